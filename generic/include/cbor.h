@@ -184,6 +184,7 @@ typedef enum CborError {
     /* encoder errors */
     CborErrorTooManyItems = 768,
     CborErrorTooFewItems,
+    CborErrorFragmented,            /* budgeted encoding : the rest must go in the next fragment */
 
     /* internal implementation errors */
     CborErrorDataTooLarge = 1024,
@@ -216,6 +217,29 @@ typedef struct CborEncoder CborEncoder;
 
 static const size_t CborIndefiniteLength = SIZE_MAX;
 
+/* Flags for cbor_encoder_init() (above the CborIteratorFlags, which containers also keep in flags) */
+enum CborEncoderFlags
+{
+    CborEncoderFlag_Budgeted        = 0x100,    /* size is a hard budget (eg the UL payload size for the DR) */
+    CborEncoderFlag_Fragmented      = 0x200     /* internal : a high priority field did not fit */
+};
+
+typedef enum CborFieldPriority {
+    CborFieldPriorityHigh = 0,
+    CborFieldPriorityLow
+} CborFieldPriority;
+
+/* Start of a field, to drop it (or cut the encoding before it) if it does not fit in the budget */
+struct CborEncoderField
+{
+    uint8_t *ptr;
+    const uint8_t *end;
+    size_t remaining;
+    int flags;
+    CborFieldPriority priority;
+};
+typedef struct CborEncoderField CborEncoderField;
+
 CBOR_API void cbor_encoder_init(CborEncoder *encoder, uint8_t *buffer, size_t size, int flags);
 CBOR_API CborError cbor_encode_uint(CborEncoder *encoder, uint64_t value);
 CBOR_API CborError cbor_encode_int(CborEncoder *encoder, int64_t value);
@@ -247,6 +271,15 @@ CBOR_API CborError cbor_encoder_create_map(CborEncoder *encoder, CborEncoder *ma
 CBOR_API CborError cbor_encoder_close_container(CborEncoder *encoder, const CborEncoder *containerEncoder);
 CBOR_API CborError cbor_encoder_close_container_checked(CborEncoder *encoder, const CborEncoder *containerEncoder);
 
+CBOR_API void cbor_encoder_begin_field(CborEncoder *encoder, CborEncoderField *field, CborFieldPriority priority);
+CBOR_API CborError cbor_encoder_end_field(CborEncoder *encoder, const CborEncoderField *field);
+CBOR_API CborError cbor_encoder_finish(CborEncoder *encoder);
+
+CBOR_INLINE_API bool cbor_encoder_is_fragmented(const CborEncoder *encoder)
+{
+    return (encoder->flags & CborEncoderFlag_Fragmented) != 0;
+}
+
 CBOR_INLINE_API uint8_t *_cbor_encoder_get_buffer_pointer(const CborEncoder *encoder)
 {
     return encoder->data.ptr;
@@ -453,6 +486,8 @@ CBOR_INLINE_API CborError cbor_value_dup_byte_string(const CborValue *value, uin
     return _cbor_value_dup_string(value, (void **)buffer, buflen, next);
 }
 
+CBOR_API CborError cbor_value_get_string_ptr(const CborValue *value, const uint8_t **ptr, size_t *length);
+
 CBOR_API CborError cbor_value_text_string_equals(const CborValue *value, const char *string, bool *result);
 
 /* Maps and arrays */
@@ -84,6 +84,22 @@ ALTI_Error_t ALTI_readPressure(int32_t *pressure);
  */
 ALTI_Error_t ALTI_readTemperature(int16_t *temperature);
 
+/*!
+ * @brief   Put altimeter in low power continuous sampling at low rate, buffering samples in its FIFO
+ *          (ALTI_activate/ALTI_sleep leave this mode)
+ * @param   void
+ * @return  ALTI_SUCCESS on success, ALTI_ERROR otherwise
+ */
+ALTI_Error_t ALTI_startFifo(void);
+/*!
+ * @brief       Empty the FIFO in a single bus transaction, giving the average of its samples
+ * @param[OUT]  Pointer to where average pressure will be written
+ * @param[OUT]  Pointer to where average temperature will be written
+ * @param[OUT]  Pointer to where number of samples read will be written (0 -> outputs not set)
+ * @return      ALTI_SUCCESS on success, ALTI_ERROR otherwise
+ */
+ALTI_Error_t ALTI_readFifo(int32_t *pressure, int16_t *temperature, uint8_t *nbSamples);
+
 
 #ifdef __cplusplus
 }
@@ -80,6 +80,35 @@ ACC_Error_t ACC_HasDetectedMoved(bool *hasDetectedMove);
  */
 ACC_Error_t ACC_HasDetectedFreeFallOrShock(bool *hasDetectedMove);
 
+/*!
+ * @brief       Get (and clear) both the moved and the fall/shock detection states in one device access
+ * @param[OUT]  Pointer to where moved state will be written
+ * @param[OUT]  Pointer to where fall/shock state will be written
+ * @return      ACC_SUCCESS or ACC_ERROR
+ */
+ACC_Error_t ACC_readIntSources(bool* hasDetectedMove, bool* hasDetectedFallOrShock);
+
+/*!
+ * @brief     Enable accelerometer fifo, keeping the newest samples, and signal on INT1 when it reaches the watermark
+ *            NOTE : while the fifo is enabled, ACC_readXYZ() takes its oldest sample
+ * @param[IN] Watermark level (in samples, max 31)
+ * @return    ACC_SUCCESS or ACC_ERROR
+ */
+ACC_Error_t ACC_startFifo(uint8_t wtm);
+/*!
+ * @brief     Disable accelerometer fifo
+ * @return    ACC_SUCCESS or ACC_ERROR
+ */
+ACC_Error_t ACC_stopFifo();
+/*!
+ * @brief       Empty the fifo in one device access
+ * @param[OUT]  Array of 3*maxSamples where x,y,z of each sample are written, oldest first
+ * @param[IN]   Max samples to read
+ * @param[OUT]  Number of samples read
+ * @return      ACC_SUCCESS or ACC_ERROR
+ */
+ACC_Error_t ACC_readFifo(int8_t* xyz, uint8_t maxSamples, uint8_t* nbSamples);
+
 /*!
  * @brief     Set detection mode of accelerometer
  * @param[IN] Threshold used to detect a shock or free fall, units are 16mg (because full scale is 2g, depends on implementation)
@@ -46,6 +46,13 @@ uint8_t CFMgr_getElementLen(uint16_t key);
 bool CFMgr_setElement(uint16_t key, void* data, uint8_t len);
 bool CFMgr_resetElement(uint16_t key);
 void CFMgr_iterateKeys(int keymodule, CFG_CBFN_t cb, void* cbctx);
+/*
+ * Set elements from a CBOR map of {integer key : value} (eg a config DL), in one pass directly from the buffer.
+ * Only existing keys are set : integers are stored in the element's length (range checked), booleans in 1 byte,
+ * byte/text strings as is (length must match), and null resets the element. Other keys or values are skipped.
+ * Returns the number of elements set (up to the first malformed item), or -1 if data is not a CBOR map
+ */
+int CFMgr_setElementsFromCBOR(uint8_t* data, uint8_t sz);
 
 // Define module ids here as unique values 1-255. Module 0 is for basic untilites (who can manage their keys between them..)
 // NEVER REDEFINE A VALUE UNLESS OK TO CLEAR DEVICE CONFIG AFTER UPGRADE
@@ -71,6 +78,9 @@ void CFMgr_iterateKeys(int keymodule, CFG_CBFN_t cb, void* cbctx);
 
 #define CFG_UTIL_KEY_REBOOT_TIME                 CFGKEY(CFG_MODULE_UTIL, 9)
 
+// Sensor manager change detection rule per sensor channel (10-19 reserved)
+#define CFG_UTIL_KEY_SR_RULE(__ch)               CFGKEY(CFG_MODULE_UTIL, (10+(__ch)))
+
 #ifdef __cplusplus
 }
 #endif
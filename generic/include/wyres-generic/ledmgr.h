@@ -23,17 +23,43 @@ extern "C" {
 // ledmgr allows multi module access to N LEDs, which can be flashed in a 2 second repeating pattern specified by a 20 character string.
 // Each '1' means on, and '0' is off for 100ms. Configuration of the pattern length and slice time can be changed using the defines.
 // A pattern is requested for a specific LED for a specific time, and can also be cancelled before the end of the requested duration.
+// Patterns can also be precompiled (LED_PATTERN()) with their own length and slice time, and requested with a priority : each
+// LED has a small queue (LED_QUEUE_SZ) so that requests from different modules are not lost.
 // api
 // values for the pri parameter to either queue the request or override the current one
 typedef enum { LED_REQ_ENQUEUE, LED_REQ_INTERUPT} LED_PRI;
+// priorities for ledRequestPattern() : string based requests use LED_PRIO_NORMAL
+#define LED_PRIO_LOW    (0)
+#define LED_PRIO_NORMAL (1)
+#define LED_PRIO_HIGH   (2)
+
+// A precompiled pattern of 'len' slices (max 32) each of 'sliceMS' : the led is on during slice n if bit n of 'bits' is set
+typedef struct {
+    uint32_t bits;
+    uint8_t len;
+    uint16_t sliceMS;
+} LED_PATTERN_t;
+// Build the bitmap at compile time from a string of up to 32 '1'/'0' chars (same format as the string patterns)
+#define _LED_BIT(__s, __i) ((((__i)<(sizeof(__s)-1)) && ((__s)[((__i)<(sizeof(__s)-1))?(__i):0]=='1'))?(1ul<<(__i)):0)
+#define LED_BITMAP(__s) ( \
+    _LED_BIT(__s,0)|_LED_BIT(__s,1)|_LED_BIT(__s,2)|_LED_BIT(__s,3)|_LED_BIT(__s,4)|_LED_BIT(__s,5)|_LED_BIT(__s,6)|_LED_BIT(__s,7)| \
+    _LED_BIT(__s,8)|_LED_BIT(__s,9)|_LED_BIT(__s,10)|_LED_BIT(__s,11)|_LED_BIT(__s,12)|_LED_BIT(__s,13)|_LED_BIT(__s,14)|_LED_BIT(__s,15)| \
+    _LED_BIT(__s,16)|_LED_BIT(__s,17)|_LED_BIT(__s,18)|_LED_BIT(__s,19)|_LED_BIT(__s,20)|_LED_BIT(__s,21)|_LED_BIT(__s,22)|_LED_BIT(__s,23)| \
+    _LED_BIT(__s,24)|_LED_BIT(__s,25)|_LED_BIT(__s,26)|_LED_BIT(__s,27)|_LED_BIT(__s,28)|_LED_BIT(__s,29)|_LED_BIT(__s,30)|_LED_BIT(__s,31) )
+#define LED_PATTERN(__s, __sliceMS) { .bits=LED_BITMAP(__s), .len=(sizeof(__s)-1), .sliceMS=(__sliceMS) }
 
 // Request for the given LED 'gpio' to flash 'pattern', for 'dur' seconds, either interuppting the current request (if any) or enqueuing behind it
 // Returns true if the request was accepted, or false if the queue was full.
 bool ledRequest(int8_t gpio, const char* pattern, uint32_t dur, LED_PRI pri);
+// Request a precompiled pattern, with a priority (higher preempts lower, which resumes after). If maxWaitSecs>0 the request is
+// dropped if it is still queued after that time. Returns false if the queue was full of requests of higher or equal priority.
+bool ledRequestPattern(int8_t gpio, const LED_PATTERN_t* pattern, uint32_t dur, uint8_t prio, uint32_t maxWaitSecs);
 // execute led pattern immediate (interupting any executing currently)
 bool ledStart(int8_t gpio, const char* pattern, uint32_t dur);
 // Cancel the current pattern flashing on the given gpio (if another is queued behind it, it becomes the current one)
 void ledCancel(int8_t gpio);
+// Number of times the led task has woken up to change led states (for checking power use of patterns)
+uint32_t ledGetWakeups();
 
 // Some common flash patterns
 #define FLASH_MIN  ("10000000000000000000")       
@@ -42,6 +68,13 @@ void ledCancel(int8_t gpio);
 #define FLASH_2HZ ("11000110001100011000")
 #define FLASH_5HZ ("10101010101010101010")
 #define FLASH_ON  ("11111111111111111111")       
+// and as precompiled patterns eg : static const LED_PATTERN_t blink = LED_PAT_FLASH_1HZ;
+#define LED_PAT_FLASH_MIN   LED_PATTERN("10000000000000000000", 100)
+#define LED_PAT_FLASH_05HZ  LED_PATTERN("10", 1000)
+#define LED_PAT_FLASH_1HZ   LED_PATTERN("10", 500)
+#define LED_PAT_FLASH_2HZ   LED_PATTERN("1100011000", 100)
+#define LED_PAT_FLASH_5HZ   LED_PATTERN("10", 100)
+#define LED_PAT_FLASH_ON    LED_PATTERN("1", 1000)
 
 
 #ifdef __cplusplus
@@ -36,6 +36,9 @@ LP_ID_t  LPMgr_register(LP_CBFN_t cb);
 // and the LPM takes the 'worst' case when doing sleeps
 // TODO should there be a way to FORCE a lp mode (override other users of LPM?)
 void LPMgr_setLPMode(LP_ID_t id, LP_MODE_t m);
+// Tell the LPM the deepest mode in which this actor's hw is unaffected by sleeping (default LP_RUN ie every sleep). Its callback
+// is then only called when entering/leaving a sleep deeper than this, which avoids useless work in the idle hook.
+void LPMgr_setCBMode(LP_ID_t id, LP_MODE_t m);
 // if OS wraps the enter/exit of sleep mode
 int LPMgr_getMode();
 int LPMgr_entersleep();
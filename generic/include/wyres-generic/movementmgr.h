@@ -20,17 +20,32 @@ extern "C" {
 #endif
 
 typedef enum { UPRIGHT, INVERTED, FLAT_BACK, FLAT_FACE, UNKNOWN} MM_ORIENT;
+typedef enum { MM_ACT_UNKNOWN, MM_ACT_STILL, MM_ACT_WALKING, MM_ACT_VEHICLE, MM_ACT_HANDLING } MM_ACTIVITY_t;
+// Features of a batch of accelero samples, on the magnitude of the acceleration (in accelero units)
+typedef struct {
+    uint8_t n;              // number of samples
+    int32_t mean;
+    uint32_t var;
+    uint16_t peak;          // max distance from mean
+    uint16_t zcFreqdHz;     // frequency of mean crossings, in 1/10 Hz
+} MM_FEATURES_t;
 typedef void (*MM_CBFN_t)(void);
 /** Wake accelero for operation. Should be called before accessing data to ensure get fresh data */
 bool MMMgr_start();
 /** put accelero into lowest power mode compatible with being able to detect basic movement */
 bool MMMgr_stop();
 // Refresh values. returns false if hw cannot be accessed. Rgistered callbacks may be called during this function.
+// If the accelero interrupt lines are wired (ACC_INT1_GPIO/ACC_INT2_GPIO syscfg) this is also done on each interrupt, 
+// so callbacks are called as events happen without needing to poll.
 bool MMMgr_check();
 // Register a callback for when movement detected
 bool MMMgr_registerMovementCB(MM_CBFN_t cb);
+// Register a callback for when free fall or shock (depending on detection mode) detected
+bool MMMgr_registerFallShockCB(MM_CBFN_t cb);
 // Register a callback for when orientation change detected
 bool MMMgr_registerOrientationCB(MM_CBFN_t cb);
+// Register a callback for when activity classification changes (MM_ACTIVITY syscfg must be set)
+bool MMMgr_registerActivityCB(MM_CBFN_t cb);
 
 /** data accessors. Note that accessor fns do not read from device : call MMMgr_check() to update data. */
 // Last time a "movement" was detected
@@ -46,6 +61,10 @@ bool MMMgr_hasShockedSince(uint32_t reltimeSecs);
 // Last time orientation changed to new value
 uint32_t MMMgr_getLastOrientTime();
 MM_ORIENT MMMgr_getOrientation();
+// Activity from the last fifo batch while active. Features of that batch are copied to f if not NULL.
+MM_ACTIVITY_t MMMgr_getActivity(MM_FEATURES_t* f);
+// Classify a batch of n samples (x,y,z interleaved) taken at sampleHz, filling its features in f
+MM_ACTIVITY_t MMMgr_classifyBatch(const int8_t* xyz, uint8_t n, uint8_t sampleHz, MM_FEATURES_t* f);
 // in units of 1/16g, xyz values
 void MMMgr_getXYZ(int8_t* xp, int8_t* yp, int8_t* zp);
 
@@ -38,6 +38,25 @@ bool PWM_addPWM(int8_t gpio, int freq, int duty, int durationMS);
 // flush current queue for the given pin
 void PWM_flush(int8_t gpio);
 
+// Precompiled melodies : each note is a semitone index and a duration in 1/16ths of a crotchet, built at compile time from the
+// same note/qualifier/duration chars as PWM_play() eg static const PWM_NOTE_t tune[] = { PWM_NOTE('C','-','c'), PWM_NOTE('a','#','q') };
+typedef struct {
+    uint8_t note;
+    uint8_t dur;
+} PWM_NOTE_t;
+#define PWM_SILENCE     (0xFF)
+#define PWM_NB_NOTES    (25)
+// semitone offset of each note from A (uppercase = octave 3 except C-G which are above middle C, lowercase = 1 octave higher)
+#define _PWM_SEMI(__n) (((__n)=='A'||(__n)=='a')?0:((__n)=='B'||(__n)=='b')?2:((__n)=='C'||(__n)=='c')?3:((__n)=='D'||(__n)=='d')?5: \
+                        ((__n)=='E'||(__n)=='e')?7:((__n)=='F'||(__n)=='f')?8:((__n)=='G'||(__n)=='g')?10:0)
+#define PWM_NOTEIDX(__n, __m) (((__n)=='S') ? PWM_SILENCE : \
+                        (uint8_t)(1 + _PWM_SEMI(__n) + (((__n)>='a')?12:0) + (((__m)=='#')?1:((__m)=='_')?-1:0)))
+#define PWM_DURUNITS(__d) (((__d)=='m')?32:((__d)=='c')?16:((__d)=='q')?8:((__d)=='s')?4:((__d)=='d')?2:((__d)=='h')?1:16)
+#define PWM_NOTE(__n, __m, __d) { .note=PWM_NOTEIDX(__n, __m), .dur=PWM_DURUNITS(__d) }
+// Add a precompiled melody of nbNotes to the queue for the given pin at the given beat (crotchets per minute). Returns false if
+// the queue does not have space for it.
+bool PWM_playMelody(int8_t gpio, const PWM_NOTE_t* melody, int nbNotes, int beat);
+
 #ifdef __cplusplus
 }
 #endif
@@ -14,6 +14,7 @@
 #define H_SENSORMGR_H
 
 #include <inttypes.h>
+#include "wyres-generic/sm_exec.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -28,6 +29,49 @@ typedef void (*SR_NOISE_CBFN_t)(void* ctx, int noiseFreq, int noiseDBm);
 
 typedef enum { DARK, INTERIER, DAYLIGHT } LIGHT_STATE_t;
 
+// Sensor channels for acquisition config
+typedef enum { SR_CHAN_BATT, SR_CHAN_LIGHT, SR_CHAN_ADC1, SR_CHAN_ADC2, SR_CHAN_PRESSURE, SR_CHAN_TEMP, SR_CHAN_HUMIDITY, SR_NB_CHANS } SR_CHAN_t;
+typedef enum { SR_FILTER_NONE, SR_FILTER_EWMA, SR_FILTER_MEDIAN3 } SR_FILTER_t;
+
+// Configure acquisition of a channel : it is sampled at most every 'periodSecs' (0=on every get), each sample being the average
+// of 'oversample' raw reads (adc channels only), then filtered : EWMA with alpha=1/2^ewmaShift (max 8), or median of the last 3.
+// The i2c channels (pressure, temp, humidity) are always sampled together when any of them is due.
+// Default is period 0, no oversampling, no filter, except battery which is EWMA with shift 1.
+bool SRMgr_configChannel(SR_CHAN_t ch, uint32_t periodSecs, uint8_t oversample, SR_FILTER_t filter, uint8_t ewmaShift);
+
+// History of filtered samples per channel (last SR_HISTORY_SZ changes of value, at most one per second : a value holds
+// until the next sample). Timestamps in seconds since boot. Each sample gets the next sequence number of its channel, which
+// is never reused (a sample whose second ended back on the previous value is kept, with that value).
+typedef struct {
+    uint32_t ts;
+    int32_t value;
+} SR_SAMPLE_t;
+// Get min/max/mean of the samples holding during the last 'windowSecs' (0=all). Returns number of samples used (0 -> outputs not set)
+int SRMgr_getStats(SR_CHAN_t ch, uint32_t windowSecs, int32_t* min, int32_t* max, int32_t* mean);
+// Copy up to maxSamples samples from sequence number *seq on (0=oldest kept) into out, oldest first. Returns number copied,
+// and *seq is set to the sequence number to pass to continue (ie to export all in several goes, or later to get the new ones).
+int SRMgr_exportHistory(SR_CHAN_t ch, uint32_t* seq, SR_SAMPLE_t* out, int maxSamples);
+void SRMgr_clearHistory(SR_CHAN_t ch);
+
+// Change detection rules, evaluated on each new sample of the channel. One rule per channel, stored in config (key CFG_UTIL_KEY_SR_RULE(ch))
+// Channels with a rule are also sampled periodically (at their period, or SR_RULE_POLL_SECS if 0) even if the app doesn't read them.
+// DELTA     : triggers when value moved by more than threshold since last trigger
+// DELTA_PCT : same but threshold is in % of the value at last trigger
+// LEVEL     : triggers when value goes above threshold, and again when it goes back below (threshold - hysteresis)
+// RATE      : triggers when value changes by more than threshold per minute between 2 samples
+typedef enum { SR_RULE_NONE, SR_RULE_DELTA, SR_RULE_DELTA_PCT, SR_RULE_LEVEL, SR_RULE_RATE } SR_RULE_TYPE_t;
+typedef struct __attribute__((packed)) {
+    uint8_t type;               // SR_RULE_TYPE_t
+    int32_t threshold;          // in channel units (or % for DELTA_PCT, units/min for RATE)
+    int32_t hysteresis;         // LEVEL only
+} SR_RULE_t;
+typedef void (*SR_RULE_CBFN_t)(void* ctx, SR_CHAN_t ch, int32_t value);
+bool SRMgr_setRule(SR_CHAN_t ch, const SR_RULE_t* rule);
+bool SRMgr_registerRuleCB(SR_RULE_CBFN_t cb, void* c);
+void SRMgr_unregisterRuleCB(SR_RULE_CBFN_t cb);
+// Also (or instead) send event e to the state machine sm when a rule triggers, with data=channel. NULL sm to stop.
+void SRMgr_setRuleSMEvent(SM_ID_t sm, int e);
+
 /** 
  * startup sensors ready for reading. Returns true if all ok, false if hw issue
  */
@@ -0,0 +1,109 @@
+/**
+ * Copyright 2019 Wyres
+ * Licensed under the Apache License, Version 2.0 (the "License"); 
+ * you may not use this file except in compliance with the License. 
+ * You may obtain a copy of the License at
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, 
+ * software distributed under the License is distributed on 
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, 
+ * either express or implied. See the License for the specific 
+ * language governing permissions and limitations under the License.
+*/
+#ifndef H_TELEMPACK_H
+#define H_TELEMPACK_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Compact bit packed codec for periodic telemetry (gps positions, sensor readings, beacon lists...), for when the per
+ * field overhead of CBOR is too much for the UL size (eg 51 bytes at SF12).
+ * A schema gives the fields of a record and their width in bits. A frame (one UL) holds as many records as fit:
+ *  - each record is sent as deltas from the previous one in the frame
+ *  - the first one is sent as deltas from the last record of the last ACKed frame (or with absolute values if none)
+ *  - a delta is a single 0 bit if the field did not change, else a 1 bit then its zig-zag varint (groups of 4 bits)
+ * The frame header (16 bits) is : seq (4 bits) | has ref (1) | ref seq (4) | number of records (7).
+ * This file has no OS dependancies, so the decoder can be built in the backend (or host tests) from the same sources.
+ */
+
+// Max fields per record (can be set by the host build)
+#ifndef TELEMPACK_MAX_FIELDS
+#define TELEMPACK_MAX_FIELDS    (16)
+#endif
+// Frame seqs remembered by the decoder : a frame can only reference one of the last 15 frames
+#define TELEMPACK_NB_SEQS       (16)
+#define TELEMPACK_MAX_RECORDS   (127)
+
+typedef enum { TELEMPACK_UINT, TELEMPACK_INT } TelemPackType;
+typedef enum {
+    TelemPackNoError = 0,
+    TelemPackErrorFull = -1,        // the record did not fit in the frame (and was removed) : send this one and start another
+    TelemPackErrorRange = -2,       // value does not fit in the field width
+    TelemPackErrorFormat = -3,      // (decoder) truncated or corrupt frame
+    TelemPackErrorUnknownRef = -4,  // (decoder) frame is deltas from a frame that was not decoded
+    TelemPackErrorNoSpace = -5,     // (decoder) more records than the caller can take
+} TelemPackError;
+
+typedef struct {
+    uint8_t type;       // TelemPackType
+    uint8_t bits;       // 1-32
+} TelemPackField;
+
+typedef struct {
+    const TelemPackField* fields;
+    uint8_t nFields;
+    uint8_t* buf;
+    uint16_t maxBits;
+    uint16_t bitPos;
+    uint16_t recStart;          // bitPos at the start of the record being encoded
+    uint8_t field;              // next field of the record being encoded
+    uint8_t nRecords;
+    uint8_t seq;                // seq of the frame being encoded
+    uint8_t delta;              // record is encoded as deltas from prev
+    uint8_t full;
+    uint8_t hasRef;
+    uint8_t refSeq;
+    uint8_t sinceAck;           // frames finished since the ACKed one
+    uint8_t sentSeq;
+    uint32_t cur[TELEMPACK_MAX_FIELDS];     // record being encoded
+    uint32_t prev[TELEMPACK_MAX_FIELDS];    // previous record in the frame (or the reference)
+    uint32_t ref[TELEMPACK_MAX_FIELDS];     // last record of the last ACKed frame
+    uint32_t sent[TELEMPACK_MAX_FIELDS];    // last record of the last finished frame
+} TelemPackEncoder;
+
+typedef struct {
+    const TelemPackField* fields;
+    uint8_t nFields;
+    uint16_t seqValid;          // bit per seq : hist[seq] is set
+    uint32_t hist[TELEMPACK_NB_SEQS][TELEMPACK_MAX_FIELDS];    // last record of each decoded frame
+} TelemPackDecoder;
+
+// Encoder : init once per schema (the fields array must stay valid), then for each UL start a frame, encode the field
+// values of each record in the schema order, and finish it. Returns false if the schema is not valid
+bool telempack_encoder_init(TelemPackEncoder* e, const TelemPackField* fields, uint8_t nFields);
+void telempack_frame_start(TelemPackEncoder* e, uint8_t* buf, uint8_t size);
+// Encode the next field of the current record (either call can be used for either type, the value is range checked)
+TelemPackError telempack_encode_uint(TelemPackEncoder* e, uint32_t value);
+TelemPackError telempack_encode_int(TelemPackEncoder* e, int32_t value);
+// Number of complete records in the frame
+uint8_t telempack_frame_records(const TelemPackEncoder* e);
+// Write the header and return the frame size in bytes (0 if no complete record : nothing to send). A partial record is dropped.
+uint8_t telempack_frame_finish(TelemPackEncoder* e);
+// The UL with the last finished frame was ACKed (or a DL came in its RX windows) : the next frames can be deltas from it
+void telempack_frame_acked(TelemPackEncoder* e);
+
+// Decoder : one per device and schema. Decode a frame into records (nFields values per record, INT fields sign extended)
+// Returns the number of records, or a TelemPackError
+bool telempack_decoder_init(TelemPackDecoder* d, const TelemPackField* fields, uint8_t nFields);
+int telempack_decode(TelemPackDecoder* d, const uint8_t* data, uint16_t sz, int32_t* records, int maxRecords);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* H_TELEMPACK_H */
@@ -35,6 +35,35 @@ void wconsole_start(uint8_t ncmds, ATCMD_DEF_t* cmds, uint32_t idleTimeoutS);
 void wconsole_stop();
 bool wconsole_isInit();
 bool wconsole_isActive();
+// Output for commands that is longer than a line (config or trace dumps...) : these wait for space in the uart tx buffer
+// rather than dropping output, so they block the calling task (the default task for commands) while the uart catches up.
+bool wconsole_print(const char* l, ...);
+bool wconsole_write(const uint8_t* data, uint32_t sz);
+
+/*
+ * Binary bulk transfer mode (syscfg WCONSOLE_BULK), for config dump/restore and diagnostics export (see tools/wconsole_bulk.py).
+ * Add wconsole_bulkModeCmd to the app's command table (eg as "AT+BULK"). After its "OK" the console takes frames instead of lines:
+ *   COBS(type, seq, payload, crc16) then 0x00. crc16 is CRC-16/CCITT-FALSE of type..payload, and all values are little endian.
+ * Each request gets its responses with the same seq. A frame that fails the crc gets a NAK with seq 0.
+ */
+#define BULK_VERSION (1)
+enum {
+    BULK_CMD_PING = 0x01,       // -> ACK [version]
+    BULK_CMD_CFG_DUMP = 0x02,   // [module (optional)] -> CFG_ELEM for each key, then END [nb keys:2]
+    BULK_CMD_CFG_SET = 0x03,    // [key:2][len][offset][data] (one element, in chunks, in order, same key/len) -> ACK|NAK per chunk
+    BULK_CMD_CRASH = 0x04,      // -> CRASH [reset reason code:2][last 8 reasons][assert fn:4][last 8 logged fns:4 each]
+    BULK_CMD_HISTORY = 0x05,    // [sensor chan][from seq:4 (0=oldest)] -> SAMPLES [chan][n][seq of 1st:4][(ts:4, value:4) x n] ...,
+                                // then END [nb:2][next seq:4] (to ask from next time for the new samples only)
+    BULK_CMD_EXIT = 0x7F,       // -> ACK, then back to AT commands
+    BULK_RSP_ACK = 0x80,        // [cmd]
+    BULK_RSP_NAK = 0x81,        // [cmd][err]
+    BULK_RSP_CFG_ELEM = 0x82,   // [key:2][len][offset][data] : elements longer than a frame come in several
+    BULK_RSP_END = 0x83,
+    BULK_RSP_CRASH = 0x84,
+    BULK_RSP_SAMPLES = 0x85,
+};
+enum { BULK_ERR_BADFRAME = 1, BULK_ERR_BADCMD, BULK_ERR_BADARG, BULK_ERR_FAILED };
+ATRESULT wconsole_bulkModeCmd(PRINTLN_t pfn, uint8_t nargs, char* argv[]);
 
 #ifdef __cplusplus
 }
@@ -13,6 +13,8 @@
 /**
  * basic accelero interface implementation for LIS2DE12
  */
+#include <string.h>
+
 #include "os/os.h"
 #include "bsp/bsp.h"
 #include "hal/hal_i2c.h"
@@ -184,6 +186,18 @@
 #define LIS2DE_TLI_MASK 		0x7F
 // ACT_THS masks
 #define LIS2DE_ACTH_MASK 		0x7F
+// FIFO_CTRL_REG masks
+#define LIS2DE_FM_BYPASS 		0x00
+#define LIS2DE_FM_STREAM 		0x80
+#define LIS2DE_FTH_MASK 		0x1F
+// FIFO_SRC_REG masks
+#define LIS2DE_FIFO_WTM_MASK 	0x80
+#define LIS2DE_FIFO_OVRN_MASK 	0x40
+#define LIS2DE_FIFO_EMPTY_MASK 	0x20
+#define LIS2DE_FSS_MASK 		0x1F
+// FIFO depth in samples, each of 6 bytes (OUT_X_L to OUT_Z_H)
+#define LIS2DE_FIFO_DEPTH 		32
+#define LIS2DE_SAMPLE_SZ 		6
 
 typedef enum
 {
@@ -193,20 +207,31 @@ typedef enum
 LIS2DE12_Error_t;
 
 // Private internals: should be using device driver sensor but instead directly access a lis2de12 
+// MSB of sub-address enables address auto-increment for multi-byte accesses
+#define LIS2DE_AUTO_INC         0x80
+// Max registers written in one go
+#define LIS2DE_MAX_WRITE        8
 /*!
- * @brief     Accelerometer rewrited register
- * @param[IN] Register address
- * @param[IN] Data to be written to internal register
+ * @brief     Accelerometer write consecutive registers in one transaction
+ * @param[IN] First register address
+ * @param[IN] Number of registers to write (max LIS2DE_MAX_WRITE)
+ * @param[IN] Data to be written to internal registers
  * @return    LIS2DE12_OK, LIS2DE12_ERR
  */
-static LIS2DE12_Error_t LIS2DE12_WriteReg( uint8_t addr, uint8_t data )
+static LIS2DE12_Error_t LIS2DE12_WriteRegs( uint8_t addr, uint8_t n, const uint8_t* data )
 {
-    // For write, first the register address and then the actual value
-    uint8_t i2c_data[2] = { addr, data};
+    // For write, first the register address and then the actual values
+    uint8_t i2c_data[LIS2DE_MAX_WRITE+1];
+    if (n==0 || n>LIS2DE_MAX_WRITE) 
+    {
+        return LIS2DE12_ERR;
+    }
+    i2c_data[0] = (n>1 ? (addr | LIS2DE_AUTO_INC) : addr);
+    memcpy(&i2c_data[1], data, n);
     struct hal_i2c_master_data mdata = {
         .address = ACCELERO_I2C_ADDR,
         .buffer = i2c_data,
-        .len = 2,
+        .len = n+1,
     };
     int rc = hal_i2c_master_write(ACCELERO_I2C_CHAN, &mdata, I2C_ACCESS_TIMEOUT, 1);
     if (rc==0) 
@@ -220,17 +245,19 @@ static LIS2DE12_Error_t LIS2DE12_WriteReg( uint8_t addr, uint8_t data )
     }
 }
 /*!
- * @brief      Accelerometer read register
- * @param[IN]  Register address
- * @param[OUT] Data to be written
+ * @brief      Accelerometer read consecutive registers in one transaction
+ * @param[IN]  First register address
+ * @param[IN]  Number of registers to read
+ * @param[OUT] Data read
  * @return     LIS2DE12_OK, LIS2DE12_ERR
  */
-static LIS2DE12_Error_t LIS2DE12_ReadReg( uint8_t addr, uint8_t *data )
+static LIS2DE12_Error_t LIS2DE12_ReadRegs( uint8_t addr, uint8_t n, uint8_t *data )
 {
     // For read, first write the register address, then read the data
+    uint8_t subaddr = (n>1 ? (addr | LIS2DE_AUTO_INC) : addr);
     struct hal_i2c_master_data mdata = {
         .address = ACCELERO_I2C_ADDR,
-        .buffer = &addr,
+        .buffer = &subaddr,
         .len = 1,
     };
     // Write reg address
@@ -238,6 +265,7 @@ static LIS2DE12_Error_t LIS2DE12_ReadReg( uint8_t addr, uint8_t *data )
     if (rc==0) 
     {
         mdata.buffer = data;    // read the data now
+        mdata.len = n;
         rc = hal_i2c_master_read(ACCELERO_I2C_CHAN, &mdata, I2C_ACCESS_TIMEOUT, 1);
     }
     if (rc==0) 
@@ -251,10 +279,17 @@ static LIS2DE12_Error_t LIS2DE12_ReadReg( uint8_t addr, uint8_t *data )
     }
 
 }
+static LIS2DE12_Error_t LIS2DE12_WriteReg( uint8_t addr, uint8_t data )
+{
+    return LIS2DE12_WriteRegs(addr, 1, &data);
+}
+static LIS2DE12_Error_t LIS2DE12_ReadReg( uint8_t addr, uint8_t *data )
+{
+    return LIS2DE12_ReadRegs(addr, 1, data);
+}
 
 // interface to accelero - rewrite to use sensor device driver?
 ACC_Error_t ACC_init() {
-    uint8_t data = 0;
     uint8_t Rx = 0;
 
     // Read its id to check its the right device
@@ -269,109 +304,186 @@ ACC_Error_t ACC_init() {
         return ACC_ERROR;
     }
 
-    data = (LIS2DE_XYZ_EN_MASK | LIS2DE_LPEN_MASK | LIS2DE_TEN_HZ_MASK);
-    if (LIS2DE12_WriteReg(LIS2DE_CTRL_REG1, data) != LIS2DE12_OK)
+    // CTRL_REG1 to CTRL_REG6 in one go
+    const uint8_t ctrl[6] = {
+        (LIS2DE_XYZ_EN_MASK | LIS2DE_LPEN_MASK | LIS2DE_TEN_HZ_MASK),
+        (LIS2DE_HPIS1_MASK | LIS2DE_HPIS2_MASK),
+        LIS2DE_I1_AOI1,
+        0x00,        // continuous update, full scale +/-2g, self test disabled, SPI 4 wire
+        (LIS2DE_LIR_INT1_MASK | LIS2DE_LIR_INT2_MASK),
+        (LIS2DE_I2C_INT2_MASK | LIS2DE_P2_ACT_MASK),
+    };
+    if (LIS2DE12_WriteRegs(LIS2DE_CTRL_REG1, sizeof(ctrl), ctrl) != LIS2DE12_OK)
     {
         return ACC_ERROR;
     }
 
-    data = (LIS2DE_HPIS1_MASK | LIS2DE_HPIS2_MASK);
-    if(LIS2DE12_WriteReg(LIS2DE_CTRL_REG2, data) != LIS2DE12_OK)
+    // MOTION DETECTION SETUP : INT1_THS and INT1_DURATION
+    const uint8_t int1[2] = { 0x02, 0x02 };
+    if(LIS2DE12_WriteRegs(LIS2DE_INT1_THS, sizeof(int1), int1) != LIS2DE12_OK)
     {
         return ACC_ERROR;
     }
 
-    data = LIS2DE_I1_AOI1;
-    if(LIS2DE12_WriteReg(LIS2DE_CTRL_REG3, data) != LIS2DE12_OK)
+    // Not in same block as THS/DURATION as INT1_SOURCE between them is read only
+    if(LIS2DE12_WriteReg(LIS2DE_INT1_CFG, (LIS2DE_ZHIE_MASK | LIS2DE_YHIE_MASK | LIS2DE_XHIE_MASK)) != LIS2DE12_OK)
     {
         return ACC_ERROR;
     }
 
-    data = 0x00;        // continuous update, full scale +/-2g, self test disabled, SPI 4 wire
-    if(LIS2DE12_WriteReg(LIS2DE_CTRL_REG4, data) != LIS2DE12_OK)
+    // Clear IT sources by reading them
+    bool moved, fall;
+    if (ACC_readIntSources(&moved, &fall) != ACC_SUCCESS)
     {
         return ACC_ERROR;
     }
+    return ACC_SUCCESS;
+}
 
-    data = (LIS2DE_LIR_INT1_MASK | LIS2DE_LIR_INT2_MASK);
-    if(LIS2DE12_WriteReg(LIS2DE_CTRL_REG5, data) != LIS2DE12_OK)
+ACC_Error_t ACC_activate() {
+    //XYZ enabled, 10Hz frequency, low power mode enabled
+    if (LIS2DE12_WriteReg(LIS2DE_CTRL_REG1, (LIS2DE_XYZ_EN_MASK | LIS2DE_TEN_HZ_MASK)) != LIS2DE12_OK)
     {
         return ACC_ERROR;
     }
+    return ACC_SUCCESS;
+}
 
-    data = (LIS2DE_I2C_INT2_MASK | LIS2DE_P2_ACT_MASK);
-    if(LIS2DE12_WriteReg(LIS2DE_CTRL_REG6, data) != LIS2DE12_OK)
+ACC_Error_t ACC_sleep() {
+    //Leave XYZ enabled, 10Hz frequency
+    if (LIS2DE12_WriteReg(LIS2DE_CTRL_REG1, (LIS2DE_XYZ_EN_MASK | LIS2DE_ONE_HZ_MASK)) != LIS2DE12_OK)
     {
         return ACC_ERROR;
     }
+    return ACC_SUCCESS;
+}
+// Static as too big for caller stacks
+static uint8_t _fifoBuf[LIS2DE_FIFO_DEPTH*LIS2DE_SAMPLE_SZ];
 
-    // MOTION DETECTION SETUP
-    data = 0x02; // 0x02
-    if(LIS2DE12_WriteReg(LIS2DE_INT1_THS, data) != LIS2DE12_OK)
+ACC_Error_t ACC_startFifo(uint8_t wtm) {
+    uint8_t reg;
+    // Enable fifo
+    if (LIS2DE12_ReadReg(LIS2DE_CTRL_REG5, &reg) != LIS2DE12_OK)
     {
         return ACC_ERROR;
     }
-
-    data = 0x02; // 0x03
-    if(LIS2DE12_WriteReg(LIS2DE_INT1_DURATION, data) != LIS2DE12_OK)
+    if (LIS2DE12_WriteReg(LIS2DE_CTRL_REG5, reg | LIS2DE_FIFO_EN_MASK) != LIS2DE12_OK)
     {
         return ACC_ERROR;
     }
-
-    data = (LIS2DE_ZHIE_MASK | LIS2DE_YHIE_MASK | LIS2DE_XHIE_MASK);
-    if(LIS2DE12_WriteReg(LIS2DE_INT1_CFG, data) != LIS2DE12_OK)
+    // Stream mode (keep newest) with watermark level
+    if (LIS2DE12_WriteReg(LIS2DE_FIFO_CTRL_REG, LIS2DE_FM_STREAM | (wtm & LIS2DE_FTH_MASK)) != LIS2DE12_OK)
     {
         return ACC_ERROR;
     }
-
-    // Clear IT sources by reading them
-    if (LIS2DE12_ReadReg(LIS2DE_INT1_SOURCE, &Rx) != LIS2DE12_OK)
+    // Watermark signalled on INT1 as well as whatever is already routed there
+    if (LIS2DE12_ReadReg(LIS2DE_CTRL_REG3, &reg) != LIS2DE12_OK)
     {
         return ACC_ERROR;
     }
-    if (LIS2DE12_ReadReg(LIS2DE_INT2_SOURCE, &Rx) != LIS2DE12_OK)
+    if (LIS2DE12_WriteReg(LIS2DE_CTRL_REG3, reg | LIS2DE_I1_WTM) != LIS2DE12_OK)
     {
         return ACC_ERROR;
     }
     return ACC_SUCCESS;
 }
 
-ACC_Error_t ACC_activate() {
-    //XYZ enabled, 10Hz frequency, low power mode enabled
-    if (LIS2DE12_WriteReg(LIS2DE_CTRL_REG1, (LIS2DE_XYZ_EN_MASK | LIS2DE_TEN_HZ_MASK)) != LIS2DE12_OK)
+ACC_Error_t ACC_stopFifo() {
+    uint8_t reg;
+    if (LIS2DE12_ReadReg(LIS2DE_CTRL_REG3, &reg) != LIS2DE12_OK)
+    {
+        return ACC_ERROR;
+    }
+    if (LIS2DE12_WriteReg(LIS2DE_CTRL_REG3, reg & ~LIS2DE_I1_WTM) != LIS2DE12_OK)
+    {
+        return ACC_ERROR;
+    }
+    if (LIS2DE12_WriteReg(LIS2DE_FIFO_CTRL_REG, LIS2DE_FM_BYPASS) != LIS2DE12_OK)
+    {
+        return ACC_ERROR;
+    }
+    if (LIS2DE12_ReadReg(LIS2DE_CTRL_REG5, &reg) != LIS2DE12_OK)
+    {
+        return ACC_ERROR;
+    }
+    if (LIS2DE12_WriteReg(LIS2DE_CTRL_REG5, reg & ~LIS2DE_FIFO_EN_MASK) != LIS2DE12_OK)
     {
         return ACC_ERROR;
     }
     return ACC_SUCCESS;
 }
 
-ACC_Error_t ACC_sleep() {
-    //Leave XYZ enabled, 10Hz frequency
-    if (LIS2DE12_WriteReg(LIS2DE_CTRL_REG1, (LIS2DE_XYZ_EN_MASK | LIS2DE_ONE_HZ_MASK)) != LIS2DE12_OK)
+ACC_Error_t ACC_readFifo(int8_t* xyz, uint8_t maxSamples, uint8_t* nbSamples) {
+    uint8_t src;
+    *nbSamples = 0;
+    if (LIS2DE12_ReadReg(LIS2DE_FIFO_SRC_REG, &src) != LIS2DE12_OK)
     {
         return ACC_ERROR;
     }
-    return ACC_SUCCESS;
-}
-ACC_Error_t ACC_readXYZ(int8_t* xp, int8_t* yp, int8_t* zp) {
-    ACC_Error_t res = ACC_SUCCESS;
-    // X axis
-    if (LIS2DE12_ReadReg(LIS2DE_OUT_X, (uint8_t*)xp) != LIS2DE12_OK)
+    if (src & LIS2DE_FIFO_EMPTY_MASK)
+    {
+        return ACC_SUCCESS;
+    }
+    // FSS is 0-31 : overrun flag means it is full with 32
+    uint8_t n = (src & LIS2DE_FIFO_OVRN_MASK) ? LIS2DE_FIFO_DEPTH : (src & LIS2DE_FSS_MASK);
+    if (n > maxSamples) 
+    {
+        n = maxSamples;
+    }
+    if (n==0)
+    {
+        return ACC_SUCCESS;
+    }
+    // In fifo mode the address rolls back from OUT_Z_H to OUT_X_L, so all samples come in one read
+    if (LIS2DE12_ReadRegs(LIS2DE_OUT_X - 1, n*LIS2DE_SAMPLE_SZ, _fifoBuf) != LIS2DE12_OK)
     {
-        res = ACC_ERROR;
+        return ACC_ERROR;
     }
-    // Y axis
-    if (LIS2DE12_ReadReg(LIS2DE_OUT_Y, (uint8_t*)yp) != LIS2DE12_OK)
+    // Only the high bytes are significant
+    for(int i=0;i<n;i++) 
     {
-        res = ACC_ERROR;
+        xyz[i*3] = (int8_t)_fifoBuf[i*LIS2DE_SAMPLE_SZ+1];
+        xyz[i*3+1] = (int8_t)_fifoBuf[i*LIS2DE_SAMPLE_SZ+3];
+        xyz[i*3+2] = (int8_t)_fifoBuf[i*LIS2DE_SAMPLE_SZ+5];
     }
-    // Z axis
-    if (LIS2DE12_ReadReg(LIS2DE_OUT_Z, (uint8_t*)zp) != LIS2DE12_OK)
+    *nbSamples = n;
+    return ACC_SUCCESS;
+}
+
+ACC_Error_t ACC_readXYZ(int8_t* xp, int8_t* yp, int8_t* zp) {
+    // STATUS_REG2 to OUT_Z in one read : status, (unused low), X, (unused low), Y, (unused low), Z
+    uint8_t data[LIS2DE_OUT_Z - LIS2DE_STATUS_REG2 + 1];
+    if (LIS2DE12_ReadRegs(LIS2DE_STATUS_REG2, sizeof(data), data) != LIS2DE12_OK)
     {
-        res = ACC_ERROR;
+        return ACC_ERROR;
     }
+    *xp = (int8_t)data[LIS2DE_OUT_X - LIS2DE_STATUS_REG2];
+    *yp = (int8_t)data[LIS2DE_OUT_Y - LIS2DE_STATUS_REG2];
+    *zp = (int8_t)data[LIS2DE_OUT_Z - LIS2DE_STATUS_REG2];
+    return ACC_SUCCESS;
+}
 
-    return res;
+/*!
+ * @brief       Read and clear both interrupt sources in one transaction
+ * @param[OUT]  Pointer to where moved flag will be written
+ * @param[OUT]  Pointer to where fall/shock flag will be written
+ * @return      ACC_SUCCESS or ACC_ERROR
+ */
+ACC_Error_t ACC_readIntSources(bool* hasDetectedMove, bool* hasDetectedFallOrShock)
+{
+    // INT1_SOURCE to INT2_SOURCE (reading the cfg/ths/duration between them has no effect)
+    uint8_t data[LIS2DE_INT2_SOURCE - LIS2DE_INT1_SOURCE + 1];
+    *hasDetectedMove = false;
+    *hasDetectedFallOrShock = false;
+    if (LIS2DE12_ReadRegs(LIS2DE_INT1_SOURCE, sizeof(data), data) != LIS2DE12_OK)
+    {
+        return ACC_ERROR;
+    }
+    // read of regs clears them
+    //If IA register of INTx_SRC is SET, means that one or more detection events have occured since last check
+    *hasDetectedMove = ((data[0] & LIS2DE_INT_IA_MASK) == LIS2DE_INT_IA_MASK);
+    *hasDetectedFallOrShock = ((data[LIS2DE_INT2_SOURCE - LIS2DE_INT1_SOURCE] & LIS2DE_INT_IA_MASK) == LIS2DE_INT_IA_MASK);
+    return ACC_SUCCESS;
 }
 /*!
  * @brief       Check Pin state to know if board has moved
@@ -459,13 +571,9 @@ ACC_Error_t ACC_setDetectionMode(ACC_DetectionMode_t detectionMode, uint8_t thre
     {
         //Basic threshold can be 100
         //100 x 16mg = 1.5g
-        if(LIS2DE12_WriteReg(LIS2DE_INT2_THS, threshold) != LIS2DE12_OK)
-        {
-            return ACC_ERROR;
-        }
-
         //Duration basic value should be 6
-        if(LIS2DE12_WriteReg(LIS2DE_INT2_DURATION, duration) != LIS2DE12_OK)
+        const uint8_t int2[2] = { threshold, duration };
+        if(LIS2DE12_WriteRegs(LIS2DE_INT2_THS, sizeof(int2), int2) != LIS2DE12_OK)
         {
             return ACC_ERROR;
         }
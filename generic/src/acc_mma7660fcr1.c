@@ -63,6 +63,29 @@ ACC_Error_t ACC_HasDetectedFreeFallOrShock(bool *hasDetectedMove)
     return ACC_SUCCESS;
 }
 
+ACC_Error_t ACC_readIntSources(bool* hasDetectedMove, bool* hasDetectedFallOrShock)
+{
+    *hasDetectedMove = true;
+    *hasDetectedFallOrShock = false;
+    return ACC_SUCCESS;
+}
+
+ACC_Error_t ACC_startFifo(uint8_t wtm)
+{
+    return ACC_ERROR;
+}
+
+ACC_Error_t ACC_stopFifo()
+{
+    return ACC_SUCCESS;
+}
+
+ACC_Error_t ACC_readFifo(int8_t* xyz, uint8_t maxSamples, uint8_t* nbSamples)
+{
+    *nbSamples = 0;
+    return ACC_SUCCESS;
+}
+
 /*!
  * @brief     Check Pin state to know if board has fall
  * @param[IN] Threshold used to detect a shock or free fall (in terms of acceleration)
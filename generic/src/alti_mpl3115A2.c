@@ -67,4 +67,15 @@ ALTI_Error_t ALTI_readTemperature(int16_t *temperature)
   *temperature = 0;
     return ALTI_SUCCESS;
 }
+
+ALTI_Error_t ALTI_startFifo(void)
+{
+    return ALTI_SUCCESS;
+}
+
+ALTI_Error_t ALTI_readFifo(int32_t *pressure, int16_t *temperature, uint8_t *nbSamples)
+{
+  *nbSamples = 0;
+    return ALTI_SUCCESS;
+}
 #endif /* ALTI_MPL3115A2 */
\ No newline at end of file
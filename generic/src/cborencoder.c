@@ -197,8 +197,21 @@
 
 /**
  * Initializes a CborEncoder structure \a encoder by pointing it to buffer \a
- * buffer of size \a size. The \a flags field is currently unused and must be
- * zero.
+ * buffer of size \a size. The \a flags field is either zero or
+ * CborEncoderFlag_Budgeted.
+ *
+ * With CborEncoderFlag_Budgeted, \a size is a hard budget (typically the
+ * maximum UL payload for the current DR, as given by the lora api) and the
+ * encoding is arranged so it always ends as valid CBOR within it:
+ * \list
+ *   \li one byte is kept back for the fragment continuation marker (see
+ *       cbor_encoder_finish());
+ *   \li arrays and maps are always encoded with indefinite length, so that
+ *       fields can be dropped without rewriting the container header, and the
+ *       break byte closing each one is kept back when it is created;
+ *   \li items added between cbor_encoder_begin_field() and
+ *       cbor_encoder_end_field() are rolled back if they do not fit.
+ * \endlist
  */
 void cbor_encoder_init(CborEncoder *encoder, uint8_t *buffer, size_t size, int flags)
 {
@@ -206,6 +219,8 @@ void cbor_encoder_init(CborEncoder *encoder, uint8_t *buffer, size_t size, int f
     encoder->end = buffer + size;
     encoder->remaining = 2;
     encoder->flags = flags;
+    if ((flags & CborEncoderFlag_Budgeted) && size > 0)
+        --encoder->end;
 }
 
 static inline void put16(void *where, uint16_t v)
@@ -470,6 +485,14 @@ static CborError create_container(CborEncoder *encoder, CborEncoder *container,
     cbor_static_assert(((ArrayType << MajorTypeShift) & CborIteratorFlag_ContainerIsMap) == 0);
     container->flags = shiftedMajorType & CborIteratorFlag_ContainerIsMap;
 
+    if (encoder->flags & CborEncoderFlag_Budgeted) {
+        /* keep back the break byte, so the container can always be closed */
+        container->flags |= CborEncoderFlag_Budgeted;
+        length = CborIndefiniteLength;
+        if (container->end)
+            --container->end;
+    }
+
     if (length == CborIndefiniteLength) {
         container->flags |= CborIteratorFlag_UnknownLength;
         err = append_byte_to_buffer(container, shiftedMajorType + IndefiniteLength);
@@ -544,7 +567,17 @@ CborError cbor_encoder_close_container(CborEncoder *encoder, const CborEncoder *
         encoder->data.ptr = containerEncoder->data.ptr;
     else
         encoder->data.bytes_needed = containerEncoder->data.bytes_needed;
-    encoder->end = containerEncoder->end;
+    /* budgeted containers end before ours (their break byte) : only take their OOM state */
+    if (!(containerEncoder->flags & CborEncoderFlag_Budgeted) || !containerEncoder->end)
+        encoder->end = containerEncoder->end;
+    if (containerEncoder->flags & CborEncoderFlag_Fragmented) {
+        /* nothing more goes in after the cut, at any level */
+        CborError err = append_byte_to_buffer(encoder, BreakByte);
+        encoder->flags |= CborEncoderFlag_Fragmented;
+        if (encoder->end)
+            encoder->end = encoder->data.ptr;
+        return err;
+    }
     if (containerEncoder->flags & CborIteratorFlag_UnknownLength)
         return append_byte_to_buffer(encoder, BreakByte);
 
@@ -556,6 +589,102 @@ CborError cbor_encoder_close_container(CborEncoder *encoder, const CborEncoder *
     return CborNoError;
 }
 
+/**
+ * Marks the start of a field in \a encoder, with priority \a priority. A field
+ * is any sequence of items (a map key and its value, an array element, a
+ * nested container...) that must be sent whole or not at all. Fields may be
+ * nested. This must be paired with cbor_encoder_end_field() on the same
+ * encoder, passing the same \a field.
+ *
+ * Only budgeted encoders (see cbor_encoder_init()) act on fields, others just
+ * encode them.
+ *
+ * \sa cbor_encoder_end_field()
+ */
+void cbor_encoder_begin_field(CborEncoder *encoder, CborEncoderField *field, CborFieldPriority priority)
+{
+    field->ptr = encoder->data.ptr;
+    field->end = encoder->end;
+    field->remaining = encoder->remaining;
+    field->flags = encoder->flags;
+    field->priority = priority;
+}
+
+static void rollback_field(CborEncoder *encoder, const CborEncoderField *field)
+{
+    encoder->data.ptr = field->ptr;
+    encoder->end = field->end;
+    encoder->remaining = field->remaining;
+}
+
+/**
+ * Marks the end of the field started by cbor_encoder_begin_field() on \a
+ * encoder. For a budgeted encoder, if the field did not fit in the budget:
+ * \list
+ *   \li a low priority field is dropped and CborNoError is returned, so the
+ *       following fields can still use the remaining budget;
+ *   \li for a high priority field, the encoding is cut just before it and
+ *       CborErrorFragmented is returned: the caller should send what was
+ *       encoded, and start the next fragment with this field.
+ * \endlist
+ * Once the encoding is cut, every field added after it is dropped and returns
+ * CborErrorFragmented, and containers can still be closed normally. A field in
+ * which a nested field caused the cut is kept (up to the cut) and also returns
+ * CborErrorFragmented.
+ *
+ * For an encoder that is not budgeted, this returns CborErrorOutOfMemory if
+ * the buffer is already full, and CborNoError otherwise.
+ *
+ * \sa cbor_encoder_begin_field(), cbor_encoder_finish()
+ */
+CborError cbor_encoder_end_field(CborEncoder *encoder, const CborEncoderField *field)
+{
+    if (!(encoder->flags & CborEncoderFlag_Budgeted))
+        return encoder->end ? CborNoError : CborErrorOutOfMemory;
+
+    if (field->flags & CborEncoderFlag_Fragmented) {
+        /* started after the cut : belongs to the next fragment */
+        rollback_field(encoder, field);
+        return CborErrorFragmented;
+    }
+    if (encoder->end)
+        return (encoder->flags & CborEncoderFlag_Fragmented) ? CborErrorFragmented : CborNoError;
+
+    rollback_field(encoder, field);
+    if (field->priority == CborFieldPriorityLow)
+        return CborNoError;
+    encoder->flags |= CborEncoderFlag_Fragmented;
+    encoder->end = encoder->data.ptr;
+    return CborErrorFragmented;
+}
+
+/**
+ * Completes the encoding of the outermost encoder \a encoder, once all its
+ * containers are closed. For a budgeted encoder whose encoding was cut (see
+ * cbor_encoder_end_field()), this appends the fragment continuation marker
+ * (the \c undefined simple value) after the encoded item, in the byte kept
+ * back for it: the receiver then knows that the rest will come in the next
+ * fragment. It does nothing for other encoders.
+ *
+ * Returns CborErrorOutOfMemory if the encoding ran out of buffer outside of a
+ * field, CborNoError otherwise. Use cbor_encoder_get_buffer_size() after this
+ * to get the size to send.
+ *
+ * \sa cbor_encoder_is_fragmented()
+ */
+CborError cbor_encoder_finish(CborEncoder *encoder)
+{
+    if (!encoder->end)
+        return CborErrorOutOfMemory;
+    if ((encoder->flags & (CborEncoderFlag_Budgeted | CborEncoderFlag_Fragmented)) ==
+            (CborEncoderFlag_Budgeted | CborEncoderFlag_Fragmented)) {
+        /* the byte after end was kept back by cbor_encoder_init() */
+        *encoder->data.ptr++ = CborUndefinedType;
+        encoder->end = encoder->data.ptr;
+    }
+    return CborNoError;
+}
+
 /**
  * \fn CborError cbor_encode_boolean(CborEncoder *encoder, bool value)
  *
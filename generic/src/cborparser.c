@@ -0,0 +1,535 @@
+/****************************************************************************
+**
+** Copyright (C) 2016 Intel Corporation
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in
+** all copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+** THE SOFTWARE.
+**
+****************************************************************************/
+
+#ifndef _BSD_SOURCE
+#define _BSD_SOURCE 1
+#endif
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE 1
+#endif
+#ifndef __STDC_LIMIT_MACROS
+#  define __STDC_LIMIT_MACROS 1
+#endif
+
+#include "cbor.h"
+#include "cborinternal_p.h"
+#include "compilersupport_p.h"
+
+#include <string.h>
+
+/**
+ * \defgroup CborParsing Parsing CBOR streams
+ * \brief Group of functions used to parse CBOR streams.
+ *
+ * This is a minimal subset of the TinyCBOR parser, enough to walk a received
+ * buffer (eg a downlink) without allocating or copying anything: the
+ * CborValue iterators point directly into the buffer. It implements the
+ * iteration (cbor_value_advance(), cbor_value_enter_container()...), the
+ * integer accessors, and cbor_value_get_string_ptr() for zero-copy access to
+ * strings of known length.
+ *
+ * The string copy/dup functions, cbor_value_map_find_value(), the half float
+ * accessor, the validation and the pretty printing API are not included.
+ *
+ * The example below reads a map of integer keys to integer values.
+ *
+ * \code
+ *      CborParser parser;
+ *      CborValue it, map;
+ *      cbor_parser_init(buf, len, 0, &parser, &it);
+ *      if (cbor_value_is_map(&it) && cbor_value_enter_container(&it, &map) == CborNoError) {
+ *          while (!cbor_value_at_end(&map)) {
+ *              int key, value;
+ *              cbor_value_get_int_checked(&map, &key);
+ *              cbor_value_advance(&map);
+ *              cbor_value_get_int_checked(&map, &value);
+ *              cbor_value_advance(&map);
+ *          }
+ *          cbor_value_leave_container(&it, &map);
+ *      }
+ * \endcode
+ *
+ * Each accessor must only be used on a value of the right type (they assert
+ * on it), so check the type first.
+ */
+
+/**
+ * \addtogroup CborParsing
+ * @{
+ */
+
+static inline uint16_t get16(const uint8_t *ptr)
+{
+    uint16_t result;
+    memcpy(&result, ptr, sizeof(result));
+    return cbor_ntohs(result);
+}
+
+static inline uint32_t get32(const uint8_t *ptr)
+{
+    uint32_t result;
+    memcpy(&result, ptr, sizeof(result));
+    return cbor_ntohl(result);
+}
+
+static inline uint64_t get64(const uint8_t *ptr)
+{
+    uint64_t result;
+    memcpy(&result, ptr, sizeof(result));
+    return cbor_ntohll(result);
+}
+
+static inline bool is_fixed_type(uint8_t type)
+{
+    return type != CborTextStringType && type != CborByteStringType && type != CborArrayType &&
+           type != CborMapType;
+}
+
+CborError CBOR_INTERNAL_API_CC _cbor_value_extract_number(const uint8_t **ptr, const uint8_t *end, uint64_t *len)
+{
+    size_t bytesNeeded;
+    uint8_t additional_information = **ptr & SmallValueMask;
+    ++*ptr;
+    if (additional_information < Value8Bit) {
+        *len = additional_information;
+        return CborNoError;
+    }
+    if (unlikely(additional_information > Value64Bit))
+        return CborErrorIllegalNumber;
+
+    bytesNeeded = (size_t)(1 << (additional_information - Value8Bit));
+    if (unlikely(bytesNeeded > (size_t)(end - *ptr)))
+        return CborErrorUnexpectedEOF;
+    else if (bytesNeeded == 1)
+        *len = (uint8_t)(*ptr)[0];
+    else if (bytesNeeded == 2)
+        *len = get16(*ptr);
+    else if (bytesNeeded == 4)
+        *len = get32(*ptr);
+    else
+        *len = get64(*ptr);
+    *ptr += bytesNeeded;
+    return CborNoError;
+}
+
+static CborError preparse_value(CborValue *it)
+{
+    const CborParser *parser = it->parser;
+    uint8_t descriptor;
+    uint8_t type;
+    size_t bytesNeeded;
+
+    it->type = CborInvalidType;
+    /* are we at the end? */
+    if (it->ptr == parser->end)
+        return CborErrorUnexpectedEOF;
+
+    descriptor = *it->ptr;
+    type = descriptor & MajorTypeMask;
+    it->type = type;
+    it->flags = 0;
+    it->extra = (descriptor &= SmallValueMask);
+
+    if (descriptor > Value64Bit) {
+        if (unlikely(descriptor != IndefiniteLength))
+            return type == CborSimpleType ? CborErrorUnknownType : CborErrorIllegalNumber;
+        if (likely(!is_fixed_type(type))) {
+            /* indefinite length string, array or map */
+            it->flags |= CborIteratorFlag_UnknownLength;
+            return CborNoError;
+        }
+        return type == CborSimpleType ? CborErrorUnexpectedBreak : CborErrorIllegalNumber;
+    }
+
+    bytesNeeded = (descriptor < Value8Bit ? 0 : (1 << (descriptor - Value8Bit)));
+    if (bytesNeeded + 1 > (size_t)(parser->end - it->ptr))
+        return CborErrorUnexpectedEOF;
+
+    if (type == (NegativeIntegerType << MajorTypeShift)) {
+        it->flags |= CborIteratorFlag_NegativeInteger;
+        it->type = CborIntegerType;
+    } else if (type == CborSimpleType) {
+        switch (descriptor) {
+        case FalseValue:
+            it->extra = false;
+            it->type = CborBooleanType;
+            break;
+
+        case SinglePrecisionFloat:
+        case DoublePrecisionFloat:
+            it->flags |= CborIteratorFlag_IntegerValueTooLarge;
+            /* fall through */
+        case TrueValue:
+        case NullValue:
+        case UndefinedValue:
+        case HalfPrecisionFloat:
+            it->type = *it->ptr;
+            break;
+
+        case SimpleTypeInNextByte:
+            it->extra = (uint8_t)it->ptr[1];
+            if (unlikely(it->extra < 32)) {
+                it->type = CborInvalidType;
+                return CborErrorIllegalSimpleType;
+            }
+            break;
+
+        default:
+            /* simple value 0 to 19, in the descriptor */
+            break;
+        }
+        return CborNoError;
+    }
+
+    /* try to decode up to 16 bits */
+    if (descriptor < Value8Bit)
+        return CborNoError;
+
+    if (descriptor == Value8Bit)
+        it->extra = (uint8_t)it->ptr[1];
+    else if (descriptor == Value16Bit)
+        it->extra = get16(it->ptr + 1);
+    else
+        it->flags |= CborIteratorFlag_IntegerValueTooLarge;     /* Value32Bit or Value64Bit */
+    return CborNoError;
+}
+
+static CborError preparse_next_value_nodecrement(CborValue *it)
+{
+    if (it->remaining == UINT32_MAX && it->ptr != it->parser->end && *it->ptr == (uint8_t)BreakByte) {
+        /* end of indefinite length map or array */
+        ++it->ptr;
+        it->type = CborInvalidType;
+        it->remaining = 0;
+        return CborNoError;
+    }
+    return preparse_value(it);
+}
+
+static CborError preparse_next_value(CborValue *it)
+{
+    if (it->remaining != UINT32_MAX) {
+        /* tags don't count towards the number of items */
+        if (it->type != CborTagType && --it->remaining == 0) {
+            it->type = CborInvalidType;
+            return CborNoError;
+        }
+    }
+    return preparse_next_value_nodecrement(it);
+}
+
+static CborError advance_internal(CborValue *it)
+{
+    uint64_t length;
+    CborError err = _cbor_value_extract_number(&it->ptr, it->parser->end, &length);
+    if (err)
+        return err;
+
+    if (it->type == CborByteStringType || it->type == CborTextStringType) {
+        cbor_assert((it->flags & CborIteratorFlag_UnknownLength) == 0);
+        if (length > (uint64_t)(it->parser->end - it->ptr))
+            return CborErrorUnexpectedEOF;
+        it->ptr += length;
+    }
+    return preparse_next_value(it);
+}
+
+static CborError skip_string_chunks(CborValue *it)
+{
+    const uint8_t *ptr = it->ptr + 1;
+    const uint8_t *end = it->parser->end;
+    uint64_t length;
+
+    for (;;) {
+        CborError err;
+        if (ptr == end)
+            return CborErrorUnexpectedEOF;
+        if (*ptr == (uint8_t)BreakByte)
+            break;
+        /* chunks must be definite length strings of the same type */
+        if ((*ptr & MajorTypeMask) != it->type)
+            return CborErrorIllegalType;
+        err = _cbor_value_extract_number(&ptr, end, &length);
+        if (err)
+            return err;
+        if (length > (uint64_t)(end - ptr))
+            return CborErrorUnexpectedEOF;
+        ptr += length;
+    }
+    it->ptr = ptr + 1;
+    return preparse_next_value(it);
+}
+
+static CborError advance_recursive(CborValue *it, int nestingLevel)
+{
+    CborError err;
+    CborValue recursed;
+
+    if (is_fixed_type(it->type) || (!cbor_value_is_container(it) && cbor_value_is_length_known(it)))
+        return advance_internal(it);
+    if (!cbor_value_is_container(it))
+        return skip_string_chunks(it);
+
+    /* map or array */
+    if (nestingLevel == 0)
+        return CborErrorNestingTooDeep;
+
+    err = cbor_value_enter_container(it, &recursed);
+    if (err)
+        return err;
+    while (!cbor_value_at_end(&recursed)) {
+        err = advance_recursive(&recursed, nestingLevel - 1);
+        if (err)
+            return err;
+    }
+    return cbor_value_leave_container(it, &recursed);
+}
+
+/**
+ * Initializes the CBOR parser for parsing \a size bytes beginning at \a
+ * buffer. Parsing will use flags set in \a flags (currently unused, must be
+ * zero). The iterator to the first element is returned in \a it.
+ *
+ * The \a parser structure needs to remain valid throughout the decoding
+ * process, as must the buffer: iterators point directly into it.
+ */
+CborError cbor_parser_init(const uint8_t *buffer, size_t size, uint32_t flags, CborParser *parser, CborValue *it)
+{
+    memset(parser, 0, sizeof(*parser));
+    parser->end = buffer + size;
+    parser->flags = flags;
+    it->parser = parser;
+    it->ptr = buffer;
+    it->remaining = 1;      /* there's one type altogether, usually an array or map */
+    return preparse_value(it);
+}
+
+/**
+ * Advances the CBOR value \a it by one fixed-size position. Fixed-size types
+ * are: integers, tags, simple types (including boolean, null and undefined
+ * values) and floating point types.
+ *
+ * \sa cbor_value_at_end(), cbor_value_advance()
+ */
+CborError cbor_value_advance_fixed(CborValue *it)
+{
+    cbor_assert(it->type != CborInvalidType);
+    cbor_assert(is_fixed_type(it->type));
+    if (!it->remaining)
+        return CborErrorAdvancePastEOF;
+    return advance_internal(it);
+}
+
+/**
+ * Advances the CBOR value \a it by one element, skipping over containers.
+ * Unlike cbor_value_advance_fixed(), this function can be called on a CBOR
+ * value of any type. However, if the type is a container (map or array) or a
+ * string with a chunked payload, this function will not run in constant time
+ * and will recurse into itself (it will run on O(n) time for the number of
+ * elements or chunks and will use O(n) memory for the number of nested
+ * containers).
+ *
+ * \sa cbor_value_at_end(), cbor_value_advance_fixed()
+ */
+CborError cbor_value_advance(CborValue *it)
+{
+    cbor_assert(it->type != CborInvalidType);
+    if (!it->remaining)
+        return CborErrorAdvancePastEOF;
+    return advance_recursive(it, CBOR_PARSER_MAX_RECURSIONS);
+}
+
+/**
+ * Advances the CBOR value \a it until it no longer points to a tag. If \a it
+ * is already not pointing to a tag, then this function returns it unchanged.
+ */
+CborError cbor_value_skip_tag(CborValue *it)
+{
+    while (cbor_value_is_tag(it)) {
+        CborError err = cbor_value_advance_fixed(it);
+        if (err)
+            return err;
+    }
+    return CborNoError;
+}
+
+/**
+ * Creates a CborValue iterator pointing to the first element of the container
+ * represented by \a it and saves it in \a recursed. The \a it container object
+ * needs to be kept and passed again to cbor_value_leave_container() in order
+ * to continue iterating past this container.
+ *
+ * \sa cbor_value_is_container(), cbor_value_leave_container(), cbor_value_advance()
+ */
+CborError cbor_value_enter_container(const CborValue *it, CborValue *recursed)
+{
+    cbor_assert(cbor_value_is_container(it));
+    *recursed = *it;
+
+    if (it->flags & CborIteratorFlag_UnknownLength) {
+        recursed->remaining = UINT32_MAX;
+        ++recursed->ptr;
+    } else {
+        uint64_t len;
+        CborError err = _cbor_value_extract_number(&recursed->ptr, recursed->parser->end, &len);
+        cbor_assert(err == CborNoError);
+
+        recursed->remaining = (uint32_t)len;
+        if (recursed->remaining != len || len == UINT32_MAX ||
+                (recursed->type == CborMapType && recursed->remaining > UINT32_MAX / 2)) {
+            /* too many items */
+            recursed->ptr = it->ptr;
+            return CborErrorDataTooLarge;
+        }
+        if (recursed->type == CborMapType) {
+            /* maps have keys and values, so we need to multiply by 2 */
+            recursed->remaining *= 2;
+        }
+        if (len == 0) {
+            /* the case of the empty container */
+            recursed->type = CborInvalidType;
+            return CborNoError;
+        }
+    }
+    return preparse_next_value_nodecrement(recursed);
+}
+
+/**
+ * Updates \a it to point to the next element after the container. The \a
+ * recursed object needs to point to the element obtained either by advancing
+ * the last element of the container (via cbor_value_advance(),
+ * cbor_value_advance_fixed(), a nested cbor_value_leave_container()) or by
+ * calling cbor_value_enter_container() on an empty container.
+ *
+ * \sa cbor_value_enter_container(), cbor_value_at_end()
+ */
+CborError cbor_value_leave_container(CborValue *it, const CborValue *recursed)
+{
+    cbor_assert(cbor_value_is_container(it));
+    cbor_assert(recursed->type == CborInvalidType);
+    it->ptr = recursed->ptr;
+    return preparse_next_value(it);
+}
+
+/**
+ * Decodes the 32 or 64 bit value of \a value (integers, tags and simple
+ * types that did not fit in the CborValue, and floating point values).
+ */
+uint64_t _cbor_value_decode_int64_internal(const CborValue *value)
+{
+    cbor_assert(value->flags & CborIteratorFlag_IntegerValueTooLarge ||
+                value->type == CborFloatType || value->type == CborDoubleType);
+
+    /* since the additional information can only be Value32Bit or Value64Bit,
+     * we just need to test for the one bit those two options differ */
+    cbor_assert((*value->ptr & SmallValueMask) == Value32Bit || (*value->ptr & SmallValueMask) == Value64Bit);
+    if ((*value->ptr & 1) == (Value32Bit & 1))
+        return get32(value->ptr + 1);
+
+    cbor_assert((*value->ptr & SmallValueMask) == Value64Bit);
+    return get64(value->ptr + 1);
+}
+
+/**
+ * Retrieves the CBOR integer value that \a value points to and stores it in \a
+ * result. If the value does not fit in an int64_t, CborErrorDataTooLarge is
+ * returned and \a result is not changed.
+ *
+ * \sa cbor_value_get_int64(), cbor_value_get_int_checked()
+ */
+CborError cbor_value_get_int64_checked(const CborValue *value, int64_t *result)
+{
+    uint64_t v;
+    cbor_assert(cbor_value_is_integer(value));
+    v = _cbor_value_extract_int64_helper(value);
+
+    /* Check before converting, as the standard says (C11 6.3.1.3 paragraph 3):
+     * "[if] the new type is signed and the value cannot be represented in it;
+     * either the result is implementation-defined or an implementation-defined
+     * signal is raised." */
+    if (unlikely(v > (uint64_t)INT64_MAX))
+        return CborErrorDataTooLarge;
+
+    *result = (int64_t)v;
+    if (value->flags & CborIteratorFlag_NegativeInteger)
+        *result = -*result - 1;
+    return CborNoError;
+}
+
+/**
+ * Retrieves the CBOR integer value that \a value points to and stores it in \a
+ * result. If the value does not fit in an int, CborErrorDataTooLarge is
+ * returned and \a result is not changed.
+ *
+ * \sa cbor_value_get_int(), cbor_value_get_int64_checked()
+ */
+CborError cbor_value_get_int_checked(const CborValue *value, int *result)
+{
+    uint64_t v;
+    cbor_assert(cbor_value_is_integer(value));
+    v = _cbor_value_extract_int64_helper(value);
+
+    if (value->flags & CborIteratorFlag_NegativeInteger) {
+        if (unlikely(v > (unsigned)-(INT_MIN + 1)))
+            return CborErrorDataTooLarge;
+        *result = (int)v;
+        *result = -*result - 1;
+    } else {
+        if (unlikely(v > (uint64_t)INT_MAX))
+            return CborErrorDataTooLarge;
+        *result = (int)v;
+    }
+    return CborNoError;
+}
+
+/**
+ * Gets a pointer to the contents of the byte or text string that \a value
+ * points to, and its length in \a length, without copying it: \a ptr points
+ * into the parsed buffer. Text strings are not NUL terminated.
+ *
+ * Only strings of known length can be accessed this way:
+ * CborErrorUnknownLength is returned for chunked strings.
+ *
+ * \sa cbor_value_is_length_known(), cbor_value_advance()
+ */
+CborError cbor_value_get_string_ptr(const CborValue *value, const uint8_t **ptr, size_t *length)
+{
+    const uint8_t *p = value->ptr;
+    uint64_t len;
+    CborError err;
+    cbor_assert(cbor_value_is_byte_string(value) || cbor_value_is_text_string(value));
+
+    if (!cbor_value_is_length_known(value))
+        return CborErrorUnknownLength;
+    err = _cbor_value_extract_number(&p, value->parser->end, &len);
+    if (err)
+        return err;
+    if (len > (uint64_t)(value->parser->end - p))
+        return CborErrorUnexpectedEOF;
+    *ptr = p;
+    *length = (size_t)len;
+    return CborNoError;
+}
+
+/** @} */
@@ -20,6 +20,7 @@
 #include "wyres-generic/wutils.h"
 
 #include "wyres-generic/configmgr.h"
+#include "cbor.h"
 
 #define MAX_KEYS 200 //MYNEWT_VAL(CFG_MAX_KEYS)
 #define INDEX_SIZE  (5)
@@ -326,6 +327,84 @@ void CFMgr_iterateKeys(int keymodule, CFG_CBFN_t cb, void* cbctx) {
 
 }
 
+// Set the element for key from the CBOR value v (which points into the received buffer, so no copy is needed)
+static bool setElementFromCBOR(int key, const CborValue* v) {
+    if (key<=CFG_KEY_ILLEGAL || key>UINT16_MAX) {
+        return false;
+    }
+    // Only existing keys can be set : their length says how to store the value
+    uint8_t klen = CFMgr_getElementLen(key);
+    if (klen==0) {
+        log_noout("CFGCB:unknown key %4x", key);
+        return false;
+    }
+    if (cbor_value_is_null(v)) {
+        return CFMgr_resetElement(key);
+    }
+    if (cbor_value_is_boolean(v)) {
+        bool b = false;
+        cbor_value_get_boolean(v, &b);
+        uint8_t bv = (b ? 1 : 0);
+        return (klen==1 && CFMgr_setElement(key, &bv, 1));
+    }
+    if (cbor_value_is_integer(v)) {
+        int64_t iv = 0;
+        if (klen>sizeof(int64_t) || cbor_value_get_int64_checked(v, &iv)!=CborNoError) {
+            return false;
+        }
+        // Must fit in the element as either a signed or an unsigned value
+        if (klen<sizeof(int64_t) && (iv > (((int64_t)1) << (8*klen))-1 || iv < -(((int64_t)1) << (8*klen-1)))) {
+            log_noout("CFGCB:value out of range for key %4x len %d", key, klen);
+            return false;
+        }
+        // little endian, as the element would be in RAM
+        uint8_t buf[sizeof(int64_t)];
+        for(int i=0;i<klen;i++) {
+            buf[i] = (uint8_t)(((uint64_t)iv) >> (8*i));
+        }
+        return CFMgr_setElement(key, buf, klen);
+    }
+    if (cbor_value_is_byte_string(v) || cbor_value_is_text_string(v)) {
+        const uint8_t* sp = NULL;
+        size_t slen = 0;
+        if (cbor_value_get_string_ptr(v, &sp, &slen)!=CborNoError || slen!=klen) {
+            log_noout("CFGCB:bad string for key %4x len %d", key, klen);
+            return false;
+        }
+        return CFMgr_setElement(key, (void*)sp, klen);
+    }
+    return false;
+}
+
+// Set elements from a CBOR map of integer key : value, in one pass directly from the buffer
+int CFMgr_setElementsFromCBOR(uint8_t* data, uint8_t sz) {
+    CborParser parser;
+    CborValue it;
+    CborValue map;
+    if (cbor_parser_init(data, sz, 0, &parser, &it)!=CborNoError || !cbor_value_is_map(&it) ||
+            cbor_value_enter_container(&it, &map)!=CborNoError) {
+        return -1;
+    }
+    int nbSet = 0;
+    while(!cbor_value_at_end(&map)) {
+        int key = CFG_KEY_ILLEGAL;
+        if (cbor_value_is_integer(&map) && cbor_value_get_int_checked(&map, &key)!=CborNoError) {
+            key = CFG_KEY_ILLEGAL;
+        }
+        // key then value
+        if (cbor_value_advance(&map)!=CborNoError || cbor_value_at_end(&map)) {
+            break;
+        }
+        if (setElementFromCBOR(key, &map)) {
+            nbSet++;
+        }
+        if (cbor_value_advance(&map)!=CborNoError) {
+            break;      // malformed : keep what was set up to here
+        }
+    }
+    return nbSet;
+}
+
 // Internals
 
 static void informListeners(uint16_t key) {
@@ -13,6 +13,8 @@
 /**
  * gpiomgr : this wraps the basic hal gpio calls with a concept of LPMODE, which defines the power modes of the MCU
  * It will then interface to a power manager, and auto deconfig/reconfig each gpio as the mode changes.
+ * Simple in/out pins are reconfigured on mode changes by direct port register writes, using masks precomputed
+ * per port and per lp mode whenever a pin is defined or released. Only irq/adc/pwm pins need per pin hal calls.
  */
 
 #include <string.h>
@@ -32,6 +34,71 @@
 int hal_gpio_init_stm(int pin, GPIO_InitTypeDef *cfg);
 
 #define MAX_GPIOS (MYNEWT_VAL(MAX_GPIOS))
+#if MAX_GPIOS > 32
+#error "gpiomgr uses a 32 bit mask of slots : MAX_GPIOS must be <= 32"
+#endif
+// Ports whose clock may be stopped when no managed pin on them is active (bit0=A). Must not include ports with
+// pins used directly by other drivers (eg uart/spi/i2c AF pins) as we can't know about those
+#define GPIO_CLKGATE_PORTS (MYNEWT_VAL(GPIO_CLKGATE_PORTS))
+
+#define NB_LP_MODES (LP_OFF+1)
+#define NB_PORTS    (8)
+#define PIN_PORT(p) (((uint8_t)(p))>>4)
+#define PIN_IDX(p)  ((p)&0x0F)
+#define PIN_BIT(p)  ((uint16_t)(1u<<PIN_IDX(p)))
+// STM32 MODER/PUPDR have 2 bits per pin
+#define MODE_IN     (0x0)
+#define MODE_OUT    (0x1)
+#define MODE_ANALOG (0x3)
+
+// Hw port registers and their clock enable bit, in the hal pin numbering order (pin = port*16 + n)
+static const struct {
+    GPIO_TypeDef* regs;
+    uint32_t clkEn;
+} _portHW[NB_PORTS] = {
+    { GPIOA, RCC_AHBENR_GPIOAEN },
+    { GPIOB, RCC_AHBENR_GPIOBEN },
+    { GPIOC, RCC_AHBENR_GPIOCEN },
+#ifdef GPIOD
+    { GPIOD, RCC_AHBENR_GPIODEN },
+#else
+    { NULL, 0 },
+#endif
+#ifdef GPIOE
+    { GPIOE, RCC_AHBENR_GPIOEEN },
+#else
+    { NULL, 0 },
+#endif
+#ifdef GPIOF
+    { GPIOF, RCC_AHBENR_GPIOFEN },
+#else
+    { NULL, 0 },
+#endif
+#ifdef GPIOG
+    { GPIOG, RCC_AHBENR_GPIOGEN },
+#else
+    { NULL, 0 },
+#endif
+#ifdef GPIOH
+    { GPIOH, RCC_AHBENR_GPIOHEN },
+#else
+    { NULL, 0 },
+#endif
+};
+
+// Precomputed per port configuration of the managed pins
+typedef struct {
+    uint16_t simplePins;            // in/out pins handled by register masks
+    uint16_t outPins;               // those of the simple pins that are outputs when active
+    uint16_t runOdr;                // output values to restore when active
+    uint16_t idleOdr;               // output values when idle (OUT_1 pins)
+    uint32_t runModer;              // MODER/PUPDR of the simple pins when active
+    uint32_t runPupdr;
+    uint32_t idleModer;             // MODER/PUPDR of the simple pins when idle
+    uint32_t idlePupdr;
+    uint16_t offPins[NB_LP_MODES];  // simple pins that must be idle in each lp mode
+    uint16_t activePins[NB_LP_MODES];   // all managed pins (any type) still active in each lp mode
+} GPIO_PORT_t;
 
 typedef struct gpio {
     int8_t pin;
@@ -51,8 +118,15 @@ typedef struct gpio {
 } GPIO_t;
 
 static GPIO_t _gpios[MAX_GPIOS];
+// Direct map of pin number to slot in _gpios (-1 if pin not defined), so accessors never have to search for the pin
+static int8_t _pinSlots[NB_PORTS*16];
+static uint32_t _usedSlots;             // mask of allocated slots in _gpios
+static GPIO_PORT_t _ports[NB_PORTS];
+static uint32_t _complexSlots;          // mask of slots with irq/adc/pwm pins that need hal calls on lp changes
+static uint8_t _lpPinCnt[NB_LP_MODES];  // number of pins per lpmode, to tell LP mgr which sleeps we care about
 static struct os_mutex _gpiomutex;
 static LP_ID_t _lpUserId;
+static LP_MODE_t _curMode = LP_RUN;     // lp mode the pins are currently configured for
 
 // function predefs
 static GPIO_t* findGPIO(int8_t p);
@@ -62,6 +136,15 @@ static void onLPModeChange(LP_MODE_t current, LP_MODE_t next);
 static void checkForNoADC();
 static void init_hal(GPIO_t* p);
 static void deinit_hal(GPIO_t* p);
+static void addPinMasks(GPIO_t* p);
+static void removePinMasks(GPIO_t* p);
+static void updateLPCBMode();
+static void setPortPins(int port, uint16_t toIdle, uint16_t toRun);
+
+// Is pin configured in the hw currently (ie not in its low power idle state)?
+static inline bool pinActive(GPIO_t* p) {
+    return (_curMode <= p->lpmode);
+}
 
 void gpio_mgr_init(void) {
     // Initialise gpio array
@@ -69,6 +152,11 @@ void gpio_mgr_init(void) {
     for(int i=0;i<MAX_GPIOS;i++) {
         _gpios[i].pin = -1;      // all free
     }
+    memset(&_pinSlots,-1,sizeof(_pinSlots));
+    _usedSlots = 0;
+    memset(&_ports,0,sizeof(_ports));
+    _complexSlots = 0;
+    memset(&_lpPinCnt,0,sizeof(_lpPinCnt));
 
     //initialise mutex
     os_mutex_init(&_gpiomutex);
@@ -89,6 +177,7 @@ void* GPIO_define_out(const char* name, int8_t pin, uint8_t initialvalue, LP_MOD
         p->lptype = offtype;
         p->lpEnabled = true;        // assume pin is alive in current lp mode!
         init_hal(p);
+        addPinMasks(p);
     }
     return p;
 }
@@ -104,6 +193,7 @@ void* GPIO_define_in(const char* name, int8_t pin,  hal_gpio_pull_t pull, LP_MOD
         p->lptype = offtype;
         p->lpEnabled = true;        // assume pin is alive in current lp mode!
         init_hal(p);
+        addPinMasks(p);
         p->value = hal_gpio_read(pin);
     }
     return p;
@@ -122,6 +212,7 @@ void* GPIO_define_adc(const char* name, int8_t pin, int adc_chan, LP_MODE_t offm
         p->lpEnabled = true;        // assume pin is alive in current lp mode!
         p->adc_chan = adc_chan;
         init_hal(p);
+        addPinMasks(p);
         p->value = hal_bsp_adc_read(adc_chan);
     }
     return p;
@@ -144,6 +235,7 @@ void* GPIO_define_pwm(const char* name, int8_t pin, int pwm_chan, LP_MODE_t offm
         p->lpEnabled = true;        // assume pin is alive in current lp mode!
         p->pwm_chan = pwm_chan;     // Timer id
         init_hal(p);
+        addPinMasks(p);
     }
     return p;
 }
@@ -163,6 +255,7 @@ void* GPIO_define_irq(const char* name, int8_t pin, hal_gpio_irq_handler_t handl
         p->lptype = offtype;
         p->lpEnabled = true;        // assume pin is alive in current lp mode!
         init_hal(p);
+        addPinMasks(p);
         p->value = hal_gpio_read(pin);
     }
     return p;
@@ -171,6 +264,7 @@ void* GPIO_define_irq(const char* name, int8_t pin, hal_gpio_irq_handler_t handl
 void GPIO_release(int8_t pin) {
     GPIO_t* p = findGPIO(pin);
     if(p!=NULL) {
+        removePinMasks(p);
         deinit_hal(p);
         releaseGPIO(p);
     } // ignore if no such pin
@@ -182,7 +276,7 @@ void GPIO_irq_enable(int8_t pin) {
     assert(p!=NULL);
     assert(p->type==GPIO_IRQ);
     p->irqEn = true;
-    if (p->lpEnabled) {
+    if (pinActive(p)) {
         hal_gpio_irq_enable(p->pin);
     }
 }
@@ -191,7 +285,7 @@ void GPIO_irq_disable(int8_t pin) {
     assert(p!=NULL);
     assert(p->type==GPIO_IRQ);
     p->irqEn = false;
-    if (p->lpEnabled) {
+    if (pinActive(p)) {
         hal_gpio_irq_disable(p->pin);
     }
 }
@@ -201,7 +295,16 @@ int GPIO_write(int8_t pin, int val) {
     assert(p!=NULL);
     assert(p->type==GPIO_OUT);
     p->value = (val!=0?1:0);
-    if (p->lpEnabled) {
+    // runOdr is shared by all the pins of the port (and read by the idle callback) : update it atomically
+    os_sr_t sr;
+    OS_ENTER_CRITICAL(sr);
+    if (p->value) {
+        _ports[PIN_PORT(p->pin)].runOdr |= PIN_BIT(p->pin);
+    } else {
+        _ports[PIN_PORT(p->pin)].runOdr &= ~PIN_BIT(p->pin);
+    }
+    OS_EXIT_CRITICAL(sr);
+    if (pinActive(p)) {
         hal_gpio_write(p->pin, p->value);
         // should re-read the value?
         p->value = hal_gpio_read(p->pin);
@@ -219,7 +322,7 @@ int GPIO_writePWM(int8_t pin, int val, int duty) {
     }
     p->value = val;
     if (val>0) {
-        if (p->lpEnabled) {
+        if (pinActive(p)) {
             // Start PWM using correct timer, duty cycle
             hal_bsp_pwm_start(p->pin, p->pwm_chan, p->value, duty);
             log_info("PWM[%d]:Start@%dHz", p->pin, val);
@@ -236,7 +339,7 @@ int GPIO_read(int8_t pin) {
     GPIO_t* p = findGPIO(pin);
     assert(p!=NULL);
     // It is allowed to read an output pin...
-    if (p->lpEnabled) {
+    if (pinActive(p)) {
         p->value = hal_gpio_read(p->pin);
     }
     return p->value;
@@ -246,7 +349,7 @@ int GPIO_readADC(int8_t pin) {
     GPIO_t* p = findGPIO(pin);
     assert(p!=NULL);
     // It is allowed to read an output pin...
-    if (p->lpEnabled) {
+    if (pinActive(p)) {
         // Read value. Note we don't use the pin, but the adc channel
         p->value =hal_bsp_adc_read(p->adc_chan);
     }
@@ -256,8 +359,12 @@ int GPIO_toggle(int8_t pin) {
     GPIO_t* p = findGPIO(pin);
     assert(p!=NULL);
     assert(p->type==GPIO_OUT);
+    os_sr_t sr;
+    OS_ENTER_CRITICAL(sr);
     p->value = (p->value!=0)?0:1;        // Invert
-    if (p->lpEnabled) {
+    _ports[PIN_PORT(p->pin)].runOdr ^= PIN_BIT(p->pin);
+    OS_EXIT_CRITICAL(sr);
+    if (pinActive(p)) {
         hal_gpio_write(p->pin, p->value);
         // should re-read the value?
         p->value = hal_gpio_read(p->pin);
@@ -266,30 +373,33 @@ int GPIO_toggle(int8_t pin) {
 }
 
 // Internals
+// O(1) lookup via the pin map. No mutex required as reading a slot index is atomic, and a slot is only
+// changed at define/release time under the mutex
 static GPIO_t* findGPIO(int8_t p) {
-    // take MUTEX
-    os_mutex_pend(&_gpiomutex, OS_TIMEOUT_NEVER);
-    for(int i=0;i<MAX_GPIOS;i++) {
-        if (_gpios[i].pin==p) {
-            os_mutex_release(&_gpiomutex);
-            return &_gpios[i];
-        }
+    if (p<0 || p>=(int)sizeof(_pinSlots)) {
+        return NULL;
     }
-    os_mutex_release(&_gpiomutex);
-    return NULL;
+    int8_t s = _pinSlots[p];
+    return (s<0 ? NULL : &_gpios[s]);
 }
 static GPIO_t* allocGPIO(int8_t p) {
+    if (p<0 || p>=(int)sizeof(_pinSlots)) {
+        return NULL;
+    }
     // take MUTEX
     os_mutex_pend(&_gpiomutex, OS_TIMEOUT_NEVER);
-    if (findGPIO(p)==NULL) {
-        for(int i=0;i<MAX_GPIOS;i++) {
-            if (_gpios[i].pin<0) {
-                _gpios[i].pin = p;      // Mine now
-                // release mutex
-                os_mutex_release(&_gpiomutex);
-                return &_gpios[i];
-            }
-        }
+    uint32_t freeSlots = ~_usedSlots;
+#if MAX_GPIOS < 32
+    freeSlots &= ((1u<<MAX_GPIOS)-1);
+#endif
+    if (_pinSlots[p]<0 && freeSlots!=0) {
+        int i = __builtin_ctz(freeSlots);
+        _usedSlots |= (1u<<i);
+        _gpios[i].pin = p;      // Mine now
+        _pinSlots[p] = i;
+        // release mutex
+        os_mutex_release(&_gpiomutex);
+        return &_gpios[i];
     }
     // release mutex
     os_mutex_release(&_gpiomutex);
@@ -301,6 +411,8 @@ static void releaseGPIO(GPIO_t* g) {
     assert(g!=NULL);
     // take MUTEX
     os_mutex_pend(&_gpiomutex, OS_TIMEOUT_NEVER);
+    _pinSlots[g->pin] = -1;
+    _usedSlots &= ~(1u<<(g-&_gpios[0]));
     g->pin = -1;
     // release mutex
     os_mutex_release(&_gpiomutex);
@@ -405,36 +517,165 @@ static void deinit_hal(GPIO_t* p) {
     }
 }
 
+// Update the per port masks with a newly defined pin
+static void addPinMasks(GPIO_t* p) {
+    GPIO_PORT_t* port = &_ports[PIN_PORT(p->pin)];
+    uint16_t bit = PIN_BIT(p->pin);
+    int sh = PIN_IDX(p->pin)*2;
+    // Masks are read by the idle task callback, ensure it never sees a half updated port
+    os_sr_t sr;
+    OS_ENTER_CRITICAL(sr);
+    if (p->type==GPIO_OUT || p->type==GPIO_IN) {
+        port->simplePins |= bit;
+        port->runModer = (port->runModer & ~(0x3u<<sh)) | ((p->type==GPIO_OUT?MODE_OUT:MODE_IN)<<sh);
+        port->runPupdr = (port->runPupdr & ~(0x3u<<sh)) | ((p->type==GPIO_IN?(p->pull & 0x3):0)<<sh);
+        if (p->type==GPIO_OUT) {
+            port->outPins |= bit;
+            if (p->value) {
+                port->runOdr |= bit;
+            } else {
+                port->runOdr &= ~bit;
+            }
+        } else {
+            port->outPins &= ~bit;
+        }
+        uint32_t idleMode = MODE_IN;
+        uint32_t idlePull = 0;
+        port->idleOdr &= ~bit;
+        if (p->lptype==PULL_DOWN) {
+            idlePull = HAL_GPIO_PULL_DOWN;
+        } else if (p->lptype==PULL_UP) {
+            idlePull = HAL_GPIO_PULL_UP;
+        } else if (p->lptype==OUT_0) {
+            idleMode = MODE_OUT;
+        } else if (p->lptype==OUT_1) {
+            idleMode = MODE_OUT;
+            port->idleOdr |= bit;
+        } else {
+            // HIGH_Z : analog is lowest power
+            idleMode = MODE_ANALOG;
+        }
+        port->idleModer = (port->idleModer & ~(0x3u<<sh)) | (idleMode<<sh);
+        port->idlePupdr = (port->idlePupdr & ~(0x3u<<sh)) | (idlePull<<sh);
+        for(int m=0;m<NB_LP_MODES;m++) {
+            if (m > p->lpmode) {
+                port->offPins[m] |= bit;
+            }
+        }
+        // if idle state is an output it must be push-pull like the hal does
+        if (idleMode==MODE_OUT && _portHW[PIN_PORT(p->pin)].regs!=NULL) {
+            _portHW[PIN_PORT(p->pin)].regs->OTYPER &= ~((uint32_t)bit);
+        }
+    } else {
+        _complexSlots |= (1u<<(p-&_gpios[0]));
+    }
+    for(int m=0;m<NB_LP_MODES;m++) {
+        if (m <= p->lpmode) {
+            port->activePins[m] |= bit;
+        }
+    }
+    _lpPinCnt[p->lpmode]++;
+    OS_EXIT_CRITICAL(sr);
+    updateLPCBMode();
+}
+
+// Remove a pin about to be released from the masks
+static void removePinMasks(GPIO_t* p) {
+    GPIO_PORT_t* port = &_ports[PIN_PORT(p->pin)];
+    uint16_t bit = PIN_BIT(p->pin);
+    os_sr_t sr;
+    OS_ENTER_CRITICAL(sr);
+    port->simplePins &= ~bit;
+    port->outPins &= ~bit;
+    for(int m=0;m<NB_LP_MODES;m++) {
+        port->offPins[m] &= ~bit;
+        port->activePins[m] &= ~bit;
+    }
+    _complexSlots &= ~(1u<<(p-&_gpios[0]));
+    _lpPinCnt[p->lpmode]--;
+    OS_EXIT_CRITICAL(sr);
+    updateLPCBMode();
+}
+
+// Tell LP mgr the deepest mode where all our pins are still active, so we are only called for sleeps that change something
+static void updateLPCBMode() {
+    LP_MODE_t m = LP_OFF;
+    for(int i=0;i<LP_OFF;i++) {
+        if (_lpPinCnt[i]>0) {
+            m = (LP_MODE_t)i;
+            break;
+        }
+    }
+    LPMgr_setCBMode(_lpUserId, m);
+}
+
+// Put the given simple pins of a port into their idle or run configuration with a few register writes
+static void setPortPins(int pi, uint16_t toIdle, uint16_t toRun) {
+    GPIO_TypeDef* regs = _portHW[pi].regs;
+    GPIO_PORT_t* port = &_ports[pi];
+    if (regs==NULL || (toIdle|toRun)==0) {
+        return;
+    }
+    // Expand the 16 bit pin masks to the 2 bits per pin register layout
+    uint32_t idle2 = 0;
+    uint32_t run2 = 0;
+    for(int i=0;i<16;i++) {
+        if (toIdle & (1u<<i)) {
+            idle2 |= (0x3u<<(i*2));
+        }
+        if (toRun & (1u<<i)) {
+            run2 |= (0x3u<<(i*2));
+        }
+    }
+    // Set output level before changing mode to avoid glitches
+    uint16_t idleOut = toIdle;
+    uint16_t runOut = toRun & port->outPins;
+    regs->BSRR = ((uint32_t)(port->idleOdr & idleOut) | (port->runOdr & runOut))
+                | ((uint32_t)((~port->idleOdr & idleOut) | (~port->runOdr & runOut))<<16);
+    regs->PUPDR = (regs->PUPDR & ~(idle2|run2)) | (port->idlePupdr & idle2) | (port->runPupdr & run2);
+    regs->MODER = (regs->MODER & ~(idle2|run2)) | (port->idleModer & idle2) | (port->runModer & run2);
+}
+
 // Callback from LP manager : DO NOT LOG OR TAKE TOO MUCH STACK
 static void onLPModeChange(LP_MODE_t current, LP_MODE_t next) {
     // Cannot take mutex - this function called on with IRQ disable from idle task -> no other task or ISR can be running, no IRQs can interrupt
-//    os_mutex_pend(&_gpiomutex, OS_TIMEOUT_NEVER);
-    for(int i=0;i<MAX_GPIOS;i++) {
-        if (_gpios[i].pin>=0) {
-            // lp modes are in increasing order of low powerness, so if next one is > that the one for this pin it must shut down
-            if (next > _gpios[i].lpmode) {
-                // deconfigure all pins that are off in the new mode (including irq disable)
-                deinit_hal(&_gpios[i]);
-                _gpios[i].lpEnabled = false;
-            } else {
-                // confgure all pins that are on in this mode (including irq enable)
-                // but only if wans't already enabled
-                if (_gpios[i].lpEnabled==false) {
-                    _gpios[i].lpEnabled = true;
-                    init_hal(&_gpios[i]);
-                }
+    // Leaving a mode : restart port clocks first as registers are not accessible without them
+    for(int pi=0;pi<NB_PORTS;pi++) {
+        if ((GPIO_CLKGATE_PORTS & (1u<<pi)) && _portHW[pi].regs!=NULL && 
+                _ports[pi].activePins[current]==0 && _ports[pi].activePins[next]!=0) {
+            RCC->AHBENR |= _portHW[pi].clkEn;
+        }
+    }
+    // irq/adc/pwm pins need the hal
+    uint32_t slots = _complexSlots;
+    while (slots!=0) {
+        int i = __builtin_ctz(slots);
+        slots &= ~(1u<<i);
+        // lp modes are in increasing order of low powerness, so if next one is > that the one for this pin it must shut down
+        if (next > _gpios[i].lpmode) {
+            // deconfigure all pins that are off in the new mode (including irq disable)
+            deinit_hal(&_gpios[i]);
+            _gpios[i].lpEnabled = false;
+        } else {
+            // confgure all pins that are on in this mode (including irq enable)
+            // but only if wans't already enabled
+            if (_gpios[i].lpEnabled==false) {
+                _gpios[i].lpEnabled = true;
+                init_hal(&_gpios[i]);
             }
         }
     }
-    // ? do we (can we) stop gpio clocks? Need to check all the gpios on each block are off...
-    // What about gpios used by other code directly (maybe this is not allowed?) 
-    // what about if used as AF functions (ie not controlled here)?
-    // TODO
-    // __HAL_RCC_GPIOA_CLK_DISABLE();
-    // __HAL_RCC_GPIOB_CLK_DISABLE();
-    // __HAL_RCC_GPIOC_CLK_DISABLE();
-    // __HAL_RCC_GPIOD_CLK_DISABLE();
-    // release mutex
-//    os_mutex_release(&_gpiomutex);
-
+    // in/out pins are done per port with precomputed masks
+    for(int pi=0;pi<NB_PORTS;pi++) {
+        uint16_t offNow = _ports[pi].offPins[current];
+        uint16_t offNext = _ports[pi].offPins[next];
+        setPortPins(pi, offNext & ~offNow, offNow & ~offNext);
+    }
+    _curMode = next;
+    // Entering a mode : stop clocks of ports with no active pins left (only those the BSP said are ours)
+    for(int pi=0;pi<NB_PORTS;pi++) {
+        if ((GPIO_CLKGATE_PORTS & (1u<<pi)) && _portHW[pi].regs!=NULL && _ports[pi].activePins[next]==0) {
+            RCC->AHBENR &= ~_portHW[pi].clkEn;
+        }
+    }
 }
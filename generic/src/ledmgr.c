@@ -27,27 +27,33 @@
 #include "wyres-generic/ledmgr.h"
 
 #define MAX_LEDS    MYNEWT_VAL(MAX_LEDS)
+#define LED_QUEUE_SZ MYNEWT_VAL(LED_QUEUE_SZ)
 
 // Led task should be high pri as does very little but wants to do it in real time
 #define LED_TASK_PRIO       MYNEWT_VAL(LEDMGR_TASK_PRIO)
 #define LED_TASK_STACK_SZ   OS_STACK_ALIGN(128)
 
 // internals
-#define ISSET(v, p) ((v & (1<<p))!=0)
-#define SETBIT(v, p) (v|=(1<<p))
+#define ISSET(v, p) (((v) & (1u<<(p)))!=0)
 
 #define MAX_PATTERN_SECS (2)
 #define LED_SLICES_PER_SEC (10)
+#define LED_NB_SLICES (MAX_PATTERN_SECS*LED_SLICES_PER_SEC)
 
 struct s_req {
     uint32_t pattern;
-    uint32_t durSecs;
+    uint8_t len;                // slices in pattern
+    uint32_t sliceTicks;        // os ticks per slice
+    uint32_t durTicks;          // duration left to run (0=until cancelled) : reduced when preempted
+    uint32_t startedAt;         // os time when last (re)started executing
+    uint8_t prio;
+    uint32_t expiresAt;         // os time after which request is dropped if not yet started (0=never)
 };
 struct s_ledref {
     int8_t gpio;
     bool active;
-    struct s_req cur;
-    struct s_req next;
+    uint8_t nreqs;
+    struct s_req reqs[LED_QUEUE_SZ];    // in priority order, [0] is executing when active
     struct os_callout durTimer;       // For the duration timer for this specific led
 };
 
@@ -58,6 +64,7 @@ static struct s_ledref _leds[MAX_LEDS];     // TODO use mempools
 static uint8_t _ledRefsSz = 0;
 static struct os_sem _ledActiveSema;
 static LP_ID_t _lpUserId;
+static uint32_t _wakeups = 0;       // number of times the led task has run its pattern loop
 
 // predefine private fns
 static int checkLED(int8_t gpio);
@@ -66,8 +73,11 @@ static void startLEDTimer(int ledref);
 static void stopLEDTimer(int ledref);
 static int findLEDRef(int8_t gpio_pin);
 static uint32_t makeBinaryFromString(const char* binary);
+static bool queueRequest(int r, const struct s_req* req, bool interrupt);
+static void startNextRequest(int r);
 static void led_mgr_task(void* arg);
 static void ledActive();
+static int nextEdge(const struct s_req* req, int timeslice);
 static void lp_change(LP_MODE_t oldmode, LP_MODE_t newmode);
 
 // Called from sysinit via reference in pkg.yml
@@ -77,8 +87,10 @@ void led_mgr_init(void) {
     // Create the led handler task
     os_task_init(&_led_task_str, "led_task", &led_mgr_task, NULL, LED_TASK_PRIO,
                  OS_WAIT_FOREVER, _led_task_stack, LED_TASK_STACK_SZ);
-    // listen for lowpower entry to deep sleep - we cancel running leds when this happens
+    // listen for lowpower entry to OFF - we cancel running leds when this happens
     _lpUserId = LPMgr_register(lp_change);
+    // patterns keep running across deep sleeps (when no led is lit), so we only care about OFF
+    LPMgr_setCBMode(_lpUserId, LP_DEEPSLEEP);
 }
 
 // Public API
@@ -88,38 +100,48 @@ void led_mgr_init(void) {
  * The return indicates if the request was accepted or not
  */
 bool ledRequest(int8_t gpio, const char* pattern, uint32_t dur, LED_PRI pri) {
+    struct s_req req = {
+        .pattern = makeBinaryFromString(pattern),
+        .len = LED_NB_SLICES,
+        .sliceTicks = OS_TICKS_PER_SEC/LED_SLICES_PER_SEC,
+        .durTicks = dur*OS_TICKS_PER_SEC,
+        .prio = LED_PRIO_NORMAL,
+        .expiresAt = 0,
+    };
     // Convert gpio to index (find existing slot or creates one)
     int r = checkLED(gpio);
     if (r<0) {
         // No more slots
         return false;
     }
-    if (pri==LED_REQ_INTERUPT) {
-        _leds[r].cur.pattern = makeBinaryFromString(pattern);
-        _leds[r].cur.durSecs = dur;
-        _leds[r].next.pattern = 0;
-    } else {
-        // Not priority, must 'queue'
-        if (_leds[r].active && _leds[r].cur.pattern!=0) {
-            if (_leds[r].next.pattern!=0) {
-                // queue full, sorry
-                return false;
-            } else {
-                _leds[r].next.pattern = makeBinaryFromString(pattern);
-                _leds[r].next.durSecs = dur;
-                return true;        // no need to deal with currently executing request
-            }
-        } else {
-            _leds[r].cur.pattern = makeBinaryFromString(pattern);
-            _leds[r].cur.durSecs = dur;
-        }
+    return queueRequest(r, &req, (pri==LED_REQ_INTERUPT));
+}
+/*
+ * Submit a request using a precompiled pattern. Higher 'prio' requests preempt lower ones (which resume after), equal ones
+ * are queued in order. If maxWaitSecs>0, the request is dropped if it has not started within that time.
+ */
+bool ledRequestPattern(int8_t gpio, const LED_PATTERN_t* pattern, uint32_t dur, uint8_t prio, uint32_t maxWaitSecs) {
+    assert(pattern!=NULL);
+    assert(pattern->len>0 && pattern->len<=32);
+    struct s_req req = {
+        .pattern = pattern->bits,
+        .len = pattern->len,
+        .sliceTicks = (pattern->sliceMS*OS_TICKS_PER_SEC)/1000,
+        .durTicks = dur*OS_TICKS_PER_SEC,
+        .prio = prio,
+        .expiresAt = (maxWaitSecs>0 ? (os_time_get() + maxWaitSecs*OS_TICKS_PER_SEC) : 0),
+    };
+    if (req.sliceTicks==0) {
+        req.sliceTicks = 1;
     }
-    // new current request, start it
-    _leds[r].active=true;
-    ledActive();
-    // Start timer for end
-    startLEDTimer(r);
-    return true;
+    if (req.expiresAt==0 && maxWaitSecs>0) {
+        req.expiresAt = 1;      // 0 means never...
+    }
+    int r = checkLED(gpio);
+    if (r<0) {
+        return false;
+    }
+    return queueRequest(r, &req, false);
 }
 // Start a pattern immediately (same as interuppting)
 bool ledStart(int8_t gpio, const char* pattern, uint32_t dur) {
@@ -134,23 +156,26 @@ void ledCancel(int8_t gpio) {
     assert(r>=0);       // Shouldnt be cancelling a non-existant LED!
     // Cancel current timer
     stopLEDTimer(r);
-    _leds[r].cur.pattern = _leds[r].next.pattern;
-    _leds[r].cur.durSecs = _leds[r].next.durSecs;
-    _leds[r].next.pattern = 0;
-    if (_leds[r].cur.pattern!=0) {
-        _leds[r].active=true;
-        ledActive();
-        // Start timer for end
-        startLEDTimer(r);
-    } else {
-        _leds[r].active=false;
-        GPIO_write(_leds[r].gpio, 0);
-
+    // drop current request
+    os_sr_t sr;
+    OS_ENTER_CRITICAL(sr);      // same as queueRequest, the duration timer callback and app tasks both get here
+    if (_leds[r].active && _leds[r].nreqs>0) {
+        for(int i=1;i<_leds[r].nreqs;i++) {
+            _leds[r].reqs[i-1] = _leds[r].reqs[i];
+        }
+        _leds[r].nreqs--;
     }
+    OS_EXIT_CRITICAL(sr);
+    startNextRequest(r);
+}
+
+// Number of times the led task has woken to update the leds (for power consumption checks)
+uint32_t ledGetWakeups() {
+    return _wakeups;
 }
 
 // privates
-// THere is at least 1 led request active, ensure task is awake
+// Led requests have changed, ensure task is awake to recalculate its next edge
 static void ledActive() {
     // Ensure task is awake by giving it a token on the sema (only if there aren't any)
     if (os_sem_get_count(&_ledActiveSema)<1) {
@@ -158,6 +183,80 @@ static void ledActive() {
     }
 }
 
+// Insert request in the led's queue by priority (after those of same or higher priority), or at head if interrupting
+static bool queueRequest(int r, const struct s_req* req, bool interrupt) {
+    struct s_ledref* led = &_leds[r];
+    int pos;
+    os_sr_t sr;
+    OS_ENTER_CRITICAL(sr);      // as duration timer callback also changes the queue
+    if (interrupt) {
+        // replaces the executing request
+        if (led->active && led->nreqs>0) {
+            led->reqs[0] = *req;
+            OS_EXIT_CRITICAL(sr);
+            startNextRequest(r);
+            return true;
+        }
+        pos = 0;
+    } else {
+        for(pos=0;pos<led->nreqs && led->reqs[pos].prio>=req->prio;pos++) {
+        }
+    }
+    if (led->nreqs>=LED_QUEUE_SZ) {
+        // full : the last (lowest priority) entry makes way if the new one is more important
+        if (pos>=LED_QUEUE_SZ) {
+            OS_EXIT_CRITICAL(sr);
+            return false;        // queue full, sorry
+        }
+        led->nreqs--;
+    }
+    if (pos==0 && led->active && led->nreqs>0 && led->reqs[0].durTicks>0) {
+        // executing request is preempted : it resumes later for the rest of its duration only
+        uint32_t ran = os_time_get() - led->reqs[0].startedAt;
+        led->reqs[0].durTicks = (ran<led->reqs[0].durTicks ? led->reqs[0].durTicks-ran : 1);
+    }
+    for(int i=led->nreqs;i>pos;i--) {
+        led->reqs[i] = led->reqs[i-1];
+    }
+    led->reqs[pos] = *req;
+    led->nreqs++;
+    OS_EXIT_CRITICAL(sr);
+    // new current request (or led idle), start it
+    if (pos==0 || !led->active) {
+        startNextRequest(r);
+    }
+    return true;
+}
+
+// Start the request at the head of the queue (dropping any that expired waiting), or turn led off if none
+static void startNextRequest(int r) {
+    struct s_ledref* led = &_leds[r];
+    uint32_t now = os_time_get();
+    os_sr_t sr;
+    OS_ENTER_CRITICAL(sr);
+    while (led->nreqs>0 && led->reqs[0].expiresAt!=0 && OS_TIME_TICK_GT(now, led->reqs[0].expiresAt)) {
+        for(int i=1;i<led->nreqs;i++) {
+            led->reqs[i-1] = led->reqs[i];
+        }
+        led->nreqs--;
+    }
+    if (led->nreqs>0) {
+        // once started it can't expire (a preempted request resumes later)
+        led->reqs[0].expiresAt = 0;
+        led->active = true;
+        OS_EXIT_CRITICAL(sr);
+        // Start timer for end
+        startLEDTimer(r);
+    } else {
+        led->active = false;
+        OS_EXIT_CRITICAL(sr);
+        stopLEDTimer(r);
+        GPIO_write(led->gpio, 0);
+    }
+    // let task recalculate its next wakeup and lp mode
+    ledActive();
+}
+
 // Create led control 
 static int checkLED(int8_t gpio) {
     int r = findLEDRef(gpio);
@@ -168,18 +267,19 @@ static int checkLED(int8_t gpio) {
             return -1;      // sorry
         }
         // get index to return and inc ready for next time
-        r = _ledRefsSz++;
+        r = _ledRefsSz;
 
         // fill in the next slot and return its index as reference
         _leds[r].gpio = gpio;
         _leds[r].active = false;
-        _leds[r].cur.pattern = 0;
-        _leds[r].next.pattern = 0;
+        _leds[r].nreqs = 0;
         // Setup io : using IO mgr to deal with sleep entry/exit. Our main loop keeps LP from going further than DOZE if an led is active
         GPIO_define_out("LED", gpio, 0, LP_SLEEP, HIGH_Z);
         // Each entry has its own timer, where the arg in the event for the timer callback is the gpio value...
         os_callout_init(&(_leds[r].durTimer), os_eventq_dflt_get(),
                     &led_dur_ev_cb, (void*)(&_leds[r]));
+        // Only make it visible to the task once its setup
+        _ledRefsSz++;
 
         //log("created new LED with gpio pin %d", gpio);
     }
@@ -191,49 +291,78 @@ static uint32_t makeBinaryFromString(const char* binary) {
         return 0;
     }
     uint32_t ret = 0;
-    for(int i=0;i<(MAX_PATTERN_SECS*LED_SLICES_PER_SEC);i++) {
-        // String may be shorter than 20 elements but effectively this pads 0s to right
-        if (i<strlen(binary) && binary[i]=='1') {
-            SETBIT(ret, i);
+    // String may be shorter than 20 elements but effectively this pads 0s to right
+    for(int i=0;i<LED_NB_SLICES && binary[i]!='\0';i++) {
+        if (binary[i]=='1') {
+            ret |= (1u<<i);
         }
     }
     return ret;
 }
 
+// Number of slices from 'timeslice' until the pattern changes state, or 0 if it never does
+static int nextEdge(const struct s_req* req, int timeslice) {
+    bool cur = ISSET(req->pattern, timeslice);
+    for(int d=1;d<req->len;d++) {
+        if (ISSET(req->pattern, (timeslice+d)%req->len)!=cur) {
+            return d;
+        }
+    }
+    return 0;
+}
+
 static void led_mgr_task(void* arg) {
     // Handle a list of requests for specific led blink pattern on a specific led to be started/stopped
     // these requests are dealt with in the task below in order
-
-    int timeslice = -1;
+    // Rather than waking every slice, the task sleeps until the next slice where any active led changes state
 
     while (1) {
-        timeslice = (timeslice+1) % (MAX_PATTERN_SECS*LED_SLICES_PER_SEC);       // 100ms slice within the 2 seconds
+        _wakeups++;
+        uint32_t now = os_time_get();
         int nleds = _ledRefsSz;
         bool patternActive = false;
+        bool ledLit = false;
+        uint32_t waitTicks = 0;     // 0 = no edge to wait for
         for (int i=0; i<nleds;i++) {
             // Only write if active pattern. 
             if (_leds[i].active) {
+                // the queue is shifted by cancels/requests from other tasks and the duration timer : work on a copy
+                struct s_req cur;
+                os_sr_t sr;
+                OS_ENTER_CRITICAL(sr);
+                cur = _leds[i].reqs[0];
+                OS_EXIT_CRITICAL(sr);
+                const struct s_req* req = &cur;
                 patternActive = true;       // at least one pattern is running
+                // slice within the pattern : from the time so we stay in step however long we slept
+                int timeslice = (now/req->sliceTicks) % req->len;
                 // get current pattern for this led and get if high or low
                 // set led on or off as required
-                if (ISSET(_leds[i].cur.pattern, timeslice)) {
+                if (ISSET(req->pattern, timeslice)) {
                     GPIO_write(_leds[i].gpio, 1);
+                    ledLit = true;
                 } else {
                     GPIO_write(_leds[i].gpio, 0);
                 }
+                int d = nextEdge(req, timeslice);
+                if (d>0) {
+                    // wait until the start of the slice with the edge
+                    uint32_t t = (d*req->sliceTicks) - (now%req->sliceTicks);
+                    if (waitTicks==0 || t<waitTicks) {
+                        waitTicks = t;
+                    }
+                }
             }
         }
-        // wait 100ms to change led states IFF led pattern running, else wait on semaphore for new request
-        if (patternActive) {
-            LPMgr_setLPMode(_lpUserId, LP_SLEEP);       // if leds running then keep at lp level where their gpios are active ie SLEEP...
-            /* Wait 100ms (or 1second divided by the number of time slices per sec) - this yields the CPU */
-            os_time_delay(OS_TICKS_PER_SEC/LED_SLICES_PER_SEC);
+        if (ledLit) {
+            LPMgr_setLPMode(_lpUserId, LP_SLEEP);       // if leds lit then keep at lp level where their gpios are active ie SLEEP...
+        } else if (patternActive) {
+            LPMgr_setLPMode(_lpUserId, LP_DEEPSLEEP);   // all leds dark until next edge, their gpios can be off
         } else {
             LPMgr_setLPMode(_lpUserId, LP_OFF);       // ok with off as no leds to light
-            // wait until a new led request arrives (so can sleep)
-            os_sem_pend(&_ledActiveSema, OS_TIMEOUT_NEVER);
-//            os_time_delay(OS_TICKS_PER_SEC/LED_SLICES_PER_SEC);
         }
+        // wait until the next edge, or until a led request changes things (so can sleep)
+        os_sem_pend(&_ledActiveSema, (waitTicks>0 ? waitTicks : OS_TIMEOUT_NEVER));
     }
 }
 
@@ -248,8 +377,9 @@ static void led_dur_ev_cb(struct os_event *ev) {
 static void startLEDTimer(int ledref) {
     assert(ledref>=0 && ledref<_ledRefsSz);
     // timer runs if value is >0, else no duration timer for this guy.... caller must cancel it explcitly or interuppt with another request
-    if (_leds[ledref].cur.durSecs>0) {
-        os_callout_reset(&_leds[ledref].durTimer, _leds[ledref].cur.durSecs * OS_TICKS_PER_SEC);
+    _leds[ledref].reqs[0].startedAt = os_time_get();
+    if (_leds[ledref].reqs[0].durTicks>0) {
+        os_callout_reset(&_leds[ledref].durTimer, _leds[ledref].reqs[0].durTicks);
     } else {
         os_callout_stop(&_leds[ledref].durTimer);
     }
@@ -269,10 +399,12 @@ static int findLEDRef(int8_t gpio_pin) {
 }
 // LOw power mode change : DO NOT LOG OR TAKE TOO MUCH STACK
 static void lp_change(LP_MODE_t oldmode, LP_MODE_t newmode) {
-    if (newmode>=LP_DEEPSLEEP) {
+    // Deep sleep happens between edges while patterns are dark, but OFF means no one will wake us to continue them
+    if (newmode>=LP_OFF) {
         // stop any running LEDs
         for(int r=0;r<_ledRefsSz;r++) {
             _leds[r].active=false;
+            _leds[r].nreqs=0;
             // Make sure its off (if gpiomgr has already de-inited it its ok)
             GPIO_write(_leds[r].gpio, 0);
             // Ensure no timer running
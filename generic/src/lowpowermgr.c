@@ -23,19 +23,29 @@
 
 #define MAX_LPCBFNS MYNEWT_VAL(MAX_LPCBFNS)
 
+#define NB_LP_MODES (LP_OFF+1)
+
 // Registered callbacks fns
 static struct lp_ctx {
     struct {
         LP_MODE_t desiredMode;  // Current sleep mode required
+        LP_MODE_t cbMode;       // deepest mode in which this user's hw is unaffected (no cb for sleeps at or above this)
         LP_CBFN_t cb;           // callback to be informed of changes
     } lpUsers[MAX_LPCBFNS];
     uint8_t deviceCnt;
+    uint8_t modeVotes[NB_LP_MODES];     // number of users currently desiring each mode
+    uint8_t cbModeCnt[NB_LP_MODES];     // number of callbacks with each cbMode
     LP_MODE_t sleepMode;
+    LP_MODE_t cbMinMode;        // shallowest cbMode of all callbacks : sleeps at or above this need no callbacks at all
+    LP_MODE_t enteredMode;      // mode callbacks were told about at sleep entry (LP_RUN if none were called)
 } _ctx = {
     .deviceCnt=0,
     .sleepMode=LP_SLEEP,
+    .cbMinMode=LP_OFF,
+    .enteredMode=LP_RUN,
 };
 static LP_MODE_t calcNextSleepMode();
+static LP_MODE_t calcCBMinMode();
 
 // Initialise low power manager
 void LPMgr_init(void) {
@@ -49,29 +59,54 @@ LP_ID_t LPMgr_register(LP_CBFN_t cb) {
     uint8_t id = _ctx.deviceCnt;
     _ctx.lpUsers[_ctx.deviceCnt].cb=cb;     // May be NULL if user only changes the desired LP mode...
     _ctx.lpUsers[_ctx.deviceCnt].desiredMode=LP_DEEPSLEEP;      // start by assuming everyone is ok with deep sleep
+    _ctx.lpUsers[_ctx.deviceCnt].cbMode=LP_RUN;                 // and that their callback wants to hear about every sleep
+    _ctx.modeVotes[LP_DEEPSLEEP]++;
+    if (cb!=NULL) {
+        _ctx.cbModeCnt[LP_RUN]++;
+    }
     _ctx.deviceCnt++;
 
     // Ensure next sleep mode is up to date including this new guy
     _ctx.sleepMode = calcNextSleepMode();
+    _ctx.cbMinMode = calcCBMinMode();
 
     return id;
 }
 
 // THe level of sleeping when someone (the OS) asks to enter 'low power mode'
 void LPMgr_setLPMode(LP_ID_t id, LP_MODE_t m) {
-    assert(id>=0 && id < MAX_LPCBFNS);
-//    LP_MODE_t prevmode = _ctx.lpUsers[id].desiredMode;
-    // Set this guy's desired mode
+    assert(id>=0 && id < _ctx.deviceCnt);
+    LP_MODE_t prevmode = _ctx.lpUsers[id].desiredMode;
+    if (prevmode==m) {
+        return;     // no change to the votes
+    }
+    // Move this guy's vote to his new desired mode
     _ctx.lpUsers[id].desiredMode = m;
+    _ctx.modeVotes[prevmode]--;
+    _ctx.modeVotes[m]++;
     _ctx.sleepMode = calcNextSleepMode();
     // new mode taken into account next time we sleep as BSP should call LPMgr_getMode() to get a HAL related sleep level
 /* for debug only and be careful
-    if (prevmode != m) {
-        log_warn("LP::%d:%d", m, _ctx.sleepMode);
-    }
+    log_warn("LP::%d:%d", m, _ctx.sleepMode);
 */
 }
 
+// Set the deepest mode in which this user's hw is unaffected : its callback is only called for sleeps deeper than this
+void LPMgr_setCBMode(LP_ID_t id, LP_MODE_t m) {
+    assert(id>=0 && id < _ctx.deviceCnt);
+    if (_ctx.lpUsers[id].cb==NULL || _ctx.lpUsers[id].cbMode==m) {
+        return;
+    }
+    // Must not change the set of called callbacks between a sleep entry and its exit
+    os_sr_t sr;
+    OS_ENTER_CRITICAL(sr);
+    _ctx.cbModeCnt[_ctx.lpUsers[id].cbMode]--;
+    _ctx.cbModeCnt[m]++;
+    _ctx.lpUsers[id].cbMode = m;
+    _ctx.cbMinMode = calcCBMinMode();
+    OS_EXIT_CRITICAL(sr);
+}
+
 /* Hook functions round the 'idle' method. These allow the code to pause/resume external hw or other tasks.
  * These functions are called with IRQs disabled, and with a minimal stack size (mynewt idle stack). 
  * DO NOT LOG, OR SLEEP, OR DO TOO MUCH STUFF IN THEM OR BAD STUFF WILL HAPPEN
@@ -95,33 +130,50 @@ int LPMgr_getMode() {
 }
 /** signal sleep entry (outside critical region). Returns anticipated sleep level.*/
 int LPMgr_entersleep() {
-    // tell all registered CBs we sleep (and at what level)
-    for(int i=0;i<_ctx.deviceCnt;i++) {
-        if (_ctx.lpUsers[i].cb!=NULL) {
-            (*_ctx.lpUsers[i].cb)(LP_RUN, _ctx.sleepMode);
+    // Only bother the CBs if this sleep level actually changes something for at least one of them
+    if (_ctx.sleepMode > _ctx.cbMinMode) {
+        _ctx.enteredMode = _ctx.sleepMode;
+        // tell registered CBs whose hw is affected that we sleep (and at what level)
+        for(int i=0;i<_ctx.deviceCnt;i++) {
+            if (_ctx.lpUsers[i].cb!=NULL && _ctx.enteredMode > _ctx.lpUsers[i].cbMode) {
+                (*_ctx.lpUsers[i].cb)(LP_RUN, _ctx.enteredMode);
+            }
         }
+    } else {
+        _ctx.enteredMode = LP_RUN;
     }
     return LPMgr_getMode();
 }
 /** signale sleep exit (outside critical region) */
 int LPMgr_exitsleep() {
-    // Tell everyone who cares
-    for(int i=0;i<_ctx.deviceCnt;i++) {
-        if (_ctx.lpUsers[i].cb!=NULL) {
-            (*_ctx.lpUsers[i].cb)(_ctx.sleepMode, LP_RUN);
+    // Tell everyone who was told about the entry (using the same mode even if a vote changed in between)
+    if (_ctx.enteredMode!=LP_RUN) {
+        for(int i=0;i<_ctx.deviceCnt;i++) {
+            if (_ctx.lpUsers[i].cb!=NULL && _ctx.enteredMode > _ctx.lpUsers[i].cbMode) {
+                (*_ctx.lpUsers[i].cb)(_ctx.enteredMode, LP_RUN);
+            }
         }
+        _ctx.enteredMode = LP_RUN;
     }
     return HAL_BSP_POWER_ON;
 }
 
 // Internals
+// Both of these are O(1) : they scan the per-mode counters, not the users
 static LP_MODE_t calcNextSleepMode() {
-    LP_MODE_t ret = LP_OFF;     // the deepest mode, man...
-    for(int i=0;i<_ctx.deviceCnt;i++) {
-        // check each user, anyone needing 'less' sleep is priority
-        if (_ctx.lpUsers[i].desiredMode<ret) {
-            ret = _ctx.lpUsers[i].desiredMode;
+    // the shallowest mode that anyone votes for is the one we can use
+    for(int m=LP_RUN;m<LP_OFF;m++) {
+        if (_ctx.modeVotes[m]>0) {
+            return (LP_MODE_t)m;
+        }
+    }
+    return LP_OFF;     // the deepest mode, man...
+}
+static LP_MODE_t calcCBMinMode() {
+    for(int m=LP_RUN;m<LP_OFF;m++) {
+        if (_ctx.cbModeCnt[m]>0) {
+            return (LP_MODE_t)m;
         }
     }
-    return ret;
+    return LP_OFF;      // no callback cares about any mode
 }
@@ -14,6 +14,7 @@
  * Accelero API implementation for LPS22HB
  */
 #include <stdint.h>
+#include <string.h>
 
 #include "os/os.h"
 #include "bsp/bsp.h"
@@ -2836,40 +2837,26 @@ static LPS22HB_Error_et LPS22HB_ReadReg(uint8_t regAddr, uint32_t numByteToRead,
     }
 }
 
+// Max bytes written in one go (registers are consecutive using IF_ADD_INC)
+#define MAX_WRITE_SZ (8)
 static LPS22HB_Error_et LPS22HB_WriteReg(uint8_t regAddr, uint32_t numByteToWrite, uint8_t* data)
 {
-    //If more than 2 bytes are needed to be written, this function has to be updated because for now,
-    //can only write 2 bytes at regAddr (developed like that for more simplicity)
-
     // For write, you write directly in struct the internal address (register) and the data
     int rc = -1;
-    if (numByteToWrite >= 3)
+    if (numByteToWrite > MAX_WRITE_SZ || numByteToWrite == 0)
     {
-        //Max 2 bytes with this driver
         return LPS22HB_ERROR;
     }
-    else if (numByteToWrite == 2)
-    {
-        uint8_t i2c_data[3] = {regAddr, data[0], data[1]};
-        struct hal_i2c_master_data mdata = 
-        {
-            .address = ALTIMETER_I2C_ADDR,
-            .buffer = i2c_data,
-            .len = 3,
-        };
-        rc = hal_i2c_master_write(ALTIMETER_I2C_CHAN, &mdata, I2C_ACCESS_TIMEOUT, 1);
-    }
-    else
+    uint8_t i2c_data[MAX_WRITE_SZ+1];
+    i2c_data[0] = regAddr;
+    memcpy(&i2c_data[1], data, numByteToWrite);
+    struct hal_i2c_master_data mdata = 
     {
-        uint8_t i2c_data[2] = {regAddr, *data};
-        struct hal_i2c_master_data mdata = 
-        {
-            .address = ALTIMETER_I2C_ADDR,
-            .buffer = i2c_data,
-            .len = 2,
-        };
-        rc = hal_i2c_master_write(ALTIMETER_I2C_CHAN, &mdata, I2C_ACCESS_TIMEOUT, 1);
-    }
+        .address = ALTIMETER_I2C_ADDR,
+        .buffer = i2c_data,
+        .len = numByteToWrite+1,
+    };
+    rc = hal_i2c_master_write(ALTIMETER_I2C_CHAN, &mdata, I2C_ACCESS_TIMEOUT, 1);
     if (rc==0) {
         return LPS22HB_OK;
     } 
@@ -2896,6 +2883,11 @@ ALTI_Error_t ALTI_init(void)
 
 ALTI_Error_t ALTI_activate(void)
 {
+    // Leave any FIFO stream mode set by ALTI_startFifo : samples are read directly
+    if (LPS22HB_Set_FifoMode(LPS22HB_FIFO_BYPASS_MODE) != LPS22HB_OK)
+    {
+      return ALTI_ERROR;
+    }
     //Set altimeter mode to Low Noise
     if (LPS22HB_Set_PowerMode(LPS22HB_LowNoise) != LPS22HB_OK)
     {
@@ -2921,6 +2913,11 @@ ALTI_Error_t ALTI_sleep(void)
     {
       return ALTI_ERROR;
     }
+    // Leave any FIFO stream mode set by ALTI_startFifo (this also empties it)
+    if (LPS22HB_Set_FifoMode(LPS22HB_FIFO_BYPASS_MODE) != LPS22HB_OK)
+    {
+      return ALTI_ERROR;
+    }
     return ALTI_SUCCESS;
 }
 
@@ -2937,16 +2934,78 @@ ALTI_Error_t ALTI_calibratePressure(int16_t referencePressure)
     return ALTI_SUCCESS;
 }
 
+// Size of a sample : PRESS_OUT_XL/L/H then TEMP_OUT_L/H
+#define SAMPLE_SZ (5)
+#define FIFO_DEPTH (32)
+// Static as too big for caller stacks
+static uint8_t _fifoBuf[FIFO_DEPTH*SAMPLE_SZ];
+
 ALTI_Error_t ALTI_readAllData(int32_t *pressure, int16_t *temperature)
 {
-    if (ALTI_readPressure(pressure) != ALTI_SUCCESS)
+    uint8_t buffer[SAMPLE_SZ];
+    // Pressure and temp registers are consecutive : read them in one go
+    if (LPS22HB_ReadReg(LPS22HB_PRESS_OUT_XL_REG, SAMPLE_SZ, buffer) != LPS22HB_OK)
     {
       return ALTI_ERROR;
     }
-    if (ALTI_readTemperature(temperature) != ALTI_SUCCESS) 
+    int32_t raw_press = (int32_t)((((uint32_t)buffer[2]) << 24) | (((uint32_t)buffer[1]) << 16) | (((uint32_t)buffer[0]) << 8)) >> 8;
+    *pressure = (raw_press*100)/4096;
+    *temperature = (int16_t)((((uint16_t)buffer[4]) << 8) | (uint16_t)buffer[3]);
+    return ALTI_SUCCESS;
+}
+
+ALTI_Error_t ALTI_startFifo(void)
+{
+    // Low power at 1Hz, FIFO keeps the newest 32 samples until read
+    if (LPS22HB_Set_PowerMode(LPS22HB_LowPower) != LPS22HB_OK)
     {
-        return ALTI_ERROR;
+      return ALTI_ERROR;
+    }
+    if (LPS22HB_Set_FifoMode(LPS22HB_FIFO_STREAM_MODE) != LPS22HB_OK)
+    {
+      return ALTI_ERROR;
+    }
+    if (LPS22HB_Set_Odr(LPS22HB_ODR_1HZ) != LPS22HB_OK)
+    {
+      return ALTI_ERROR;
+    }
+    return ALTI_SUCCESS;
+}
+
+ALTI_Error_t ALTI_readFifo(int32_t *pressure, int16_t *temperature, uint8_t *nbSamples)
+{
+    uint8_t level;
+    *nbSamples = 0;
+    if (LPS22HB_ReadReg(LPS22HB_STATUS_FIFO_REG, 1, &level) != LPS22HB_OK)
+    {
+      return ALTI_ERROR;
+    }
+    level &= LPS22HB_LEVEL_FIFO_MASK;
+    if (level==0) 
+    {
+      return ALTI_SUCCESS;
+    }
+    if (level>FIFO_DEPTH) 
+    {
+      level = FIFO_DEPTH;
+    }
+    // With FIFO enabled the address rolls back from TEMP_OUT_H to PRESS_OUT_XL, so all samples come in one read
+    if (LPS22HB_ReadReg(LPS22HB_PRESS_OUT_XL_REG, level*SAMPLE_SZ, _fifoBuf) != LPS22HB_OK)
+    {
+      return ALTI_ERROR;
+    }
+    int64_t sumPress = 0;
+    int32_t sumTemp = 0;
+    for(int i=0;i<level;i++) 
+    {
+      uint8_t* s = &_fifoBuf[i*SAMPLE_SZ];
+      sumPress += (int32_t)((((uint32_t)s[2]) << 24) | (((uint32_t)s[1]) << 16) | (((uint32_t)s[0]) << 8)) >> 8;
+      sumTemp += (int16_t)((((uint16_t)s[4]) << 8) | (uint16_t)s[3]);
     }
+    // Average in raw units before scaling to keep the extra resolution
+    *pressure = (int32_t)((sumPress*100)/(4096*level));
+    *temperature = (int16_t)(sumTemp/level);
+    *nbSamples = level;
     return ALTI_SUCCESS;
 }
 
@@ -15,12 +15,15 @@
  * Uses the accelero to provide info about movement, orientation etc
  * Possibility to add callback to be informed when movement is detected
  */
+#include <stdlib.h>
+
 #include "os/os.h"
 #include "bsp/bsp.h"
 #include "hal/hal_i2c.h"
 
 #include "wyres-generic/wutils.h"
 #include "wyres-generic/lowpowermgr.h"
+#include "wyres-generic/gpiomgr.h"
 
 #include "wyres-generic/movementmgr.h"
 #include "wyres-generic/timemgr.h"
@@ -29,9 +32,32 @@
 
 
 #define MAX_MMCBFNS MYNEWT_VAL(MAX_MMCBFNS)
+// Accelero interrupt lines, if wired to the MCU
+#define ACC_INT1_GPIO MYNEWT_VAL(ACC_INT1_GPIO)
+#define ACC_INT2_GPIO MYNEWT_VAL(ACC_INT2_GPIO)
+// Activity classification from accelero fifo batches
+#define ACTIVITY MYNEWT_VAL(MM_ACTIVITY)
+#define FIFO_WTM MYNEWT_VAL(MM_FIFO_WTM)
+#define FIFO_MAX (32)
+// accelero ODR when active (see ACC_activate)
+#define SAMPLE_HZ (10)
+// Need at least this many samples for a classification
+#define MIN_BATCH (8)
+// Classification thresholds, in accelero units (1/64g) on the magnitude of the acceleration
+#define STILL_VAR_MAX       (2)
+#define WALK_PEAK_MIN       (10)
+#define WALK_ZC_MIN_DHZ     (10)        // walking steps in 1-3Hz
+#define WALK_ZC_MAX_DHZ     (30)
+#define ZC_DEADBAND         (2)         // ignore crossings of mean that are just noise
+#if FIFO_WTM > 31
+#error "MM_FIFO_WTM must be <32"
+#endif
 
 static void callMovedCBs();
 static void checkMoved();
+static void callCBs(MM_CBFN_t* cbs);
+static void accIntCB(void* arg);
+static void accIntEvent(struct os_event* e);
 static void checkOrientationChange();
 static MM_ORIENT calcOrient(int8_t x, int8_t y, int8_t z);
 
@@ -39,6 +65,8 @@ static struct {
     // Registered callbacks fns
     MM_CBFN_t movecbs[MAX_MMCBFNS];     
     MM_CBFN_t orientcbs[MAX_MMCBFNS];   
+    MM_CBFN_t activitycbs[MAX_MMCBFNS];   
+    MM_CBFN_t fallshockcbs[MAX_MMCBFNS];   
     // current data from last read
     int8_t x;
     int8_t y;
@@ -51,14 +79,25 @@ static struct {
     uint32_t lastOrientTimeS;
     bool movedSinceLastCheck;
     MM_ORIENT orientation;
+    MM_ACTIVITY_t activity;
+    struct os_event intEvent;           // posted from accelero irq
+    MM_FEATURES_t features;             // of last batch
     LP_ID_t lpUserId;
 } _ctx;
 
+#if ACTIVITY
+static int8_t _batch[FIFO_MAX*3];
+static void checkActivity(uint8_t n);
+#endif
+
 void movement_init(void) 
 {
     //Accelero config
     uint8_t threshold = 0;
     uint8_t duration = 0;
+#ifdef UNITTEST
+    unittest_mm();
+#endif
     // clear context
     memset(&_ctx, 0, sizeof(_ctx));
     _ctx.orientation = UNKNOWN;
@@ -105,6 +144,25 @@ void movement_init(void)
     _ctx.lpUserId = LPMgr_register(NULL);   // no need to tell me
     // We are always ok with deepsleep during idle periods, as no long running actions on the device
     LPMgr_setLPMode(_ctx.lpUserId, LP_DEEPSLEEP);
+
+    // If the accelero int lines are wired, its events are processed as they happen (interrupts are latched in the 
+    // device until its source regs are read, and are active high)
+    _ctx.intEvent.ev_cb = accIntEvent;
+    // (gpiomgr defines irqs disabled : enable them once defined)
+    if (ACC_INT1_GPIO>=0) 
+    {
+        if (GPIO_define_irq("accint1", ACC_INT1_GPIO, accIntCB, NULL, HAL_GPIO_TRIG_RISING, HAL_GPIO_PULL_NONE, LP_DEEPSLEEP, HIGH_Z)!=NULL) 
+        {
+            GPIO_irq_enable(ACC_INT1_GPIO);
+        }
+    }
+    if (ACC_INT2_GPIO>=0) 
+    {
+        if (GPIO_define_irq("accint2", ACC_INT2_GPIO, accIntCB, NULL, HAL_GPIO_TRIG_RISING, HAL_GPIO_PULL_NONE, LP_DEEPSLEEP, HIGH_Z)!=NULL) 
+        {
+            GPIO_irq_enable(ACC_INT2_GPIO);
+        }
+    }
 }
 
 bool MMMgr_registerMovementCB(MM_CBFN_t cb) 
@@ -130,11 +188,39 @@ bool MMMgr_registerOrientationCB(MM_CBFN_t cb) {
     }
     return false;
 }
+bool MMMgr_registerFallShockCB(MM_CBFN_t cb) {
+    for(int i=0;i<MAX_MMCBFNS;i++) 
+    {
+        if (_ctx.fallshockcbs[i]==NULL) 
+        {
+            _ctx.fallshockcbs[i] = cb;
+            return true;
+        }
+    }
+    return false;
+}
+bool MMMgr_registerActivityCB(MM_CBFN_t cb) {
+    for(int i=0;i<MAX_MMCBFNS;i++) 
+    {
+        if (_ctx.activitycbs[i]==NULL) 
+        {
+            _ctx.activitycbs[i] = cb;
+            return true;
+        }
+    }
+    return false;
+}
 
 bool MMMgr_start() {
     // Ignore if already activated
     if (!_ctx.active) {
         _ctx.active = (ACC_activate() == ACC_SUCCESS);
+#if ACTIVITY
+        // Batch samples in the accelero
+        if (_ctx.active && ACC_startFifo(FIFO_WTM) != ACC_SUCCESS) {
+            log_warn("mm: no fifo");
+        }
+#endif
     }
     MMMgr_check();      // update data from device now
     return _ctx.active;
@@ -145,6 +231,10 @@ bool MMMgr_stop() {
     // Ignore if already not active
     if (_ctx.active) {
         _ctx.active=false;
+#if ACTIVITY
+        // Not useful at the low rate in sleep. Activity stays as last seen.
+        ACC_stopFifo();
+#endif
         // This just attempts to put the accelero into its 'lowest' power mode : it should remain accessible, and monitor at least movement events
         return (ACC_sleep() == ACC_SUCCESS);
     }
@@ -156,11 +246,13 @@ bool MMMgr_stop() {
 bool MMMgr_check() 
 {
     bool ret = true;
-    bool hasDetected = false;
+    bool hasMoved = false;
+    bool hasFallOrShock = false;
     // NOTE : we check the hw independantly of the active/sleep status of the device, as 'sleep' should not prevent responses
-    if (ACC_HasDetectedMoved(&hasDetected) == ACC_SUCCESS) 
+    // Both detection sources are read in one access
+    if (ACC_readIntSources(&hasMoved, &hasFallOrShock) == ACC_SUCCESS) 
     {
-        if (hasDetected)
+        if (hasMoved)
         {
             _ctx.movedSinceLastCheck = true;
             _ctx.lastMoveTimeS = TMMgr_getRelTimeSecs();
@@ -168,16 +260,7 @@ bool MMMgr_check()
         } else {
             log_debug("mm:NOT MOVED");
         }
-    }
-    else
-    {
-        log_warn("mm: move read failed");
-        ret = false;
-    }
-    hasDetected = false;
-    if (ACC_HasDetectedFreeFallOrShock(&hasDetected) == ACC_SUCCESS) 
-    {
-        if (hasDetected)
+        if (hasFallOrShock)
         {
             if (_ctx.detectionMode==ACC_FreeFallDetection) {
                 _ctx.lastFallTimeS = TMMgr_getRelTimeSecs();
@@ -186,18 +269,31 @@ bool MMMgr_check()
                 _ctx.lastShockTimeS = TMMgr_getRelTimeSecs();
                 log_debug("mm:SHOCK");
             }
+            callCBs(_ctx.fallshockcbs);
         }
     }
     else
     {
-        log_warn("mm: fall read failed");
+        log_warn("mm: move read failed");
         ret = false;
     }
     int8_t x=_ctx.x;
     int8_t y=_ctx.y;
     int8_t z=_ctx.z;
-    
-    if (ACC_readXYZ(&x, &y, &z) == ACC_SUCCESS)
+    bool xyzOk = false;
+#if ACTIVITY
+    // With fifo on, get the batch and use its newest sample as current xyz
+    uint8_t n = 0;
+    if (_ctx.active && ACC_readFifo(_batch, FIFO_MAX, &n) == ACC_SUCCESS && n>0) 
+    {
+        x = _batch[(n-1)*3];
+        y = _batch[(n-1)*3+1];
+        z = _batch[(n-1)*3+2];
+        xyzOk = true;
+        checkActivity(n);
+    }
+#endif
+    if (xyzOk || ACC_readXYZ(&x, &y, &z) == ACC_SUCCESS)
     {
         if (x!=_ctx.x || y!=_ctx.y || z!=_ctx.z) {
             // change of orientation - record new values and update change timestamp
@@ -254,6 +350,88 @@ MM_ORIENT MMMgr_getOrientation()
 {
     return _ctx.orientation;
 }
+MM_ACTIVITY_t MMMgr_getActivity(MM_FEATURES_t* f) 
+{
+    if (f!=NULL) {
+        *f = _ctx.features;
+    }
+    return _ctx.activity;
+}
+
+// integer square root
+static uint32_t isqrt(uint32_t v) 
+{
+    uint32_t r = 0;
+    uint32_t b = 1u << 30;
+    while (b > v) {
+        b >>= 2;
+    }
+    while (b != 0) {
+        if (v >= r + b) {
+            v -= r + b;
+            r = (r >> 1) + b;
+        } else {
+            r >>= 1;
+        }
+        b >>= 2;
+    }
+    return r;
+}
+
+// Extract features of the acceleration magnitude over the batch, and classify the activity from them
+MM_ACTIVITY_t MMMgr_classifyBatch(const int8_t* xyz, uint8_t n, uint8_t sampleHz, MM_FEATURES_t* f) 
+{
+    uint16_t mag[FIFO_MAX];
+    memset(f, 0, sizeof(MM_FEATURES_t));
+    if (n < MIN_BATCH || sampleHz==0) {
+        return MM_ACT_UNKNOWN;
+    }
+    if (n > FIFO_MAX) {
+        n = FIFO_MAX;
+    }
+    int32_t sum = 0;
+    for(int i=0;i<n;i++) {
+        int32_t x = xyz[i*3], y = xyz[i*3+1], z = xyz[i*3+2];
+        mag[i] = (uint16_t)isqrt((uint32_t)(x*x + y*y + z*z));
+        sum += mag[i];
+    }
+    int32_t mean = sum / n;
+    uint32_t var = 0;
+    uint16_t peak = 0;
+    uint8_t zc = 0;
+    int8_t lastSign = 0;
+    for(int i=0;i<n;i++) {
+        int32_t d = mag[i] - mean;
+        var += (uint32_t)(d*d);
+        peak = max(peak, (uint16_t)abs(d));
+        if (d > ZC_DEADBAND || d < -ZC_DEADBAND) {
+            int8_t sign = (d > 0 ? 1 : -1);
+            if (lastSign != 0 && sign != lastSign) {
+                zc++;
+            }
+            lastSign = sign;
+        }
+    }
+    f->n = n;
+    f->mean = mean;
+    f->var = var / n;
+    f->peak = peak;
+    // 2 crossings per cycle
+    f->zcFreqdHz = (uint16_t)((zc * sampleHz * 10) / (2 * n));
+
+    if (f->var <= STILL_VAR_MAX) {
+        return MM_ACT_STILL;
+    }
+    if (f->peak < WALK_PEAK_MIN) {
+        // continuous low level vibration
+        return MM_ACT_VEHICLE;
+    }
+    if (f->zcFreqdHz >= WALK_ZC_MIN_DHZ && f->zcFreqdHz <= WALK_ZC_MAX_DHZ) {
+        return MM_ACT_WALKING;
+    }
+    // big but irregular
+    return MM_ACT_HANDLING;
+}
 // in units of 1/16g 
 void MMMgr_getXYZ(int8_t* xp, int8_t* yp, int8_t* zp) {
     // Always return our last known values anyway
@@ -266,16 +444,31 @@ void MMMgr_getXYZ(int8_t* xp, int8_t* yp, int8_t* zp) {
 
 
 // internals
-static void callMovedCBs() 
+static void callCBs(MM_CBFN_t* cbs) 
 {
     for(int i=0;i<MAX_MMCBFNS;i++) 
     {
-        if (_ctx.movecbs[i]!=NULL) 
+        if (cbs[i]!=NULL) 
         {
-            (*_ctx.movecbs[i])();
+            (*cbs[i])();
         }
     }
 }
+static void callMovedCBs() 
+{
+    callCBs(_ctx.movecbs);
+}
+
+// In irq context : defer the device read to the default task
+static void accIntCB(void* arg) 
+{
+    os_eventq_put(os_eventq_dflt_get(), &_ctx.intEvent);
+}
+// Read the sources (once for both lines), fifo and xyz, calling the relevant callbacks
+static void accIntEvent(struct os_event* e) 
+{
+    MMMgr_check();
+}
 static void checkMoved() 
 {
     if (_ctx.movedSinceLastCheck) 
@@ -303,6 +496,25 @@ static MM_ORIENT calcOrient(int8_t x, int8_t y, int8_t z) {
     return UNKNOWN;
 }
 
+#if ACTIVITY
+static void checkActivity(uint8_t n) 
+{
+    MM_ACTIVITY_t a = MMMgr_classifyBatch(_batch, n, SAMPLE_HZ, &_ctx.features);
+    if (a != MM_ACT_UNKNOWN && a != _ctx.activity) 
+    {
+        log_debug("mm:activity %d", a);
+        _ctx.activity = a;
+        for(int i=0;i<MAX_MMCBFNS;i++) 
+        {
+            if (_ctx.activitycbs[i]!=NULL) 
+            {
+                (*_ctx.activitycbs[i])();
+            }
+        }
+    }
+}
+#endif
+
 static void checkOrientationChange() 
 {
     MM_ORIENT o = calcOrient(_ctx.x, _ctx.y, _ctx.z);
@@ -319,3 +531,35 @@ static void checkOrientationChange()
         }
     }
 }
+
+#ifdef UNITTEST
+// Replay synthetic traces through the classifier
+bool unittest_mm() {
+    bool ret = true;        // assume all will go ok
+    int8_t t[20*3];
+    MM_FEATURES_t f;
+    // lying flat, only noise
+    for(int i=0;i<20;i++) {
+        t[i*3] = 0; t[i*3+1] = (i&1); t[i*3+2] = 64;
+    }
+    ret &= unittest("still", MMMgr_classifyBatch(t, 20, 10, &f)==MM_ACT_STILL);
+    // walking : ~2Hz bounce of +/-0.3g on vertical
+    static const int8_t walk[5] = { 0, 18, 0, -18, -8 };
+    for(int i=0;i<20;i++) {
+        t[i*3] = 4; t[i*3+1] = 64 + walk[i%5]; t[i*3+2] = 2;
+    }
+    ret &= unittest("walking", MMMgr_classifyBatch(t, 20, 10, &f)==MM_ACT_WALKING);
+    // vehicle : small vibration
+    for(int i=0;i<20;i++) {
+        t[i*3] = 0; t[i*3+1] = 0; t[i*3+2] = 64 + ((i&1) ? 4 : -4);
+    }
+    ret &= unittest("vehicle", MMMgr_classifyBatch(t, 20, 10, &f)==MM_ACT_VEHICLE);
+    // handling : one big swing then still
+    for(int i=0;i<20;i++) {
+        t[i*3] = (i>=5 && i<12) ? 60 : 0; t[i*3+1] = 0; t[i*3+2] = 64;
+    }
+    ret &= unittest("handling", MMMgr_classifyBatch(t, 20, 10, &f)==MM_ACT_HANDLING);
+    ret &= unittest("too short", MMMgr_classifyBatch(t, 4, 10, &f)==MM_ACT_UNKNOWN);
+    return ret;
+}
+#endif /* UNITTEST */
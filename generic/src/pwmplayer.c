@@ -13,6 +13,8 @@
 
 /** Tone player : plays pwm (tone or whatever) sequences using PWM output on one or more IO pins 
  * Uses default event q for callout timers which may impact the precision of the tone lengths
+ * Notes are mapped to frequencies with a const integer table (no float ops), and consecutive queued tones of the
+ * same frequency are merged so they play without a timer callout or PWM restart between them.
 */
 
 #include <string.h>
@@ -21,7 +23,6 @@
 #include "os/os.h"
 #include "bsp/bsp.h"
 #include "hal/hal_gpio.h"
-#include <math.h>
 
 #include "wyres-generic/wutils.h"
 #include "wyres-generic/gpiomgr.h"
@@ -41,6 +42,8 @@ typedef struct {
     const char* name;       // also used to idicate if entry is in use
     int8_t pin;
     bool playing;
+    uint16_t curFreq;       // tone currently output (0=none)
+    uint8_t curDuty;
     struct {
         uint8_t head;
         uint8_t tail;
@@ -61,7 +64,7 @@ static struct {
 static bool isPlaying(PWMGPIO* p);
 static bool playNextPWMEntry(PWMGPIO* p);
 static int findDur(const char dur);
-static float findNote(const char note, const char modif);
+static uint16_t noteFreq(uint8_t noteIdx);
 static PWMGPIO* checkPin(int8_t gpio);
 static void tone_ev_cb(struct os_event *ev);
 
@@ -124,9 +127,26 @@ bool PWM_addNote(int8_t gpio, char note, char modif, char dur, int beat) {
     if (p==NULL) {
         return false;
     }
-    float freq = findNote(note, modif);
     int durMS = (((findDur(dur) * 1000)/CROTCHET_NOMINAL_DUR) * 60)/beat;      // logically ((note dur in secs if crotchet=1s) / (beat/60)) *1000
-    return PWM_addPWM(gpio, (int)freq, 50, durMS);
+    return PWM_addPWM(gpio, noteFreq(PWM_NOTEIDX(note, modif)), 50, durMS);
+}
+// Add a precompiled melody (see PWM_NOTE()) to the queue for the given pin. Returns false (and adds nothing) if it doesn't fit.
+bool PWM_playMelody(int8_t gpio, const PWM_NOTE_t* melody, int nbNotes, int beat) {
+    PWMGPIO* p = checkPin(gpio);
+    if (p==NULL) {
+        log_warn("PWM[%d] not found", gpio);
+        return false;
+    }
+    assert(melody!=NULL);
+    if (nbNotes > (MODQ((p->q.head-1) - p->q.tail))) {
+        log_warn("PWM[%d] play too long %d", gpio, nbNotes);
+        return false;
+    }
+    for(int i=0;i<nbNotes;i++) {
+        int durMS = (((melody[i].dur * 1000)/CROTCHET_NOMINAL_DUR) * 60)/beat;
+        PWM_addPWM(gpio, noteFreq(melody[i].note), 50, durMS);
+    }
+    return true;
 }
 // Add a pwm tone to the queue for the given pin. Returns ture if ok, false if the queue is full
 bool PWM_addPWM(int8_t gpio, int freq, int duty, int durationMS) {
@@ -134,6 +154,15 @@ bool PWM_addPWM(int8_t gpio, int freq, int duty, int durationMS) {
     if (p==NULL) {
         return false;
     }
+    // Same tone as the last one queued (and not yet playing)? just make it longer, so no callout/restart between them
+    if (p->q.head!=p->q.tail) {
+        int last = MODQ(p->q.head-1);
+        if (p->q.tone[last].freq==(uint16_t)freq && p->q.tone[last].duty==(uint8_t)duty &&
+                (p->q.tone[last].durMS + durationMS) <= UINT16_MAX) {
+            p->q.tone[last].durMS += (uint16_t)durationMS;
+            return true;
+        }
+    }
     if (p->q.head == (MODQ(p->q.tail-1))) {
         // full
         return false;
@@ -164,6 +193,7 @@ void PWM_flush(int8_t gpio) {
         os_callout_stop(&p->durTimer);
         GPIO_writePWM(p->pin, 0, 0);
         p->playing = false;
+        p->curFreq = 0;
     }
 }
 
@@ -179,14 +209,19 @@ static bool playNextPWMEntry(PWMGPIO* p) {
         // Stop last note
         GPIO_writePWM(p->pin, 0, 0);
         p->playing=false;
+        p->curFreq = 0;
 //        log_info("PWM[%d]:play end", p->pin);
         return false;       // nothing to play as tail caught up to head
     }
     p->playing=true;        // now we're playing something (note this applies even if playing silence)
 //    log_info("PWM[%d]:@%dHz for %d ms", p->pin, p->q.tone[p->q.tail].freq, p->q.tone[p->q.tail].durMS);
 
-    // Start PWM
-    GPIO_writePWM(p->pin, p->q.tone[p->q.tail].freq, p->q.tone[p->q.tail].duty);
+    // Start PWM (unless its already outputing this tone)
+    if (p->q.tone[p->q.tail].freq!=p->curFreq || p->q.tone[p->q.tail].duty!=p->curDuty) {
+        GPIO_writePWM(p->pin, p->q.tone[p->q.tail].freq, p->q.tone[p->q.tail].duty);
+        p->curFreq = p->q.tone[p->q.tail].freq;
+        p->curDuty = p->q.tone[p->q.tail].duty;
+    }
 
     // start timer to move to next entry when this one done
     os_callout_reset(&p->durTimer, (p->q.tone[p->q.tail].durMS * OS_TICKS_PER_SEC)/1000);
@@ -197,38 +232,24 @@ static bool playNextPWMEntry(PWMGPIO* p) {
 }
 
 static int findDur(const char dur) {
-    switch(dur) {
-        case 'm': return CROTCHET_NOMINAL_DUR*2;
-        case 'c': return CROTCHET_NOMINAL_DUR;
-        case 'q': return CROTCHET_NOMINAL_DUR/2;
-        case 's': return CROTCHET_NOMINAL_DUR/4;
-        case 'd': return CROTCHET_NOMINAL_DUR/8;
-        case 'h': return CROTCHET_NOMINAL_DUR/16;
-        default : return CROTCHET_NOMINAL_DUR;
-    }
+    return PWM_DURUNITS(dur);
 }
-// Mapping of note names to frequencies. As the intervals are not constant (what?), accidentals are a duplicate of the note below with the correct frequency. Hence
-// if you find your note name, then the sharped value is entry+1, and the flattened is entry-1.
-// Starts with the 'silent note' at f=0, then a dummy note to handle A_ (A flat).
-static struct {
-    char n;
-    float f;
-} NOTE2FREQ[] = {
-    {.n='S', .f=0},{.n='Z', .f=207.65},{.n='A', .f=220.0},{.n='A', .f=238.08},{.n='B', .f=246.94},{.n='C', .f=261.63},{.n='C', .f=277.18},{.n='D', .f=293.66},{.n='D', .f=311.13},{.n='E', .f=329.63},{.n='F', .f=349.23},{.n='F', .f=369.99},{.n='G', .f=392.0},{.n='G', .f=415.30},
-    {.n='a', .f=440},{.n='a', .f=466.16},{.n='b', .f=493.88},{.n='c', .f=523.25},{.n='c', .f=554.37},{.n='d', .f=587.33},{.n='d', .f=622.25},{.n='e', .f=659.25},{.n='f', .f=698.46},{.n='f', .f=739.99},{.n='g', .f=783.99},{.n='g', .f=830.61},
+// Frequency in Hz of each semitone from G#3 (index 0) to G#5, as given by PWM_NOTEIDX(). Integer values as that is what the
+// PWM hal takes anyway, and avoids any float ops at play time
+static const uint16_t NOTE2FREQ[PWM_NB_NOTES] = {
+    208, 220, 233, 247, 262, 277, 294, 311, 330, 349, 370, 392,     // G#3 A3 .. G4  (A..G)
+    415, 440, 466, 494, 523, 554, 587, 622, 659, 698, 740, 784,     // G#4 A4 .. G5  (a..g)
+    831,
 };
-// Get frequency in Hz based on note name and modifier
-static float findNote(const char note, const char modif) {
-    for(int i=0;i<(sizeof(NOTE2FREQ)/sizeof(NOTE2FREQ[0]));i++) {
-        if (NOTE2FREQ[i].n==note) {
-            switch(modif) {
-                case '#': return NOTE2FREQ[i+1].f;
-                case '_':return NOTE2FREQ[i-1].f;
-                default: return NOTE2FREQ[i].f;
-            }
-        }
-    }  
-    return 440.0;
+// Get frequency in Hz of a note index
+static uint16_t noteFreq(uint8_t noteIdx) {
+    if (noteIdx==PWM_SILENCE) {
+        return 0;
+    }
+    if (noteIdx>=PWM_NB_NOTES) {
+        return 440;
+    }
+    return NOTE2FREQ[noteIdx];
 }
 
 // Find or allocate gpio slot
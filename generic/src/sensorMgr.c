@@ -13,6 +13,8 @@
 /**
  * Sensor manager. 
  * Works on a start/stop basis, records the values which can be read at any time
+ * Each sensor channel is sampled at most once per its configured period (so slow changing values are not re-read
+ * on every get), with optional oversampling and filtering of the samples.
  */
 #include "os/os.h"
 #include "bsp/bsp.h"
@@ -26,6 +28,7 @@
 
 #include "wyres-generic/lowpowermgr.h"
 #include "wyres-generic/sensormgr.h"
+#include "wyres-generic/sm_exec.h"
 #include "wyres-generic/configmgr.h"
 #include "wyres-generic/ALTI_basic.h"
 #include "wyres-generic/HUMIDITY_basic.h"
@@ -50,6 +53,57 @@
 
 #define LIGHT_MAX				3950
 #define LIGHT_MIN				20
+// Light sensor only powered around its reads (else powered while sensors are started), and time for it to be valid after powering it
+#define LIGHT_PWR_PULSE         MYNEWT_VAL(SR_LIGHT_PWR_PULSE)
+#define LIGHT_SETTLE_MS         MYNEWT_VAL(SR_LIGHT_SETTLE_MS)
+// History entries kept per channel (each 4 bytes)
+#define HISTORY_SZ              MYNEWT_VAL(SR_HISTORY_SZ)
+// Rule channels without a sampling period are sampled this often for their rule, whether the app reads them or not
+#define RULE_POLL_SECS          MYNEWT_VAL(SR_RULE_POLL_SECS)
+// Alti samples continuously at low rate into its FIFO, which is averaged at each pressure sample
+#define PRESSURE_FIFO           MYNEWT_VAL(SR_PRESSURE_FIFO)
+#if HISTORY_SZ > 255
+#error "SR_HISTORY_SZ must be <256"
+#endif
+
+#if HISTORY_SZ > 0
+// Ring of samples, each stored as delta value/time from the previous one. Oldest one is kept as absolute in base.
+// Only changes are recorded (a value holds until the next entry), at most one entry per second.
+struct sr_hist {
+    int32_t baseVal;            // value of oldest entry
+    uint32_t baseTS;            // timestamp of oldest entry
+    int32_t lastVal;            // value of newest entry
+    uint32_t lastTS;            // timestamp of newest entry
+    uint32_t seq;               // sequence number of newest entry (first ever is 1)
+    uint8_t first;              // index of oldest entry (its delta is unused)
+    uint8_t count;
+    struct {
+        int16_t dv;
+        uint16_t dt;
+    } e[HISTORY_SZ];
+};
+#endif
+
+// Per channel acquisition config and filter state
+struct sr_chan {
+    uint32_t periodSecs;        // min time between samples, 0=sample at every read
+    uint32_t lastSampleTS;      // in seconds since boot
+    uint8_t oversample;         // raw reads averaged per sample
+    uint8_t filter;             // SR_FILTER_t
+    uint8_t ewmaShift;          // EWMA alpha = 1/2^ewmaShift
+    uint8_t nSamples;           // samples taken (saturates at 3)
+    int32_t ewmaAcc;            // EWMA value scaled by 2^ewmaShift
+    int32_t last3[3];           // last samples for median
+#if HISTORY_SZ > 0
+    struct sr_hist hist;
+#endif
+    // change detection rule and its state
+    SR_RULE_t rule;
+    bool ruleRefSet;            // ref/prev set from a first sample
+    bool ruleHigh;              // LEVEL : currently above threshold
+    int32_t ruleRef;            // DELTA : value at last trigger, RATE : previous value
+    uint32_t rulePrevTS;        // RATE : time of previous value
+};
 
 // store values in between checks
 static struct {
@@ -73,6 +127,14 @@ static struct {
         SR_NOISE_CBFN_t fn;
         void* ctx;
     } noiseCBs[MAX_CBS];
+    struct {
+        SR_RULE_CBFN_t fn;
+        void* ctx;
+    } ruleCBs[MAX_CBS];
+    SM_ID_t ruleSM;
+    int ruleSMEvent;
+    struct os_callout ruleTimer;        // samples the channels with rules
+    uint32_t rulePeriodSecs;            // 0 = no rules to check
     uint32_t lastReadTS;                // in seconds since boot
     bool isActive;
     int16_t currTempcC;
@@ -92,6 +154,7 @@ static struct {
     uint16_t currADC2mV;
     uint16_t lastADC1mV;
     uint16_t lastADC2mV;
+    struct sr_chan chans[SR_NB_CHANS];
 } _ctx;    // memset'd all to 0 in init()
 
 // Timeout for I2C accesses in 'ticks'
@@ -103,10 +166,19 @@ static bool config();
 static bool readEnv();
 static void deconfig();
 static uint32_t delta(int a, int b);
-static uint8_t deltaPercent(int a, int b);
+static uint16_t deltaPercent(int a, int b);
 static void buttonCheckDebounced(struct os_event* e);
 static uint8_t mapButton(int in);
 static LIGHT_STATE_t mapLight(uint8_t reading);
+static bool isDue(SR_CHAN_t ch, uint32_t now);
+static int32_t filterSample(SR_CHAN_t ch, int32_t v, uint32_t now);
+static int readADCAvg(int8_t gpio, uint8_t n);
+static void histAdd(struct sr_chan* c, int32_t v, uint32_t now);
+static void ruleCheck(SR_CHAN_t ch, int32_t v, uint32_t now);
+static void loadRule(SR_CHAN_t ch);
+static void ruleTimerReset();
+static void ruleTimerCB(struct os_event* e);
+static void cfgChangeCB(void* ctx, uint16_t key);
 
 // Called from sysinit
 void SRMgr_init(void) 
@@ -115,6 +187,19 @@ void SRMgr_init(void)
     for(int i=0;i<MAX_BUTTONS;i++) {
         _ctx.buttons[i].io = -1;        // no buttons defined yet
     }
+    os_callout_init(&_ctx.ruleTimer, os_eventq_dflt_get(), ruleTimerCB, NULL);
+    // By default everything is read at each access, no filtering
+    for(int i=0;i<SR_NB_CHANS;i++) {
+        SRMgr_configChannel(i, 0, 1, SR_FILTER_NONE, 0);
+    }
+    // Average battery a little as battery value changes slowly over time
+    SRMgr_configChannel(SR_CHAN_BATT, 0, 1, SR_FILTER_EWMA, 1);
+    // Change detection rules are in config, and reloaded if changed there
+    for(int i=0;i<SR_NB_CHANS;i++) {
+        loadRule(i);
+    }
+    CFMgr_registerCB(cfgChangeCB);
+    ruleTimerReset();
 
     // config alti on i2c
     if (ALTI_init() != ALTI_SUCCESS)
@@ -123,6 +208,13 @@ void SRMgr_init(void)
         // badness we stop here
         wassert_hw_fault();
     }
+#if PRESSURE_FIFO
+    // Start buffering right away
+    if (ALTI_startFifo() != ALTI_SUCCESS)
+    {
+        log_warn("SM:Err alti fifo");
+    }
+#endif
     // Try to find a humidity sensor
     if (HUMIDITY_present() && HUMIDITY_init() != HUMIDITY_SUCCESS)
     {
@@ -159,6 +251,148 @@ void SRMgr_stop()
     LPMgr_setLPMode(_ctx.lpUserId, LP_DEEPSLEEP);
 }
 
+// Set change detection rule for a channel (saved in config)
+bool SRMgr_setRule(SR_CHAN_t ch, const SR_RULE_t* rule) 
+{
+    if (ch>=SR_NB_CHANS || rule==NULL) {
+        return false;
+    }
+    // config callback reloads it
+    return CFMgr_setElement(CFG_UTIL_KEY_SR_RULE(ch), (void*)rule, sizeof(SR_RULE_t));
+}
+
+bool SRMgr_registerRuleCB(SR_RULE_CBFN_t cb, void* c) 
+{
+    for(int i=0;i<MAX_CBS;i++) 
+    {
+        if (_ctx.ruleCBs[i].fn==NULL) 
+        {
+            _ctx.ruleCBs[i].fn = cb;
+            _ctx.ruleCBs[i].ctx = c;
+            return true;
+        }
+    }
+    return false;       // no space
+}
+
+void SRMgr_unregisterRuleCB(SR_RULE_CBFN_t cb) 
+{
+    for(int i=0;i<MAX_CBS;i++) 
+    {
+        if (_ctx.ruleCBs[i].fn==cb) 
+        {
+            _ctx.ruleCBs[i].fn = NULL;
+        }
+    }
+}
+
+void SRMgr_setRuleSMEvent(SM_ID_t sm, int e) 
+{
+    _ctx.ruleSM = sm;
+    _ctx.ruleSMEvent = e;
+}
+
+// Get min/max/mean of channel history over last windowSecs (0=all of it), returns number of samples used
+int SRMgr_getStats(SR_CHAN_t ch, uint32_t windowSecs, int32_t* minv, int32_t* maxv, int32_t* mean) 
+{
+    int n = 0;
+#if HISTORY_SZ > 0
+    if (ch>=SR_NB_CHANS) {
+        return 0;
+    }
+    struct sr_hist* h = &_ctx.chans[ch].hist;
+    uint32_t now = TMMgr_getRelTimeSecs();
+    int32_t v = h->baseVal;
+    uint32_t ts = h->baseTS;
+    int64_t sum = 0;
+    for(int i=0;i<h->count;i++) {
+        if (i>0) {
+            uint8_t idx = (h->first+i) % HISTORY_SZ;
+            v += h->e[idx].dv;
+            ts += h->e[idx].dt;
+        }
+        // each value holds until the next entry (or now for the newest) : used if that overlaps the window
+        uint32_t until = (i<h->count-1 ? ts + h->e[(h->first+i+1) % HISTORY_SZ].dt : now);
+        if (windowSecs==0 || (now - until) <= windowSecs) {
+            if (n==0) {
+                *minv = *maxv = v;
+            } else {
+                *minv = min(*minv, v);
+                *maxv = max(*maxv, v);
+            }
+            sum += v;
+            n++;
+        }
+    }
+    if (n>0) {
+        *mean = (int32_t)(sum / n);
+    }
+#endif
+    return n;
+}
+
+// Copy channel history samples from sequence number *seq on into out, oldest first, and update *seq to continue from.
+// Returns number copied.
+int SRMgr_exportHistory(SR_CHAN_t ch, uint32_t* seq, SR_SAMPLE_t* out, int maxSamples) 
+{
+    int n = 0;
+#if HISTORY_SZ > 0
+    if (ch>=SR_NB_CHANS || seq==NULL) {
+        return 0;
+    }
+    struct sr_hist* h = &_ctx.chans[ch].hist;
+    uint32_t oldestSeq = h->seq - h->count + 1;
+    // those before the oldest are gone : start from the oldest
+    int i = (*seq > oldestSeq ? (int)(*seq - oldestSeq) : 0);
+    int32_t v = h->baseVal;
+    uint32_t ts = h->baseTS;
+    for(int j=1;j<=i && j<h->count;j++) {
+        uint8_t idx = (h->first+j) % HISTORY_SZ;
+        v += h->e[idx].dv;
+        ts += h->e[idx].dt;
+    }
+    for(;i<h->count && n<maxSamples;i++) {
+        if (n>0) {
+            uint8_t idx = (h->first+i) % HISTORY_SZ;
+            v += h->e[idx].dv;
+            ts += h->e[idx].dt;
+        }
+        out[n].ts = ts;
+        out[n].value = v;
+        n++;
+    }
+    if (n>0 || *seq<oldestSeq) {
+        *seq = oldestSeq + i;
+    }
+#endif
+    return n;
+}
+
+void SRMgr_clearHistory(SR_CHAN_t ch) 
+{
+#if HISTORY_SZ > 0
+    if (ch<SR_NB_CHANS) {
+        _ctx.chans[ch].hist.count = 0;
+    }
+#endif
+}
+
+// Configure acquisition of a sensor channel
+bool SRMgr_configChannel(SR_CHAN_t ch, uint32_t periodSecs, uint8_t oversample, SR_FILTER_t filter, uint8_t ewmaShift) {
+    if (ch>=SR_NB_CHANS || ewmaShift>8) {
+        return false;
+    }
+    struct sr_chan* c = &_ctx.chans[ch];
+    c->periodSecs = periodSecs;
+    c->oversample = (oversample>0 ? oversample : 1);
+    c->filter = filter;
+    c->ewmaShift = ewmaShift;
+    // restart filter with next sample
+    c->nSamples = 0;
+    ruleTimerReset();
+    return true;
+}
+
 /** Define a gpio as a button, ie with debounce and IRQ execution */
 bool SRMgr_defineButton(int8_t gpio) {
     if (gpio>=0)
@@ -541,8 +775,8 @@ static bool config()
         // Note the ADC ones will work but return 0 on read if ADC not enabled
         if (LIGHT_SENSOR>=0) 
         {
-            // Must activate GPIO that provides power to it
-            GPIO_define_out("micropower", SENSOR_PWR, 1, LP_DOZE, OUT_0);
+            // GPIO that provides power to it is on while we are active, or only while we sample it if pulsing
+            GPIO_define_out("micropower", SENSOR_PWR, (LIGHT_PWR_PULSE?0:1), LP_DOZE, OUT_0);
             GPIO_define_adc("light", LIGHT_SENSOR, LIGHT_SENSOR_ADCCHAN, LP_DOZE, HIGH_Z);
     //        log_debug("SM light");
         }
@@ -559,7 +793,12 @@ static bool config()
             GPIO_define_adc("battery", BATTERY_GPIO, BATTERY_ADCCHAN, LP_DOZE, HIGH_Z); //TODO : double check "HIGH_Z"
     //        log_debug("SM:batt");
         }
+#if PRESSURE_FIFO
+        // alti stays in its fifo mode
+        if (ALTI_startFifo() != ALTI_SUCCESS)
+#else
         if (ALTI_activate() != ALTI_SUCCESS)
+#endif
         {
             log_warn("SM:Erractivate alti");
             return false;
@@ -578,36 +817,46 @@ static bool config()
 }
 
 
-// read stuff into current values
-// TODO add ability to average/smooth certain values?
+// read stuff into current values : only channels whose period has elapsed are sampled
 static bool readEnv() 
 {
     bool ret=true;
     if (_ctx.isActive) 
     {
-        _ctx.lastReadTS = TMMgr_getRelTimeSecs();
+        uint32_t now = TMMgr_getRelTimeSecs();
+        _ctx.lastReadTS = now;
 
         for(int i=0;i<MAX_BUTTONS;i++) {
             if (_ctx.buttons[i].io>=0) {
                 _ctx.buttons[i].currButtonState = mapButton(GPIO_read(_ctx.buttons[i].io));
             }
         }
-        if (BATTERY_GPIO>=0) 
+        if (BATTERY_GPIO>=0 && isDue(SR_CHAN_BATT, now)) 
         {
-            int newvalue = GPIO_readADC(BATTERY_GPIO);       
+            int newvalue = readADCAvg(BATTERY_GPIO, _ctx.chans[SR_CHAN_BATT].oversample);
             // We don't use the VREF from calibValues here, rather a constant calculation
             // calculate the Voltage in millivolt
             if (newvalue > 0) {
                 newvalue = ( uint32_t )ADC_VREF_BANDGAP * ( uint32_t )ADC_MAX_VALUE / ( uint32_t )newvalue;
             }
-            _ctx.currBattmV = (newvalue + _ctx.currBattmV)/2;   // Average it a little as battery value changes slowly over time
+            _ctx.currBattmV = (uint16_t)filterSample(SR_CHAN_BATT, newvalue, now);
 //            log_debug("S bat %d", _ctx.currBattmV);
         }
-        if (LIGHT_SENSOR>=0) 
+        if (LIGHT_SENSOR>=0 && isDue(SR_CHAN_LIGHT, now)) 
         {
             uint16_t rawLightLevel = 0;
             uint16_t formatedLightLevel = 0;
-            rawLightLevel = GPIO_readADC(LIGHT_SENSOR);  
+#if LIGHT_PWR_PULSE
+            // power it just for the time of the reads : this blocks the caller for the settle time
+            GPIO_write(SENSOR_PWR, 1);
+            if (LIGHT_SETTLE_MS>0) {
+                os_time_delay(os_time_ms_to_ticks32(LIGHT_SETTLE_MS));
+            }
+#endif
+            rawLightLevel = readADCAvg(LIGHT_SENSOR, _ctx.chans[SR_CHAN_LIGHT].oversample);  
+#if LIGHT_PWR_PULSE
+            GPIO_write(SENSOR_PWR, 0);
+#endif
             if (rawLightLevel > LIGHT_MAX)
             {
                 formatedLightLevel = 0xFF;
@@ -620,35 +869,308 @@ static bool readEnv()
             {
                 formatedLightLevel = ((rawLightLevel * 0xFF) / LIGHT_MAX);
             }
-            _ctx.currLight = (uint8_t)formatedLightLevel;
+            _ctx.currLight = (uint8_t)filterSample(SR_CHAN_LIGHT, formatedLightLevel, now);
 //            log_debug("S lum %d", _ctx.currLight);
         }
-        if (GPIO_ADC1>=0) 
+        if (GPIO_ADC1>=0 && isDue(SR_CHAN_ADC1, now)) 
         {
-            _ctx.currADC1mV = GPIO_readADC(GPIO_ADC1);
+            _ctx.currADC1mV = (uint16_t)filterSample(SR_CHAN_ADC1, readADCAvg(GPIO_ADC1, _ctx.chans[SR_CHAN_ADC1].oversample), now);
         }
-        if (GPIO_ADC2>=0) 
+        if (GPIO_ADC2>=0 && isDue(SR_CHAN_ADC2, now)) 
         {
-            _ctx.currADC2mV = GPIO_readADC(GPIO_ADC2);
+            _ctx.currADC2mV = (uint16_t)filterSample(SR_CHAN_ADC2, readADCAvg(GPIO_ADC2, _ctx.chans[SR_CHAN_ADC2].oversample), now);
         }
-        if (ALTI_readAllData(&_ctx.currPressurePa, &_ctx.currTempcC) != ALTI_SUCCESS)
+        // The i2c sensors are all read together in one go if any of their channels is due
+        if (isDue(SR_CHAN_PRESSURE, now) || isDue(SR_CHAN_TEMP, now) || isDue(SR_CHAN_HUMIDITY, now)) 
         {
-            log_warn("SM:Err read alti");
-            ret = false;
-        } else {
-            //            log_debug("SM:temp %d", _ctx.currTempdC);
-            //            log_debug("SM:press %d", _ctx.currPressurePa);
+            int32_t pressurePa = 0;
+            int16_t tempcC = 0;
+            bool tempOk = false;
+            bool readAlti = true;
+#if PRESSURE_FIFO
+            // Get average of all samples since last time in one read
+            uint8_t nbSamples = 0;
+            if (ALTI_readFifo(&pressurePa, &tempcC, &nbSamples) != ALTI_SUCCESS)
+            {
+                log_warn("SM:Err read alti fifo");
+                ret = false;
+            } else if (nbSamples>0) {
+                _ctx.currPressurePa = filterSample(SR_CHAN_PRESSURE, pressurePa, now);
+                tempOk = true;
+            } 
+            // if no new sample since last time : keep current values, unless we don't have any yet
+            readAlti = (nbSamples==0 && _ctx.chans[SR_CHAN_PRESSURE].nSamples==0);
+#endif
+            if (readAlti) 
+            {
+                if (ALTI_readAllData(&pressurePa, &tempcC) != ALTI_SUCCESS)
+                {
+                    log_warn("SM:Err read alti");
+                    ret = false;
+                } else {
+                    _ctx.currPressurePa = filterSample(SR_CHAN_PRESSURE, pressurePa, now);
+                    tempOk = true;
+                    //            log_debug("SM:temp %d", _ctx.currTempdC);
+                    //            log_debug("SM:press %d", _ctx.currPressurePa);
+                }
+            }
+            if (HUMIDITY_present()) 
+            {
+                int8_t relHumidity = 0;
+                if (HUMIDITY_readAllData(&relHumidity, &tempcC) != HUMIDITY_SUCCESS)
+                {
+                    log_warn("SM:Err read humidity");
+                    ret = false;
+                } else {
+                    _ctx.currRelHumidity = (int8_t)filterSample(SR_CHAN_HUMIDITY, relHumidity, now);
+                    tempOk = true;
+                }
+            } 
+            if (tempOk) 
+            {
+                _ctx.currTempcC = (int16_t)filterSample(SR_CHAN_TEMP, tempcC, now);
+            }
         }
-        if (HUMIDITY_present() && HUMIDITY_readAllData(&_ctx.currRelHumidity, &_ctx.currTempcC) != HUMIDITY_SUCCESS)
-        {
-            log_warn("SM:Err read humidity");
-            ret = false;
-        } 
+    }
+    return ret;
+}
 
+// Channel needs a new sample?
+static bool isDue(SR_CHAN_t ch, uint32_t now) 
+{
+    struct sr_chan* c = &_ctx.chans[ch];
+    return (c->nSamples==0 || c->periodSecs==0 || (now - c->lastSampleTS) >= c->periodSecs);
+}
+
+// Run a new sample through the channel's filter and return the filtered value
+static int32_t filterSample(SR_CHAN_t ch, int32_t v, uint32_t now) 
+{
+    struct sr_chan* c = &_ctx.chans[ch];
+    c->lastSampleTS = now;
+    // keep last 3 for median
+    c->last3[2] = c->last3[1];
+    c->last3[1] = c->last3[0];
+    c->last3[0] = v;
+    if (c->nSamples==0) {
+        // first sample starts the filter
+        c->ewmaAcc = v * (1<<c->ewmaShift);
+        c->last3[1] = v;
+        c->last3[2] = v;
     }
+    if (c->nSamples<3) {
+        c->nSamples++;
+    }
+    int32_t ret = v;
+    switch(c->filter) {
+        case SR_FILTER_EWMA: {
+            c->ewmaAcc += v - (c->ewmaAcc / (1<<c->ewmaShift));
+            ret = c->ewmaAcc / (1<<c->ewmaShift);
+            break;
+        }
+        case SR_FILTER_MEDIAN3: {
+            int32_t a = c->last3[0], b = c->last3[1], d = c->last3[2];
+            ret = max(min(a,b), min(max(a,b),d));
+            break;
+        }
+        default:
+            break;
+    }
+    histAdd(c, ret, now);
+    ruleCheck(ch, ret, now);
     return ret;
 }
 
+// Evaluate channel's rule with a new sample, and tell registered parties if it triggers
+static void ruleCheck(SR_CHAN_t ch, int32_t v, uint32_t now) 
+{
+    struct sr_chan* c = &_ctx.chans[ch];
+    if (c->rule.type==SR_RULE_NONE) {
+        return;
+    }
+    if (!c->ruleRefSet) {
+        c->ruleRef = v;
+        c->rulePrevTS = now;
+        c->ruleHigh = (v > c->rule.threshold);
+        c->ruleRefSet = true;
+        return;
+    }
+    bool fire = false;
+    switch(c->rule.type) {
+        case SR_RULE_DELTA: {
+            if (delta(v, c->ruleRef) > (uint32_t)c->rule.threshold) {
+                c->ruleRef = v;
+                fire = true;
+            }
+            break;
+        }
+        case SR_RULE_DELTA_PCT: {
+            if (deltaPercent(v, c->ruleRef) > c->rule.threshold) {
+                c->ruleRef = v;
+                fire = true;
+            }
+            break;
+        }
+        case SR_RULE_LEVEL: {
+            if (!c->ruleHigh && v > c->rule.threshold) {
+                c->ruleHigh = true;
+                fire = true;
+            } else if (c->ruleHigh && v < (c->rule.threshold - c->rule.hysteresis)) {
+                c->ruleHigh = false;
+                fire = true;
+            }
+            break;
+        }
+        case SR_RULE_RATE: {
+            // only once some time has passed, else accumulate until it has
+            if (now != c->rulePrevTS) {
+                uint32_t perMin = (delta(v, c->ruleRef) * 60) / (now - c->rulePrevTS);
+                fire = (perMin > (uint32_t)c->rule.threshold);
+                c->ruleRef = v;
+                c->rulePrevTS = now;
+            }
+            break;
+        }
+        default:
+            break;
+    }
+    if (fire) {
+        log_debug("SM:rule %d fired v=%d", ch, v);
+        for(int i=0;i<MAX_CBS;i++) {
+            if (_ctx.ruleCBs[i].fn!=NULL) {
+                (*(_ctx.ruleCBs[i].fn))(_ctx.ruleCBs[i].ctx, ch, v);
+            }
+        }
+        if (_ctx.ruleSM!=NULL) {
+            sm_sendEvent(_ctx.ruleSM, _ctx.ruleSMEvent, (void*)((int)ch));
+        }
+    }
+}
+
+// (re)load a channel's rule from config. Rules only exist in config if set, so no default is added.
+static void loadRule(SR_CHAN_t ch) 
+{
+    struct sr_chan* c = &_ctx.chans[ch];
+    if (CFMgr_getElement(CFG_UTIL_KEY_SR_RULE(ch), &c->rule, sizeof(SR_RULE_t))!=sizeof(SR_RULE_t)) {
+        c->rule.type = SR_RULE_NONE;
+    }
+    c->ruleRefSet = false;
+}
+
+static void cfgChangeCB(void* ctx, uint16_t key) 
+{
+    if (key>=CFG_UTIL_KEY_SR_RULE(0) && key<CFG_UTIL_KEY_SR_RULE(SR_NB_CHANS)) {
+        loadRule(key - CFG_UTIL_KEY_SR_RULE(0));
+        ruleTimerReset();
+    }
+}
+
+// Rules are checked at the shortest period of the channels that have one (RULE_POLL_SECS for those sampled at each read)
+static void ruleTimerReset() 
+{
+    uint32_t period = 0;
+    for(int i=0;i<SR_NB_CHANS;i++) {
+        struct sr_chan* c = &_ctx.chans[i];
+        if (c->rule.type!=SR_RULE_NONE) {
+            uint32_t p = (c->periodSecs>0 ? c->periodSecs : RULE_POLL_SECS);
+            if (p>0 && (period==0 || p<period)) {
+                period = p;
+            }
+        }
+    }
+    if (period!=_ctx.rulePeriodSecs || (period>0 && !os_callout_queued(&_ctx.ruleTimer))) {
+        _ctx.rulePeriodSecs = period;
+        if (period>0) {
+            os_callout_reset(&_ctx.ruleTimer, period*OS_TICKS_PER_SEC);
+        } else {
+            os_callout_stop(&_ctx.ruleTimer);
+        }
+    }
+}
+
+// Sample the due channels (and so run their rules) without waiting for the app to read them
+static void ruleTimerCB(struct os_event* e) 
+{
+    if (_ctx.isActive) {
+        readEnv();
+    } else {
+        // sensors are stopped : power them just for this read
+        if (config()) {
+            readEnv();
+        }
+        deconfig();
+    }
+    if (_ctx.rulePeriodSecs>0) {
+        os_callout_reset(&_ctx.ruleTimer, _ctx.rulePeriodSecs*OS_TICKS_PER_SEC);
+    }
+}
+
+// Add sample to channel history
+static void histAdd(struct sr_chan* c, int32_t v, uint32_t now) 
+{
+#if HISTORY_SZ > 0
+    struct sr_hist* h = &c->hist;
+    if (h->count>0) {
+        if (v==h->lastVal) {
+            return;     // no change, the newest entry still holds
+        }
+        if (now==h->lastTS) {
+            // same second as the newest entry : it takes the new value
+            if (h->count==1) {
+                h->baseVal = h->lastVal = v;
+            } else {
+                uint8_t last = (h->first + h->count - 1) % HISTORY_SZ;
+                int32_t dv = v - (h->lastVal - h->e[last].dv);
+                dv = max(min(dv, INT16_MAX), INT16_MIN);
+                h->lastVal += dv - h->e[last].dv;
+                // (kept even if back to the previous value : its sequence number may already have been exported)
+                h->e[last].dv = (int16_t)dv;
+            }
+            return;
+        }
+    }
+    h->seq++;
+    if (h->count==HISTORY_SZ) {
+        // drop oldest : next one becomes the base
+        if (h->count>1) {
+            h->first = (h->first+1) % HISTORY_SZ;
+            h->baseVal += h->e[h->first].dv;
+            h->baseTS += h->e[h->first].dt;
+            h->count--;
+        } else {
+            h->count = 0;
+        }
+    }
+    if (h->count==0) {
+        h->baseVal = h->lastVal = v;
+        h->baseTS = h->lastTS = now;
+        h->first = 0;
+        h->e[0].dv = 0;
+        h->e[0].dt = 0;
+        h->count = 1;
+        return;
+    }
+    // Deltas saturate : the stored history then follows the true value with a lag rather than wrapping
+    int32_t dv = v - h->lastVal;
+    dv = max(min(dv, INT16_MAX), INT16_MIN);
+    uint32_t dt = min(now - h->lastTS, UINT16_MAX);
+    uint8_t idx = (h->first + h->count) % HISTORY_SZ;
+    h->e[idx].dv = (int16_t)dv;
+    h->e[idx].dt = (uint16_t)dt;
+    h->lastVal += dv;
+    h->lastTS += dt;
+    h->count++;
+#endif
+}
+
+// Average of n adc reads
+static int readADCAvg(int8_t gpio, uint8_t n) 
+{
+    int32_t sum = 0;
+    for(int i=0;i<n;i++) {
+        sum += GPIO_readADC(gpio);
+    }
+    return (n>0 ? (sum/n) : 0);
+}
 
 static void deconfig() 
 {
@@ -675,11 +1197,13 @@ static void deconfig()
         }
         // accelero power state controlled by MovementMgr, no need for us to tell him
 
-        // sleep the alti on i2c
+#if !PRESSURE_FIFO
+        // sleep the alti on i2c (unless it is buffering samples for us)
         if (ALTI_sleep() != ALTI_SUCCESS)
         {
             log_warn("SM:Err sleep alti");
         }
+#endif
         if (HUMIDITY_present() && HUMIDITY_sleep() != HUMIDITY_SUCCESS)
         {
             log_warn("SM:Err deactivate humidity sensor");
@@ -701,10 +1225,14 @@ static LIGHT_STATE_t mapLight(uint8_t reading) {
         return DAYLIGHT;
     }
 }
-// Change in percent between two values
-static uint8_t deltaPercent(int a, int b) {
-    int r = max(max(a,b),1);
-    return ((delta(a,b)*100)/r);
+// Change in percent of a from the reference b (either may be negative), saturating at UINT16_MAX. Any change from 0 saturates.
+static uint16_t deltaPercent(int a, int b) {
+    uint32_t r = delta(b, 0);
+    if (r==0) {
+        return (a==0 ? 0 : UINT16_MAX);
+    }
+    uint64_t pct = ((uint64_t)delta(a,b)*100)/r;
+    return (uint16_t)min(pct, UINT16_MAX);
 }
 
 static uint32_t delta(int a, int b) 
@@ -0,0 +1,372 @@
+/**
+ * Copyright 2019 Wyres
+ * Licensed under the Apache License, Version 2.0 (the "License"); 
+ * you may not use this file except in compliance with the License. 
+ * You may obtain a copy of the License at
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, 
+ * software distributed under the License is distributed on 
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, 
+ * either express or implied. See the License for the specific 
+ * language governing permissions and limitations under the License.
+*/
+
+/**
+ * Bit packed delta telemetry codec (see telempack.h for the frame format)
+ * No OS dependancies : must build on the host for the decoder.
+ */
+#include <string.h>
+
+#include "wyres-generic/telempack.h"
+#ifdef MYNEWT
+#include "wyres-generic/wutils.h"     // UNITTEST is a target build syscfg
+#endif
+
+#define HDR_BITS        (16)
+#define VARINT_BITS     (4)
+
+static uint32_t fieldMask(const TelemPackField* f) {
+    return (f->bits>=32 ? 0xFFFFFFFFu : ((1u << f->bits) - 1));
+}
+
+static uint32_t zigzag(int32_t v) {
+    return (((uint32_t)v) << 1) ^ (uint32_t)(v >> 31);
+}
+
+static int32_t unzigzag(uint32_t z) {
+    return (int32_t)((z >> 1) ^ (0u - (z & 1)));
+}
+
+static bool schemaOk(const TelemPackField* fields, uint8_t nFields) {
+    if (fields==NULL || nFields==0 || nFields>TELEMPACK_MAX_FIELDS) {
+        return false;
+    }
+    for(int i=0;i<nFields;i++) {
+        if (fields[i].bits==0 || fields[i].bits>32 || fields[i].type>TELEMPACK_INT) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// MSB first
+static bool putBits(TelemPackEncoder* e, uint32_t v, uint8_t nbits) {
+    if (e->bitPos + nbits > e->maxBits) {
+        return false;
+    }
+    for(int i=nbits-1;i>=0;i--) {
+        uint8_t m = 0x80 >> (e->bitPos & 7);
+        if ((v>>i) & 1) {
+            e->buf[e->bitPos>>3] |= m;
+        } else {
+            e->buf[e->bitPos>>3] &= ~m;
+        }
+        e->bitPos++;
+    }
+    return true;
+}
+
+// groups of VARINT_BITS, least significant first, each preceded by a 'more' bit
+static bool putVarint(TelemPackEncoder* e, uint32_t v) {
+    do {
+        uint32_t g = v & ((1u << VARINT_BITS) - 1);
+        v >>= VARINT_BITS;
+        if (!putBits(e, ((v!=0 ? 1u : 0u) << VARINT_BITS) | g, VARINT_BITS+1)) {
+            return false;
+        }
+    } while(v!=0);
+    return true;
+}
+
+static TelemPackError encodeValue(TelemPackEncoder* e, int64_t value) {
+    if (e->buf==NULL || e->full) {
+        return TelemPackErrorFull;
+    }
+    const TelemPackField* f = &e->fields[e->field];
+    if (f->type==TELEMPACK_UINT) {
+        if (value<0 || (uint64_t)value>fieldMask(f)) {
+            return TelemPackErrorRange;
+        }
+    } else {
+        int64_t lim = ((int64_t)1) << (f->bits-1);
+        if (value<-lim || value>=lim) {
+            return TelemPackErrorRange;
+        }
+    }
+    if (e->field==0) {
+        e->recStart = e->bitPos;
+        e->delta = (e->hasRef || e->nRecords>0);
+    }
+    uint32_t v = (uint32_t)value;
+    bool ok;
+    if (e->delta) {
+        int32_t d = (int32_t)(v - e->prev[e->field]);
+        if (d==0) {
+            ok = putBits(e, 0, 1);
+        } else {
+            // 0 is coded by the bit alone, so the varint starts at 1
+            ok = putBits(e, 1, 1) && putVarint(e, zigzag(d)-1);
+        }
+    } else {
+        ok = putBits(e, v & fieldMask(f), f->bits);
+    }
+    if (!ok) {
+        // drop the whole record : it goes in the next frame
+        e->bitPos = e->recStart;
+        e->field = 0;
+        e->full = true;
+        return TelemPackErrorFull;
+    }
+    e->cur[e->field++] = v;
+    if (e->field>=e->nFields) {
+        memcpy(e->prev, e->cur, sizeof(e->prev));
+        e->field = 0;
+        e->nRecords++;
+        if (e->nRecords>=TELEMPACK_MAX_RECORDS) {
+            e->full = true;
+        }
+    }
+    return TelemPackNoError;
+}
+
+bool telempack_encoder_init(TelemPackEncoder* e, const TelemPackField* fields, uint8_t nFields) {
+    memset(e, 0, sizeof(TelemPackEncoder));
+    if (!schemaOk(fields, nFields)) {
+        return false;
+    }
+    e->fields = fields;
+    e->nFields = nFields;
+    return true;
+}
+
+void telempack_frame_start(TelemPackEncoder* e, uint8_t* buf, uint8_t size) {
+    e->buf = buf;
+    e->maxBits = size*8;
+    e->bitPos = HDR_BITS;
+    e->field = 0;
+    e->nRecords = 0;
+    e->full = (size*8 <= HDR_BITS);
+    // The decoder only remembers the last TELEMPACK_NB_SEQS frames : don't reference one that it may have forgotten
+    if (e->sinceAck>=TELEMPACK_NB_SEQS-1) {
+        e->hasRef = false;
+    }
+    memcpy(e->prev, e->ref, sizeof(e->prev));
+}
+
+TelemPackError telempack_encode_uint(TelemPackEncoder* e, uint32_t value) {
+    return encodeValue(e, value);
+}
+
+TelemPackError telempack_encode_int(TelemPackEncoder* e, int32_t value) {
+    return encodeValue(e, value);
+}
+
+uint8_t telempack_frame_records(const TelemPackEncoder* e) {
+    return e->nRecords;
+}
+
+uint8_t telempack_frame_finish(TelemPackEncoder* e) {
+    if (e->buf==NULL || e->nRecords==0) {
+        e->buf = NULL;
+        return 0;
+    }
+    // drop any partial record
+    if (e->field!=0) {
+        e->bitPos = e->recStart;
+        e->field = 0;
+    }
+    uint16_t endPos = e->bitPos;
+    // zero the padding in the last byte
+    if (endPos & 7) {
+        putBits(e, 0, 8 - (endPos & 7));
+    }
+    uint16_t sz = e->bitPos/8;
+    e->bitPos = 0;
+    putBits(e, e->seq, 4);
+    putBits(e, e->hasRef ? 1 : 0, 1);
+    putBits(e, e->hasRef ? e->refSeq : 0, 4);
+    putBits(e, e->nRecords, 7);
+    // This is the reference if the UL gets ACKed
+    memcpy(e->sent, e->prev, sizeof(e->sent));
+    e->sentSeq = e->seq;
+    e->seq = (e->seq + 1) % TELEMPACK_NB_SEQS;
+    if (e->sinceAck<UINT8_MAX) {
+        e->sinceAck++;
+    }
+    e->buf = NULL;
+    return (uint8_t)sz;
+}
+
+void telempack_frame_acked(TelemPackEncoder* e) {
+    memcpy(e->ref, e->sent, sizeof(e->ref));
+    e->refSeq = e->sentSeq;
+    e->hasRef = true;
+    e->sinceAck = 0;
+}
+
+/** Decoder */
+
+typedef struct {
+    const uint8_t* data;
+    uint16_t nbits;
+    uint16_t pos;
+} BitReader_t;
+
+static bool getBits(BitReader_t* r, uint8_t nbits, uint32_t* v) {
+    if (r->pos + nbits > r->nbits) {
+        return false;
+    }
+    uint32_t res = 0;
+    for(int i=0;i<nbits;i++) {
+        res = (res << 1) | ((r->data[r->pos>>3] >> (7 - (r->pos & 7))) & 1);
+        r->pos++;
+    }
+    *v = res;
+    return true;
+}
+
+static bool getVarint(BitReader_t* r, uint32_t* v) {
+    uint32_t res = 0;
+    for(int shift=0;shift<32;shift+=VARINT_BITS) {
+        uint32_t g = 0;
+        if (!getBits(r, VARINT_BITS+1, &g)) {
+            return false;
+        }
+        res |= (g & ((1u << VARINT_BITS) - 1)) << shift;
+        if ((g >> VARINT_BITS)==0) {
+            *v = res;
+            return true;
+        }
+    }
+    return false;       // too long for 32 bits
+}
+
+bool telempack_decoder_init(TelemPackDecoder* d, const TelemPackField* fields, uint8_t nFields) {
+    memset(d, 0, sizeof(TelemPackDecoder));
+    if (!schemaOk(fields, nFields)) {
+        return false;
+    }
+    d->fields = fields;
+    d->nFields = nFields;
+    return true;
+}
+
+int telempack_decode(TelemPackDecoder* d, const uint8_t* data, uint16_t sz, int32_t* records, int maxRecords) {
+    BitReader_t r = { .data = data, .nbits = sz*8, .pos = 0 };
+    uint32_t seq, hasRef, refSeq, nRecords;
+    if (d->fields==NULL || !getBits(&r, 4, &seq) || !getBits(&r, 1, &hasRef) || !getBits(&r, 4, &refSeq) ||
+            !getBits(&r, 7, &nRecords) || nRecords==0) {
+        return TelemPackErrorFormat;
+    }
+    if (nRecords>(uint32_t)maxRecords) {
+        return TelemPackErrorNoSpace;
+    }
+    uint32_t prev[TELEMPACK_MAX_FIELDS];
+    if (hasRef) {
+        if ((d->seqValid & (1u << refSeq))==0) {
+            return TelemPackErrorUnknownRef;
+        }
+        memcpy(prev, d->hist[refSeq], sizeof(prev));
+    }
+    for(uint32_t rec=0;rec<nRecords;rec++) {
+        bool delta = (hasRef || rec>0);
+        for(int f=0;f<d->nFields;f++) {
+            const TelemPackField* fd = &d->fields[f];
+            uint32_t v = 0;
+            if (delta) {
+                uint32_t changed = 0;
+                if (!getBits(&r, 1, &changed)) {
+                    return TelemPackErrorFormat;
+                }
+                if (changed) {
+                    uint32_t z = 0;
+                    if (!getVarint(&r, &z)) {
+                        return TelemPackErrorFormat;
+                    }
+                    v = prev[f] + (uint32_t)unzigzag(z+1);
+                } else {
+                    v = prev[f];
+                }
+            } else {
+                if (!getBits(&r, fd->bits, &v)) {
+                    return TelemPackErrorFormat;
+                }
+                if (fd->type==TELEMPACK_INT && fd->bits<32 && (v & (1u << (fd->bits-1)))) {
+                    v |= ~fieldMask(fd);     // sign extend
+                }
+            }
+            prev[f] = v;
+            records[rec*d->nFields + f] = (int32_t)v;
+        }
+    }
+    // Remember it : later frames may reference it once it is ACKed
+    memcpy(d->hist[seq], prev, sizeof(prev));
+    d->seqValid |= (1u << seq);
+    return (int)nRecords;
+}
+
+#ifdef UNITTEST
+static TelemPackError encodeRec(TelemPackEncoder* e, uint32_t a, int32_t b, int32_t c) {
+    TelemPackError err = telempack_encode_uint(e, a);
+    if (err==TelemPackNoError) {
+        err = telempack_encode_int(e, b);
+    }
+    if (err==TelemPackNoError) {
+        err = telempack_encode_int(e, c);
+    }
+    return err;
+}
+#define HAS_REF(buf)    (((buf)[0] & 0x08)!=0)
+// Encode frames and check they decode to the same records
+bool unittest_telempack() {
+    bool ret = true;        // assume all will go ok
+    static const TelemPackField fields[3] = { { TELEMPACK_UINT, 16 }, { TELEMPACK_INT, 12 }, { TELEMPACK_INT, 32 } };
+    // Static as too big for caller stacks
+    static TelemPackEncoder e;
+    static TelemPackDecoder d;
+    static TelemPackDecoder d2;
+    static uint8_t buf[51];
+    int32_t r[3*4];
+    ret &= unittest("init", telempack_encoder_init(&e, fields, 3) && telempack_decoder_init(&d, fields, 3));
+    // first frame : absolute values (16+12+32 bits), narrow INT field sign extended by the decoder
+    telempack_frame_start(&e, buf, sizeof(buf));
+    ret &= unittest("abs enc", encodeRec(&e, 1000, -2048, 0)==TelemPackNoError);
+    ret &= unittest("abs sz", telempack_frame_finish(&e)==10 && !HAS_REF(buf));
+    ret &= unittest("abs dec", telempack_decode(&d, buf, 10, r, 4)==1 && r[0]==1000 && r[1]==-2048 && r[2]==0);
+    telempack_frame_acked(&e);
+    // deltas from the ACKed frame : unchanged record is 1 bit per field
+    telempack_frame_start(&e, buf, sizeof(buf));
+    ret &= unittest("delta enc", encodeRec(&e, 1000, -2048, 0)==TelemPackNoError);
+    ret &= unittest("delta sz", telempack_frame_finish(&e)==3 && HAS_REF(buf));
+    ret &= unittest("delta dec", telempack_decode(&d, buf, 3, r, 4)==1 && r[0]==1000 && r[1]==-2048 && r[2]==0);
+    // deltas of INT32_MIN then INT32_MAX need all 8 varint groups
+    telempack_frame_start(&e, buf, sizeof(buf));
+    ret &= unittest("big enc", encodeRec(&e, 1001, 2047, INT32_MIN)==TelemPackNoError && 
+                                encodeRec(&e, 1001, 2047, -1)==TelemPackNoError);
+    uint8_t sz = telempack_frame_finish(&e);
+    ret &= unittest("big dec", telempack_decode(&d, buf, sz, r, 4)==2 && r[1]==2047 && r[2]==INT32_MIN && r[5]==-1);
+    // frames keep the ACKed reference until the decoder may have forgotten it
+    for(int i=2;i<TELEMPACK_NB_SEQS-1;i++) {
+        telempack_frame_start(&e, buf, sizeof(buf));
+        encodeRec(&e, 1000+i, 0, i);
+        sz = telempack_frame_finish(&e);
+        ret &= unittest("ref kept", HAS_REF(buf) && telempack_decode(&d, buf, sz, r, 4)==1 && r[0]==1000+i && r[2]==i);
+    }
+    // then go back to absolute values : only one record fits in 10 bytes, the one that doesn't is dropped whole
+    telempack_frame_start(&e, buf, 10);
+    ret &= unittest("noref enc", encodeRec(&e, 2000, -1, 5)==TelemPackNoError);
+    ret &= unittest("full", encodeRec(&e, 2000, -1, 0x12345678)==TelemPackErrorFull && telempack_frame_records(&e)==1);
+    ret &= unittest("still full", encodeRec(&e, 2000, -1, 5)==TelemPackErrorFull);
+    ret &= unittest("noref sz", telempack_frame_finish(&e)==10 && !HAS_REF(buf));
+    ret &= unittest("noref dec", telempack_decode(&d, buf, 10, r, 4)==1 && r[0]==2000 && r[1]==-1 && r[2]==5);
+    // a decoder that missed the ACKed frame can't decode deltas from it
+    telempack_frame_acked(&e);
+    telempack_frame_start(&e, buf, sizeof(buf));
+    encodeRec(&e, 2001, -1, 5);
+    sz = telempack_frame_finish(&e);
+    ret &= unittest("init d2", telempack_decoder_init(&d2, fields, 3));
+    ret &= unittest("unknown ref", HAS_REF(buf) && telempack_decode(&d2, buf, sz, r, 4)==TelemPackErrorUnknownRef);
+    ret &= unittest("known ref", telempack_decode(&d, buf, sz, r, 4)==1 && r[0]==2001);
+    return ret;
+}
+#endif /* UNITTEST */
@@ -14,6 +14,9 @@
 // Basic AT commands based console. Can use any UART device, and also be aware of a 'uart selector' hardware
 // Console is activate/deactivate on demand by the application layer.
 // Uses the default task/eventq for execution of its rx'd commands
+#include <stdarg.h>
+#include <stdio.h>
+
 #include "os/os.h"
 #include "wyres-generic/wutils.h"
 #include "wyres-generic/wskt_user.h"
@@ -24,8 +27,20 @@
 #include "wyres-generic/timemgr.h"
 #include "wyres-generic/sm_exec.h"
 #include "wyres-generic/rebootmgr.h"
+#include "wyres-generic/configmgr.h"
+#include "wyres-generic/sensormgr.h"
 
 #define MAX_TXSZ (256)
+#define MAX_ARGS MYNEWT_VAL(WCONSOLE_MAX_ARGS)
+#define TX_CHUNK MYNEWT_VAL(WCONSOLE_TX_CHUNK)
+#define TX_STALL_MS MYNEWT_VAL(WCONSOLE_TX_STALL_MS)
+
+// Bulk mode : max frame before COBS encoding (type, seq, payload, crc) so the encoded frame fits a socket rx line
+#define BULK_MAX_FRAME (240)
+#define BULK_MAX_PAYLOAD (BULK_MAX_FRAME-4)
+#define BULK_NB_REASONS (8)
+#define BULK_NB_LOGFNS (8)
+#define BULK_MAX_SAMPLES (8)         // per frame (they are on the stack)
 
 static struct appctx {
     struct os_event myUARTEvent;
@@ -40,6 +55,19 @@ static struct appctx {
     uint8_t txbuf[MAX_TXSZ+3];
     uint8_t ncmds;
     ATCMD_DEF_t* cmds;
+    uint8_t sortedCmds[UINT8_MAX];      // indexes into cmds, sorted by command name
+    bool bulkMode;
+#if MYNEWT_VAL(WCONSOLE_BULK)
+    struct {
+        uint8_t seq;                    // of the request being processed
+        uint16_t setKey;                // element being restored
+        uint8_t setLen;
+        uint8_t setOff;                 // next chunk expected, 0 if none in progress
+        uint8_t frame[BULK_MAX_FRAME];
+        uint8_t resp[BULK_MAX_FRAME];
+        uint8_t elem[UINT8_MAX];
+    } bulk;
+#endif
 } _ctx = {
     .mySMId=NULL,
     .ncmds=0,
@@ -59,6 +87,9 @@ enum MyEvents { ME_CHECK_CONSOLE, ME_START_CONSOLE, ME_STOP_CONSOLE, ME_NEW_DATA
 // predeclare privates
 static void uart_mgr_rxcb(struct os_event* ev);
 static void processATCmd(char* line);
+static void processBulkFrame(char* line);
+static void sortCmds();
+static bool writeAll(const uint8_t* data, uint32_t sz);
 
 
 // State machine states
@@ -68,6 +99,7 @@ static SM_STATE_ID_t State_Idle(void* arg, int e, void* data) {
         case SM_ENTER: {
             log_debug("CN: idle");
             // ensure clean state
+            ctx->bulkMode = false;
             if (ctx->cnx!=NULL) {
                 wskt_close(&ctx->cnx);  // sets cnx to null
             }
@@ -200,7 +232,10 @@ static SM_STATE_ID_t State_Active(void* arg, int e, void* data) {
             return MS_IDLE;
         }
         case ME_NEW_DATA: {
-            wskt_write(ctx->cnx, (uint8_t*)PROMPT, strlen(PROMPT));
+            // no prompts in the binary bulk mode
+            if (!ctx->bulkMode) {
+                wskt_write(ctx->cnx, (uint8_t*)PROMPT, strlen(PROMPT));
+            }
             ctx->lastInputTS = TMMgr_getRelTimeSecs();
             return SM_STATE_CURRENT;
         }
@@ -271,6 +306,7 @@ void wconsole_start(uint8_t ncmds, ATCMD_DEF_t* cmds, uint32_t idleTimeoutS) {
         _ctx.ncmds = ncmds;
         _ctx.cmds = cmds;
         _ctx.idleTimeoutS = idleTimeoutS;
+        sortCmds();
         sm_sendEvent(_ctx.mySMId, ME_START_CONSOLE, NULL);
     }
 }
@@ -304,57 +340,166 @@ bool wconsole_isActive() {
     return false;
 }
 
-static bool wconsole_println(const char* l, ...) {
+// Wait till the uart tx buffer has space for sz bytes. This blocks the calling task (the default task for commands),
+// returning false if the tx makes no progress for TX_STALL_MS.
+static bool waitTxSpace(uint32_t sz) {
+    wskt_ioctl_t cmd = {
+        .cmd = IOCTL_CHECKTX,
+        .param = 0,
+    };
+    int pending = wskt_ioctl(_ctx.cnx, &cmd);
+    uint32_t progressTS = TMMgr_getRelTimeMS();
+    while(pending > (int)(WSKT_BUF_SZ - sz)) {
+        // sleep for about the time the uart needs to send the excess (10 bits per char)
+        uint32_t waitms = 1;
+        if (_ctx.baudrate>0) {
+            waitms += ((pending - (WSKT_BUF_SZ - sz))*10*1000)/_ctx.baudrate;
+        }
+        os_time_delay(os_time_ms_to_ticks32(waitms));
+        int now = wskt_ioctl(_ctx.cnx, &cmd);
+        if (now<0) {
+            return false;
+        }
+        if (now<pending) {
+            progressTS = TMMgr_getRelTimeMS();
+        } else if ((TMMgr_getRelTimeMS() - progressTS) > TX_STALL_MS) {
+            return false;
+        }
+        pending = now;
+    }
+    return (pending>=0);
+}
+
+// Write all the data to the uart in chunks, waiting for tx space as required so nothing is dropped
+static bool writeAll(const uint8_t* data, uint32_t sz) {
+    if (_ctx.cnx==NULL) {
+        log_noout_fn("console write no open uart");      // just for debugger to watch
+        return false;
+    }
+    while(sz>0) {
+        uint32_t n = (sz>TX_CHUNK ? TX_CHUNK : sz);
+        int res = wskt_write(_ctx.cnx, (uint8_t*)data, n);
+        if (res==SKT_NOSPACE) {
+            if (!waitTxSpace(n)) {
+                log_noout_fn("console write stalled");      // just for debugger to watch
+                return false;
+            }
+            continue;
+        }
+        if (res<0) {
+            log_noout_fn("console write FAIL %d", res);      // just for debugger to watch
+            return false;
+        }
+        data += n;
+        sz -= n;
+    }
+    return true;
+}
+
+static bool vprintTx(bool eol, const char* l, va_list vl) {
     bool ret = true;
-    va_list vl;
-    va_start(vl, l);
-    vsprintf((char*)&_ctx.txbuf[0], l, vl);
-    int len = strnlen((const char*)&_ctx.txbuf[0], MAX_TXSZ);
+    int len = vsnprintf((char*)&_ctx.txbuf[0], MAX_TXSZ, l, vl);
+    if (len<0) {
+        return false;
+    }
     if (len>=MAX_TXSZ) {
-        // oops might just have broken stuff...
+        // truncated : use wconsole_write() for longer output
         len = MAX_TXSZ-1;
         ret = false;        // caller knows there was an issue
     }
-    _ctx.txbuf[len]='\n';
-    _ctx.txbuf[len+1]='\r';         // This is to play nice with putty...
-    _ctx.txbuf[len+2]=0;
-    len+=2;     // Don't send the null byte!
-    if (_ctx.cnx!=NULL) {
-        int res = wskt_write(_ctx.cnx, &_ctx.txbuf[0], len);
-        if (res<0) {
+    if (eol) {
+        _ctx.txbuf[len]='\n';
+        _ctx.txbuf[len+1]='\r';         // This is to play nice with putty...
+        _ctx.txbuf[len+2]=0;
+        len+=2;     // Don't send the null byte!
+    }
+    if (!writeAll(&_ctx.txbuf[0], len)) {
+        if (_ctx.cnx!=NULL) {
             _ctx.txbuf[0] = '*';
             wskt_write(_ctx.cnx, &_ctx.txbuf[0], 1);      // so user knows he missed something.
-            ret = false;        // caller knows there was an issue
-            // Not actually a lot we can do about this especially if its a flow control (SKT_NOSPACE) condition - ignore it
-           log_noout_fn("console write FAIL %d", res);      // just for debugger to watch
-       }
-    } else {
+        }
         ret = false;        // caller knows there was an issue
-        log_noout_fn("console write no open uart");      // just for debugger to watch
     }
+    return ret;
+}
+
+static bool wconsole_println(const char* l, ...) {
+    va_list vl;
+    va_start(vl, l);
+    bool ret = vprintTx(true, l, vl);
+    va_end(vl);
+    return ret;
+}
+
+bool wconsole_print(const char* l, ...) {
+    va_list vl;
+    va_start(vl, l);
+    bool ret = vprintTx(false, l, vl);
     va_end(vl);
     return ret;
 }
+
+bool wconsole_write(const uint8_t* data, uint32_t sz) {
+    return writeAll(data, sz);
+}
 // callback every time the socket gives us a new line of data 
 static void uart_mgr_rxcb(struct os_event* ev) {
     // ev->arg is our line buffer
     char* line = (char*)(ev->ev_arg);
     assert(line!=NULL);
-    // process it for commands
-    processATCmd(line);
+    // process it for commands (or as a frame in bulk mode)
+    if (_ctx.bulkMode) {
+        processBulkFrame(line);
+    } else {
+        processATCmd(line);
+    }
     // tell SM so it presents new prompt
     sm_sendEvent(_ctx.mySMId, ME_NEW_DATA, NULL);
     // and done
 }
 
+// Sort the command indexes by name (once per start, so lookups can binary search)
+static void sortCmds() {
+    for(int i=0;i<_ctx.ncmds;i++) {
+        int j = i;
+        while(j>0 && strcmp(_ctx.cmds[_ctx.sortedCmds[j-1]].cmd, _ctx.cmds[i].cmd)>0) {
+            _ctx.sortedCmds[j] = _ctx.sortedCmds[j-1];
+            j--;
+        }
+        _ctx.sortedCmds[j] = i;
+        if (j>0 && strcmp(_ctx.cmds[_ctx.sortedCmds[j-1]].cmd, _ctx.cmds[i].cmd)==0) {
+            log_warn("CN: duplicate cmd %s", _ctx.cmds[i].cmd);
+        }
+    }
+}
+
+static ATCMD_DEF_t* findCmd(const char* name) {
+    int lo = 0;
+    int hi = _ctx.ncmds-1;
+    while(lo<=hi) {
+        int mid = (lo+hi)/2;
+        ATCMD_DEF_t* c = &_ctx.cmds[_ctx.sortedCmds[mid]];
+        int r = strcmp(name, c->cmd);
+        if (r==0) {
+            return c;
+        }
+        if (r<0) {
+            hi = mid-1;
+        } else {
+            lo = mid+1;
+        }
+    }
+    return NULL;
+}
+
 static void processATCmd(char* line) {
     // parse line into : command, args
-    char* els[5];
+    char* els[MAX_ARGS];
     char* s = line;
     int elsi = 0;
     // first segment
     els[elsi++] = s;
-    while (*s!=0 && elsi<5) {
+    while (*s!=0 && elsi<MAX_ARGS) {
         if (*s==' ' || *s=='=' || *s==',') {
             // make end of string at seperator
             *s='\0';
@@ -379,30 +524,332 @@ static void processATCmd(char* line) {
         return;
     }
     // find it in the list
-    for(int i=0;i<_ctx.ncmds;i++) {
-        if (strcmp(els[0], _ctx.cmds[i].cmd)==0) {
-            // gotcha
-            log_debug("got cmd %s with %d args", els[0], elsi-1);
-            // call the specific command processor function as registered
-            ATRESULT res = (*_ctx.cmds[i].fn)(&wconsole_println, elsi, els);
-            switch(res) {
-                case ATCMD_OK: {
-                    wconsole_println("OK\r\n");
-                    break;
-                }
-                case ATCMD_GENERR: {
-                    wconsole_println("ERROR\r\n");
-                    break;
-                }
-                default:
-                    // Command processing already did return
-                    break;
+    ATCMD_DEF_t* c = findCmd(els[0]);
+    if (c!=NULL) {
+        // gotcha
+        log_debug("got cmd %s with %d args", els[0], elsi-1);
+        // call the specific command processor function as registered
+        ATRESULT res = (*c->fn)(&wconsole_println, elsi, els);
+        switch(res) {
+            case ATCMD_OK: {
+                wconsole_println("OK\r\n");
+                break;
             }
-            return;
+            case ATCMD_GENERR: {
+                wconsole_println("ERROR\r\n");
+                break;
+            }
+            default:
+                // Command processing already did return
+                break;
         }
+        return;
     }
     // not found
     wconsole_println("ERROR\r\n");
     wconsole_println("Unknown command [%s].", els[0]);
     log_debug("no cmd %s with %d args", els[0], elsi-1);
 }
+
+#if MYNEWT_VAL(WCONSOLE_BULK)
+/* Binary bulk transfer mode (see wconsole.h for the protocol).
+ * Frames are COBS encoded, so the 0x00 delimiter can be the socket's eol : each frame then arrives as one 'line'.
+ */
+static uint16_t crc16(const uint8_t* d, uint16_t sz) {
+    // CRC-16/CCITT-FALSE
+    uint16_t crc = 0xFFFF;
+    for(int i=0;i<sz;i++) {
+        crc ^= ((uint16_t)d[i]) << 8;
+        for(int b=0;b<8;b++) {
+            crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1);
+        }
+    }
+    return crc;
+}
+
+// out must have space for sz + sz/254 + 1 bytes. Returns the encoded size (without the 0x00 delimiter)
+static uint16_t cobsEncode(const uint8_t* in, uint16_t sz, uint8_t* out) {
+    uint16_t codeIdx = 0;
+    uint16_t o = 1;
+    uint8_t code = 1;
+    for(int i=0;i<sz;i++) {
+        if (in[i]==0) {
+            out[codeIdx] = code;
+            codeIdx = o++;
+            code = 1;
+        } else {
+            out[o++] = in[i];
+            if (++code==0xFF) {
+                out[codeIdx] = code;
+                codeIdx = o++;
+                code = 1;
+            }
+        }
+    }
+    out[codeIdx] = code;
+    return o;
+}
+
+// Returns the decoded size, or -1 if bad
+static int cobsDecode(const uint8_t* in, uint16_t sz, uint8_t* out, uint16_t maxsz) {
+    uint16_t i = 0;
+    uint16_t o = 0;
+    while(i<sz) {
+        uint8_t code = in[i++];
+        if (code==0) {
+            return -1;
+        }
+        for(int k=1;k<code;k++) {
+            if (i>=sz || o>=maxsz) {
+                return -1;
+            }
+            out[o++] = in[i++];
+        }
+        // implicit zero after each block, except a full one or the last one
+        if (code<0xFF && i<sz) {
+            if (o>=maxsz) {
+                return -1;
+            }
+            out[o++] = 0;
+        }
+    }
+    return o;
+}
+
+static void put16le(uint8_t* p, uint16_t v) {
+    p[0] = (v & 0xff);
+    p[1] = ((v >> 8) & 0xff);
+}
+
+static void put32le(uint8_t* p, uint32_t v) {
+    put16le(p, v & 0xffff);
+    put16le(p+2, (v >> 16) & 0xffff);
+}
+
+static uint32_t get32le(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (((uint32_t)p[3]) << 24);
+}
+
+// Send a frame : type, seq (of the request), payload, crc
+static bool bulkSend(uint8_t type, const uint8_t* payload, uint16_t sz) {
+    if (sz>BULK_MAX_PAYLOAD) {
+        return false;
+    }
+    _ctx.bulk.resp[0] = type;
+    _ctx.bulk.resp[1] = _ctx.bulk.seq;
+    if (sz>0 && payload!=&_ctx.bulk.resp[2]) {
+        memcpy(&_ctx.bulk.resp[2], payload, sz);
+    }
+    sz += 2;
+    put16le(&_ctx.bulk.resp[sz], crc16(&_ctx.bulk.resp[0], sz));
+    sz += 2;
+    // txbuf is big enough for the COBS overhead and the delimiter
+    uint16_t len = cobsEncode(&_ctx.bulk.resp[0], sz, &_ctx.txbuf[0]);
+    _ctx.txbuf[len++] = 0;
+    return writeAll(&_ctx.txbuf[0], len);
+}
+
+static void bulkAck(uint8_t cmd) {
+    bulkSend(BULK_RSP_ACK, &cmd, 1);
+}
+
+static void bulkNak(uint8_t cmd, uint8_t err) {
+    uint8_t p[2] = { cmd, err };
+    bulkSend(BULK_RSP_NAK, p, 2);
+}
+
+// Config dump : each element in as many frames as needed
+static void bulkCfgElemCB(void* ctx, uint16_t key) {
+    uint16_t* nb = (uint16_t*)ctx;
+    int len = CFMgr_getElement(key, &_ctx.bulk.elem[0], sizeof(_ctx.bulk.elem));
+    if (len<0) {
+        return;
+    }
+    uint8_t* p = &_ctx.bulk.resp[2];
+    int off = 0;
+    do {
+        int n = len - off;
+        if (n>BULK_MAX_PAYLOAD-4) {
+            n = BULK_MAX_PAYLOAD-4;
+        }
+        put16le(p, key);
+        p[2] = len;
+        p[3] = off;
+        memcpy(p+4, &_ctx.bulk.elem[off], n);
+        bulkSend(BULK_RSP_CFG_ELEM, p, n+4);
+        off += n;
+    } while(off<len);
+    (*nb)++;
+}
+
+static void bulkCfgSet(const uint8_t* p, uint16_t sz) {
+    if (sz<4) {
+        bulkNak(BULK_CMD_CFG_SET, BULK_ERR_BADARG);
+        return;
+    }
+    uint16_t key = p[0] | (p[1] << 8);
+    uint8_t len = p[2];
+    uint8_t off = p[3];
+    uint16_t n = sz-4;
+    if (key==CFG_KEY_ILLEGAL || len==0 || off+n>len) {
+        bulkNak(BULK_CMD_CFG_SET, BULK_ERR_BADARG);
+        return;
+    }
+    // chunks of an element must come in order, all with the key/len of the first one. An element in progress must be
+    // finished before another (or the same one again) is started : re-entering bulk mode abandons it.
+    if (_ctx.bulk.setOff>0 ? (key!=_ctx.bulk.setKey || len!=_ctx.bulk.setLen || off!=_ctx.bulk.setOff) : (off!=0)) {
+        bulkNak(BULK_CMD_CFG_SET, BULK_ERR_BADARG);
+        return;
+    }
+    memcpy(&_ctx.bulk.elem[off], p+4, n);
+    _ctx.bulk.setKey = key;
+    _ctx.bulk.setLen = len;
+    _ctx.bulk.setOff = off+n;
+    if (_ctx.bulk.setOff>=len) {
+        _ctx.bulk.setOff = 0;
+        if (!CFMgr_setElement(key, &_ctx.bulk.elem[0], len)) {
+            bulkNak(BULK_CMD_CFG_SET, BULK_ERR_FAILED);
+            return;
+        }
+    }
+    bulkAck(BULK_CMD_CFG_SET);
+}
+
+static void bulkCrash() {
+    uint8_t* p = &_ctx.bulk.resp[2];
+    put16le(p, RMMgr_getResetReasonCode());
+    RMMgr_getResetReasonBuffer(p+2, BULK_NB_REASONS);
+    uint16_t sz = 2+BULK_NB_REASONS;
+    put32le(p+sz, (uint32_t)(uintptr_t)RMMgr_getLastAssertCallerFn());
+    sz += 4;
+    for(int i=0;i<BULK_NB_LOGFNS;i++) {
+        put32le(p+sz, (uint32_t)(uintptr_t)RMMgr_getLogFn(i));
+        sz += 4;
+    }
+    bulkSend(BULK_RSP_CRASH, p, sz);
+}
+
+static void bulkHistory(const uint8_t* p, uint16_t sz) {
+    if (sz<5 || p[0]>=SR_NB_CHANS) {
+        bulkNak(BULK_CMD_HISTORY, BULK_ERR_BADARG);
+        return;
+    }
+    SR_CHAN_t ch = p[0];
+    // paged by the history's sequence numbers, so samples sharing a timestamp are never lost between frames
+    uint32_t seq = get32le(p+1);
+    uint16_t total = 0;
+    SR_SAMPLE_t samples[BULK_MAX_SAMPLES];
+    int n;
+    while((n = SRMgr_exportHistory(ch, &seq, samples, BULK_MAX_SAMPLES))>0) {
+        uint8_t* r = &_ctx.bulk.resp[2];
+        r[0] = ch;
+        r[1] = n;
+        // (sequence number of the first sample : the ones asked for may be gone)
+        put32le(r+2, seq-n);
+        for(int i=0;i<n;i++) {
+            put32le(r+6+i*8, samples[i].ts);
+            put32le(r+10+i*8, (uint32_t)samples[i].value);
+        }
+        bulkSend(BULK_RSP_SAMPLES, r, 6+n*8);
+        total += n;
+        if (n<BULK_MAX_SAMPLES) {
+            break;
+        }
+    }
+    uint8_t e[6];
+    put16le(e, total);
+    put32le(e+2, seq);
+    bulkSend(BULK_RSP_END, e, 6);
+}
+
+static void bulkExit() {
+    bulkAck(BULK_CMD_EXIT);
+    // back to AT lines
+    wskt_ioctl_t cmd = {
+        .cmd = IOCTL_FILTERASCII,
+        .param = 1,
+    };
+    wskt_ioctl(_ctx.cnx, &cmd);
+    cmd.cmd = IOCTL_SETEOL;
+    cmd.param = 0x0D;
+    wskt_ioctl(_ctx.cnx, &cmd);
+    _ctx.bulkMode = false;
+}
+
+static void processBulkFrame(char* line) {
+    uint8_t* f = &_ctx.bulk.frame[0];
+    int sz = cobsDecode((const uint8_t*)line, strnlen(line, WSKT_BUF_SZ), f, sizeof(_ctx.bulk.frame));
+    if (sz<4 || crc16(f, sz-2)!=(f[sz-2] | (f[sz-1] << 8))) {
+        // can't trust the cmd/seq
+        _ctx.bulk.seq = 0;
+        bulkNak(0, BULK_ERR_BADFRAME);
+        return;
+    }
+    uint8_t type = f[0];
+    _ctx.bulk.seq = f[1];
+    const uint8_t* p = f+2;
+    uint16_t psz = sz-4;
+    switch(type) {
+        case BULK_CMD_PING: {
+            uint8_t v = BULK_VERSION;
+            bulkSend(BULK_RSP_ACK, &v, 1);
+            break;
+        }
+        case BULK_CMD_CFG_DUMP: {
+            uint16_t nb = 0;
+            CFMgr_iterateKeys((psz>0 ? p[0] : -1), &bulkCfgElemCB, &nb);
+            uint8_t e[2];
+            put16le(e, nb);
+            bulkSend(BULK_RSP_END, e, 2);
+            break;
+        }
+        case BULK_CMD_CFG_SET: {
+            bulkCfgSet(p, psz);
+            break;
+        }
+        case BULK_CMD_CRASH: {
+            bulkCrash();
+            break;
+        }
+        case BULK_CMD_HISTORY: {
+            bulkHistory(p, psz);
+            break;
+        }
+        case BULK_CMD_EXIT: {
+            bulkExit();
+            break;
+        }
+        default: {
+            bulkNak(type, BULK_ERR_BADCMD);
+            break;
+        }
+    }
+}
+
+ATRESULT wconsole_bulkModeCmd(PRINTLN_t pfn, uint8_t nargs, char* argv[]) {
+    if (_ctx.cnx==NULL) {
+        return ATCMD_GENERR;
+    }
+    (*pfn)("OK\r\n");
+    // Binary from now : no ascii filter, and the COBS delimiter ends each 'line'
+    wskt_ioctl_t cmd = {
+        .cmd = IOCTL_FILTERASCII,
+        .param = 0,
+    };
+    wskt_ioctl(_ctx.cnx, &cmd);
+    cmd.cmd = IOCTL_SETEOL;
+    cmd.param = 0x00;
+    wskt_ioctl(_ctx.cnx, &cmd);
+    memset(&_ctx.bulk, 0, sizeof(_ctx.bulk));
+    _ctx.bulkMode = true;
+    return ATCMD_PROCESSED;
+}
+#else /* MYNEWT_VAL(WCONSOLE_BULK) */
+static void processBulkFrame(char* line) {
+    // not built
+}
+ATRESULT wconsole_bulkModeCmd(PRINTLN_t pfn, uint8_t nargs, char* argv[]) {
+    (*pfn)("bulk mode not in this build (WCONSOLE_BULK)");
+    return ATCMD_GENERR;
+}
+#endif /* MYNEWT_VAL(WCONSOLE_BULK) */
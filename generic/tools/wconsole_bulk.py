@@ -0,0 +1,235 @@
+#!/usr/bin/env python3
+# Copyright 2019 Wyres
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#    http://www.apache.org/licenses/LICENSE-2.0
+# Unless required by applicable law or agreed to in writing,
+# software distributed under the License is distributed on
+# an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+# either express or implied. See the License for the specific
+# language governing permissions and limitations under the License.
+
+"""Host side of the wconsole binary bulk mode (see wyres-generic/wconsole.h). Needs pyserial.
+
+  wconsole_bulk.py -p /dev/ttyUSB0 dump config.txt      save all config elements ("key hexdata" per line)
+  wconsole_bulk.py -p /dev/ttyUSB0 restore config.txt   write them back
+  wconsole_bulk.py -p /dev/ttyUSB0 crash                show the reset/assert/log records
+  wconsole_bulk.py -p /dev/ttyUSB0 history 1 [seq]      export a sensor channel's history ("seq ts value" per line), from
+                                                        sample sequence number seq on (default all kept)
+"""
+import argparse
+import struct
+import sys
+import time
+
+import serial
+
+BULK_VERSION = 1
+CMD_PING, CMD_CFG_DUMP, CMD_CFG_SET, CMD_CRASH, CMD_HISTORY, CMD_EXIT = 0x01, 0x02, 0x03, 0x04, 0x05, 0x7F
+RSP_ACK, RSP_NAK, RSP_CFG_ELEM, RSP_END, RSP_CRASH, RSP_SAMPLES = 0x80, 0x81, 0x82, 0x83, 0x84, 0x85
+MAX_SET_CHUNK = 240 - 4 - 4
+
+
+def crc16(data):
+    """CRC-16/CCITT-FALSE"""
+    crc = 0xFFFF
+    for b in data:
+        crc ^= b << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else (crc << 1)
+            crc &= 0xFFFF
+    return crc
+
+
+def cobs_encode(data):
+    out = bytearray()
+    block = bytearray()
+    for b in data:
+        if b == 0:
+            out.append(len(block) + 1)
+            out += block
+            block = bytearray()
+        else:
+            block.append(b)
+            if len(block) == 254:
+                out.append(255)
+                out += block
+                block = bytearray()
+    out.append(len(block) + 1)
+    out += block
+    return bytes(out)
+
+
+def cobs_decode(data):
+    out = bytearray()
+    i = 0
+    while i < len(data):
+        code = data[i]
+        if code == 0 or i + code > len(data) + 1:
+            raise ValueError("bad cobs")
+        out += data[i + 1:i + code]
+        i += code
+        if code < 255 and i < len(data):
+            out.append(0)
+    return bytes(out)
+
+
+class BulkLink:
+    def __init__(self, port, baud, atcmd, timeout):
+        self.ser = serial.Serial(port, baud, timeout=timeout)
+        self.timeout = timeout
+        self.seq = 0
+        self.rx = bytearray()
+        self.enter(atcmd)
+
+    def enter(self, atcmd):
+        self.ser.reset_input_buffer()
+        self.ser.write((atcmd + "\r").encode())
+        end = time.time() + self.timeout
+        resp = b""
+        while b"OK" not in resp:
+            if time.time() > end:
+                raise IOError("no OK to %s (got %r)" % (atcmd, resp))
+            resp += self.ser.read(64)
+        # flush anything the console had buffered as a line
+        self.ser.write(b"\x00")
+        time.sleep(0.1)
+        self.ser.reset_input_buffer()
+        rsp = self.request(CMD_PING)
+        if rsp[0][0] != RSP_ACK or rsp[0][1][0] != BULK_VERSION:
+            raise IOError("unexpected ping response %r" % (rsp,))
+
+    def send(self, typ, payload=b""):
+        self.seq = (self.seq % 255) + 1
+        raw = bytes([typ, self.seq]) + payload
+        raw += struct.pack("<H", crc16(raw))
+        self.ser.write(cobs_encode(raw) + b"\x00")
+        return self.seq
+
+    def recv(self):
+        end = time.time() + self.timeout
+        while b"\x00" not in self.rx:
+            if time.time() > end:
+                raise IOError("timeout waiting for response")
+            self.rx += self.ser.read(max(1, self.ser.in_waiting))
+        frame, _, self.rx = self.rx.partition(b"\x00")
+        if not frame:
+            return self.recv()
+        raw = cobs_decode(bytes(frame))
+        if len(raw) < 4 or crc16(raw[:-2]) != struct.unpack("<H", raw[-2:])[0]:
+            raise IOError("bad response frame")
+        return raw[0], raw[1], raw[2:-2]
+
+    def request(self, typ, payload=b"", multi=False):
+        """Send a request, return [(type, payload)] : one response, or all of them up to END if multi"""
+        seq = self.send(typ, payload)
+        out = []
+        while True:
+            rtyp, rseq, rpl = self.recv()
+            if rseq != seq and rseq != 0:
+                continue    # stale response to an earlier request
+            if rtyp == RSP_NAK:
+                raise IOError("NAK cmd 0x%02x err %d" % (rpl[0], rpl[1]))
+            out.append((rtyp, rpl))
+            if not multi or rtyp == RSP_END:
+                return out
+
+    def close(self):
+        try:
+            self.request(CMD_EXIT)
+        finally:
+            self.ser.close()
+
+
+def cfg_dump(link, module=None):
+    payload = bytes([module]) if module is not None else b""
+    elems = {}
+    for typ, pl in link.request(CMD_CFG_DUMP, payload, multi=True):
+        if typ != RSP_CFG_ELEM:
+            continue
+        key, ln, off = struct.unpack("<HBB", pl[:4])
+        buf = elems.setdefault(key, bytearray(ln))
+        buf[off:off + len(pl) - 4] = pl[4:]
+    return elems
+
+
+def cfg_set(link, key, data):
+    for off in range(0, len(data), MAX_SET_CHUNK):
+        chunk = data[off:off + MAX_SET_CHUNK]
+        link.request(CMD_CFG_SET, struct.pack("<HBB", key, len(data), off) + chunk)
+
+
+def crash(link):
+    pl = link.request(CMD_CRASH)[0][1]
+    code, = struct.unpack("<H", pl[:2])
+    reasons = list(pl[2:10])
+    assertfn, = struct.unpack("<I", pl[10:14])
+    logfns = struct.unpack("<8I", pl[14:46])
+    print("reset reason code : 0x%04x" % code)
+    print("last reasons      : %s" % " ".join("%d" % r for r in reasons))
+    print("last assert fn    : 0x%08x" % assertfn)
+    print("last logged fns   : %s" % " ".join("0x%08x" % f for f in logfns))
+
+
+def history(link, chan, seq):
+    for typ, pl in link.request(CMD_HISTORY, struct.pack("<BI", chan, seq), multi=True):
+        if typ == RSP_END:
+            _, nxt = struct.unpack("<HI", pl[:6])
+            print("# next seq %d" % nxt)
+        if typ != RSP_SAMPLES:
+            continue
+        first, = struct.unpack("<I", pl[2:6])
+        for i in range(pl[1]):
+            ts, value = struct.unpack("<Ii", pl[6 + 8 * i:14 + 8 * i])
+            print("%d %d %d" % (first + i, ts, value))
+
+
+def main():
+    ap = argparse.ArgumentParser(description="wconsole bulk mode client")
+    ap.add_argument("-p", "--port", required=True)
+    ap.add_argument("-b", "--baud", type=int, default=115200)
+    ap.add_argument("-c", "--atcmd", default="AT+BULK", help="command the app registered wconsole_bulkModeCmd as")
+    ap.add_argument("-t", "--timeout", type=float, default=3.0)
+    sub = ap.add_subparsers(dest="op", required=True)
+    p = sub.add_parser("dump")
+    p.add_argument("file")
+    p.add_argument("-m", "--module", type=int)
+    p = sub.add_parser("restore")
+    p.add_argument("file")
+    sub.add_parser("crash")
+    p = sub.add_parser("history")
+    p.add_argument("chan", type=int)
+    p.add_argument("seq", type=int, nargs="?", default=0)
+    args = ap.parse_args()
+
+    link = BulkLink(args.port, args.baud, args.atcmd, args.timeout)
+    try:
+        if args.op == "dump":
+            elems = cfg_dump(link, args.module)
+            # zero length elements have nothing to restore (and CFG_SET refuses them)
+            keys = [key for key in sorted(elems) if elems[key]]
+            with open(args.file, "w") as f:
+                for key in keys:
+                    f.write("%04x %s\n" % (key, elems[key].hex()))
+            print("%d elements saved" % len(keys))
+        elif args.op == "restore":
+            n = 0
+            with open(args.file) as f:
+                for line in f:
+                    fields = line.split()
+                    if len(fields) != 2:
+                        continue    # blank line or zero length element (from an older dump)
+                    cfg_set(link, int(fields[0], 16), bytes.fromhex(fields[1]))
+                    n += 1
+            print("%d elements restored" % n)
+        elif args.op == "crash":
+            crash(link)
+        elif args.op == "history":
+            history(link, args.chan, args.seq)
+    finally:
+        link.close()
+
+
+if __name__ == "__main__":
+    sys.exit(main())
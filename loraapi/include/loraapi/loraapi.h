@@ -14,6 +14,7 @@
 #define H_LORAAPI_H
 
 #include <inttypes.h>
+#include <stdbool.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -23,7 +24,8 @@ extern "C" {
 /* LoraWAN and LoRa radio access api */
 typedef enum { LORAWAN_RES_OK, LORAWAN_RES_JOIN_OK, LORAWAN_RES_NOT_JOIN, LORAWAN_RES_NO_RESP, LORAWAN_RES_DUTYCYCLE, 
                 LORAWAN_RES_NO_BW, LORAWAN_RES_OCC, LORAWAN_RES_HWERR, LORAWAN_RES_FWERR, LORAWAN_RES_TIMEOUT, LORAWAN_RES_BADPARAM } LORAWAN_RESULT_t;
-typedef enum { LORAWAN_SF12=12, LORAWAN_SF11=11, LORAWAN_SF10=10, LORAWAN_SF9=9, LORAWAN_SF8=8, LORAWAN_SF7=7,	LORAWAN_FSK250=5, LORAWAN_SF_USEADR=13, LORAWAN_SF_DEFAULT=14 } LORAWAN_SF_t;
+typedef enum { LORAWAN_SF12=12, LORAWAN_SF11=11, LORAWAN_SF10=10, LORAWAN_SF9=9, LORAWAN_SF8=8, LORAWAN_SF7=7,	LORAWAN_FSK250=5, LORAWAN_SF_USEADR=13, LORAWAN_SF_DEFAULT=14, LORAWAN_SF_AUTO=15 } LORAWAN_SF_t;
+typedef enum { LORAWAN_PRIO_LOW, LORAWAN_PRIO_NORMAL, LORAWAN_PRIO_HIGH } LORAWAN_PRIO_t;
 typedef void* LORAWAN_REQ_ID_t;     // A request id. NULL means the request was failed
 typedef void (*LORAWAN_JOIN_CB_t)(void* userctx, LORAWAN_RESULT_t res);
 typedef void (*LORAWAN_TX_CB_t)(void* userctx, LORAWAN_RESULT_t res);
@@ -54,6 +56,7 @@ LORAWAN_RESULT_t lora_api_registerRxCB(int port, LORAWAN_RX_CB_t callback, void*
 void lora_api_cancelRxCB(int port, LORAWAN_RX_CB_t callback);
 
 // request an UL. This will be sent 'as soon as possible' async to this call
+// sf : LORAWAN_SF_AUTO uses the fastest SF the link history says is reliable (or the network's choice if ADR is enabled)
 // data buffer should be maintained as-is until the callback happens to release it.
 // Note that no other lorawan tx may be done until the callback has happened to signal end of this one. This will be when
 // either the tx fails, tx completes successfullly (if doRx=false), or either a DL is rx'd (RX1 or RX2) or RX2 timeout has popped.
@@ -62,15 +65,46 @@ void lora_api_cancelRxCB(int port, LORAWAN_RX_CB_t callback);
 LORAWAN_RESULT_t lora_api_send(LORAWAN_SF_t sf, uint8_t port, bool reqAck, bool doRx, 
                 uint8_t* data, uint8_t sz, LORAWAN_TX_CB_t callback, void* userctx);
 
-// Schedule direct radio tx access for specific time. The callback will be done following the access. Set abs_time to 0 to mean 'now'
-// Not yet implmented.
+// queue an UL. Requests are sent one at a time as the stack becomes free, highest prio first (FIFO within a prio).
+// data buffer should be maintained as-is until the callback happens to release it.
+// maxWaitMS : if not sent within this time, the request is dropped and the callback gets LORAWAN_RES_TIMEOUT (0=no limit)
+// coalesce : allow this request to be sent in the same frame as other coalescable requests for the same port/SF (data is concatenated
+// up to the max payload for the SF). All requests in a frame get the same callback result.
+// Returns LORAWAN_RES_OCC if the queue is full of requests of the same or higher prio (a lower prio one is evicted otherwise,
+// with LORAWAN_RES_OCC to its callback), or LORAWAN_RES_BADPARAM if sz is too big for the SF.
+LORAWAN_RESULT_t lora_api_sendQ(LORAWAN_SF_t sf, uint8_t port, bool reqAck, bool doRx, 
+                uint8_t* data, uint8_t sz, LORAWAN_PRIO_t prio, uint32_t maxWaitMS, bool coalesce,
+                LORAWAN_TX_CB_t callback, void* userctx);
+// Remove queued (not yet sent) requests with this callback/ctx. No callback is done for them. Returns true if any removed.
+bool lora_api_cancelQ(LORAWAN_TX_CB_t callback, void* userctx);
+// Number of UL requests queued or in progress via lora_api_sendQ()
+int lora_api_getQLen();
+// Max app payload size for an UL at this SF
+uint8_t lora_api_getMaxPayloadSz(LORAWAN_SF_t sf);
+// Estimated time on air (ms) of an UL of sz app payload bytes at this SF (LoRaWAN overhead included, no FOpts)
+// For LORAWAN_SF_USEADR/LORAWAN_SF_DEFAULT the DR is not known here, so this is the SF12 worst case
+uint32_t lora_api_estimateToA(LORAWAN_SF_t sf, uint8_t sz);
+// Time (ms) before an UL of sz bytes at this SF can be sent within the regulatory duty cycle of the default channels' band
+// (0 = now, UINT32_MAX = never eg above the region's dwell time)
+uint32_t lora_api_nextTxPossibleMS(LORAWAN_SF_t sf, uint8_t sz);
+
+// Link history used for LORAWAN_SF_AUTO : the SF it currently gives, and the mean DL rssi/snr seen at that SF (0 if none yet)
+LORAWAN_SF_t lora_api_getAutoSF(int* rssi, int* snr);
+// Forget the link history and restart LORAWAN_SF_AUTO at sf (eg when the device has been moved to a new site)
+void lora_api_resetLinkHistory(LORAWAN_SF_t sf);
+
+// Schedule direct radio tx access for specific time (ms since boot as TMMgr_getRelTimeMS()). The callback will be done following the access. 
+// Set abs_time to 0 to mean 'now'. freq in Hz, sf explicit (no DEFAULT/USEADR/AUTO). Returns NULL if the radio is already scheduled 
+// for a LoRaWAN exchange or another tx/rx in this time frame, the packet is over the region's dwell time, or the loraapi
+// implementation has no raw radio access.
+// The callback gets LORAWAN_RES_DUTYCYCLE if the band is still in its off time, LORAWAN_RES_OCC if a LoRaWAN exchange overran into the slot.
 LORAWAN_REQ_ID_t lora_api_radio_tx(uint32_t abs_time, LORAWAN_SF_t sf, uint32_t freq, int txpower, uint8_t* data, uint8_t sz, LORAWAN_TX_CB_t callback, void* userctx);
-// Schedule direct radio rx access for specific time. The callback will be done following the access. Set abs_time to 0 to mean 'now'
-// Not yet implmented.
+// Schedule direct radio rx access for specific time, for timeoutms. The callback will be done following the access (port 0) : 
+// LORAWAN_RES_OK with the received packet (copied into data, up to sz), or LORAWAN_RES_TIMEOUT. Set abs_time to 0 to mean 'now'
 LORAWAN_REQ_ID_t lora_api_radio_rx(uint32_t abs_time, LORAWAN_SF_t sf, uint32_t freq, uint32_t timeoutms, uint8_t* data, uint8_t sz, LORAWAN_RX_CB_t callback, void* userctx);
 
-// Cancel a pending radio direct request. True if cancelled without action, false if already in progress and cannot be cancelled
-// Not yet implmented.
+// Cancel a pending radio direct request (no callback is done). True if cancelled without action, false if already in progress 
+// (or done) and cannot be cancelled
 bool lora_api_cancel(LORAWAN_REQ_ID_t id);
 
 // Get current lora region
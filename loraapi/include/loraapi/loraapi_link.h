@@ -0,0 +1,44 @@
+/**
+ * Copyright 2019 Wyres
+ * Licensed under the Apache License, Version 2.0 (the "License"); 
+ * you may not use this file except in compliance with the License. 
+ * You may obtain a copy of the License at
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, 
+ * software distributed under the License is distributed on 
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, 
+ * either express or implied. See the License for the specific 
+ * language governing permissions and limitations under the License.
+*/
+#ifndef H_LORAAPI_LINK_H
+#define H_LORAAPI_LINK_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include "wyres-generic/configmgr.h"
+#include "loraapi/loraapi.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Link quality history hooks for use by loraapi implementations only (not by apps) */
+
+// Config key for the persisted link history (lora module keys from 200 are for the loraapi, apps use those below)
+#define CFG_LORA_KEY_LINK_HISTORY   CFGKEY(CFG_MODULE_LORA, 200)
+
+// Load the history (or start it at defaultSF). Call from lora_api_init()
+void lora_api_link_init(LORAWAN_SF_t defaultSF);
+// SF to use for a LORAWAN_SF_AUTO request (LORAWAN_SF_USEADR if ADR is enabled : the network knows better)
+LORAWAN_SF_t lora_api_link_getSF(bool useADR);
+// Result of a LoRaWAN UL sent at sf (ackRx only meaningful if reqAck)
+void lora_api_link_noteUL(LORAWAN_SF_t sf, bool reqAck, bool ackRx);
+// DL received in the RX windows of an UL sent at sf. Only call if the radio gave its real rssi/snr
+void lora_api_link_noteDL(LORAWAN_SF_t sf, int rssi, int snr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* H_LORAAPI_LINK_H */
@@ -0,0 +1,54 @@
+/**
+ * Copyright 2019 Wyres
+ * Licensed under the Apache License, Version 2.0 (the "License"); 
+ * you may not use this file except in compliance with the License. 
+ * You may obtain a copy of the License at
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, 
+ * software distributed under the License is distributed on 
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, 
+ * either express or implied. See the License for the specific 
+ * language governing permissions and limitations under the License.
+*/
+#ifndef H_LORAAPI_RADIO_H
+#define H_LORAAPI_RADIO_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include "loraapi/loraapi.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Radio access scheduler hooks for use by loraapi implementations only (not by apps) */
+
+// Initialise the scheduler. Call from lora_api_init()
+void lora_api_radio_init(void);
+
+// Time (ms) the radio is needed for a LoRaWAN exchange : UL then RX windows (and the join accept windows if isJoin)
+uint32_t lora_api_radio_lwExchangeMS(LORAWAN_SF_t sf, uint8_t sz, bool doRx, bool isJoin);
+// Can a LoRaWAN exchange of durationMS start now without running into a scheduled radio tx/rx?
+bool lora_api_radio_lwCanStart(uint32_t durationMS);
+// Tell the scheduler a LoRaWAN exchange is starting (false if it would conflict with a scheduled radio tx/rx : don't start it)
+bool lora_api_radio_lwStart(uint32_t durationMS);
+// Tell the scheduler the LoRaWAN exchange is over (RX windows closed)
+void lora_api_radio_lwEnd(void);
+
+// Implemented by the loraapi implementation : can it do raw radio tx/rx at all? If not, no radio tx/rx requests are accepted
+// (so they never hold off LoRaWAN exchanges for slots that would fail)
+bool lora_api_radio_hwAvailable(void);
+// Implemented by the loraapi implementation : start a raw radio tx/rx now, with the stack idle.
+// Return false if not possible, else call lora_api_radio_txDone()/rxDone() when finished.
+bool lora_api_radio_hwTx(uint32_t freq, LORAWAN_SF_t sf, int8_t power, uint8_t* data, uint8_t sz);
+bool lora_api_radio_hwRx(uint32_t freq, LORAWAN_SF_t sf, uint32_t timeoutMS, uint8_t* data, uint8_t sz);
+// Result of the raw radio tx/rx (rx : sz bytes were put in the request's buffer). Can be called from interrupt context
+void lora_api_radio_txDone(LORAWAN_RESULT_t res);
+void lora_api_radio_rxDone(LORAWAN_RESULT_t res, int rssi, int snr, uint8_t sz);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* H_LORAAPI_RADIO_H */
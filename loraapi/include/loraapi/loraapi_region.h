@@ -0,0 +1,84 @@
+/**
+ * Copyright 2019 Wyres
+ * Licensed under the Apache License, Version 2.0 (the "License"); 
+ * you may not use this file except in compliance with the License. 
+ * You may obtain a copy of the License at
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, 
+ * software distributed under the License is distributed on 
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, 
+ * either express or implied. See the License for the specific 
+ * language governing permissions and limitations under the License.
+*/
+#ifndef H_LORAAPI_REGION_H
+#define H_LORAAPI_REGION_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include "loraapi/loraapi.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* LoRaWAN regional parameters (UL side) used by the loraapi implementations. */
+// Region ids : same values as the stack's LoRaMacRegion_t, as given by lora_api_getCurrentRegion()
+typedef enum { LORAWAN_REGION_AS923, LORAWAN_REGION_AU915, LORAWAN_REGION_CN470, LORAWAN_REGION_CN779, LORAWAN_REGION_EU433,
+                LORAWAN_REGION_EU868, LORAWAN_REGION_KR920, LORAWAN_REGION_IN865, LORAWAN_REGION_US915, LORAWAN_REGION_US915_HYBRID,
+                LORAWAN_REGION_NB } LORAWAN_REGION_t;
+
+#define LORAWAN_REGION_MAX_DR       (8)
+#define LORAWAN_REGION_MAX_TXPOWER  (11)
+#define LORAWAN_MAX_FOPTS_SZ        (15)
+#define LORAWAN_REGION_MAX_BANDS    (6)
+#define LORAWAN_OVERHEAD_SZ         (13)    // MHDR+FHDR (no FOpts)+FPort+MIC
+
+// A regulatory sub-band
+typedef struct {
+    uint32_t minHz;
+    uint32_t maxHz;
+    uint16_t dcPermille;        // duty cycle allowed in this band
+} LORA_REGION_BAND_t;
+
+typedef struct {
+    uint8_t nbDR;                                   // UL datarates DR0..nbDR-1
+    uint8_t sf4DR[LORAWAN_REGION_MAX_DR];           // LORAWAN_SF_t for the DR (0 if not a 125kHz LoRa or FSK DR)
+    uint8_t maxPayload4DR[LORAWAN_REGION_MAX_DR];   // max MACPayload-FHDR-FPort (N) ie app payload with no FOpts
+    uint8_t nbTxPower;
+    int8_t txPower[LORAWAN_REGION_MAX_TXPOWER];     // dBm for each stack tx power level (0=max)
+    uint8_t nbBands;                                // duty cycle limited sub-bands (0=no duty cycle in region)
+    LORA_REGION_BAND_t bands[LORAWAN_REGION_MAX_BANDS]; // band 0 is the one with the default (join) channels
+    uint16_t dwellTimeMS;                           // max time on air per UL (0=none)
+} LORA_REGION_PARAMS_t;
+
+// Get params for a region (EU868 if unknown)
+const LORA_REGION_PARAMS_t* lora_region_get(int region);
+// DR for a SF (slowest DR using it, or DR0 if SF not usable in the region)
+int lora_region_sf2DR(const LORA_REGION_PARAMS_t* rp, LORAWAN_SF_t sf);
+// SF for a DR (LORAWAN_SF_DEFAULT if not a DR we can use)
+LORAWAN_SF_t lora_region_DR2sf(const LORA_REGION_PARAMS_t* rp, int dr);
+// Max app payload at this SF, when the stack has foptsSz bytes of MAC commands to piggyback
+uint8_t lora_region_maxPayload(const LORA_REGION_PARAMS_t* rp, LORAWAN_SF_t sf, uint8_t foptsSz);
+// Stack tx power level to use for a requested power in dBm (the highest one not above it)
+int8_t lora_region_txPowerLevel(const LORA_REGION_PARAMS_t* rp, int8_t dbm);
+// Slowest SF from sf to the fastest one, in which sz bytes fit. If none, returns the fastest SF. Never steps from LoRa to FSK.
+LORAWAN_SF_t lora_region_fitSF(const LORA_REGION_PARAMS_t* rp, LORAWAN_SF_t sf, uint8_t sz, uint8_t foptsSz);
+
+// LoRa time on air in us (fixed point) of a radio packet of plSz bytes (phy payload, so may be over 255 with the LoRaWAN overhead). bwkHz=125/250/500, cr=1..4 for 4/5..4/8.
+// FSK250 is 50kbps FSK (bw/cr/header ignored).
+uint32_t lora_toa_us(LORAWAN_SF_t sf, uint16_t bwkHz, uint8_t cr, uint16_t plSz, bool explicitHdr, bool crc, uint8_t preambleSyms);
+
+// Duty cycle ledger. Implementations call this for each UL they start, with its frequency if known (0 = not known, 
+// counted in the band of the default channels)
+void lora_region_noteTx(const LORA_REGION_PARAMS_t* rp, uint32_t freqHz, uint32_t toaMS);
+// Band (0..nbBands-1) of a frequency (0 = not known : band of the default channels), -1 if not in a duty cycled band
+int lora_region_band4Freq(const LORA_REGION_PARAMS_t* rp, uint32_t freqHz);
+// ms until band (0..nbBands-1) is out of its duty cycle off time (0 = now)
+uint32_t lora_region_bandWaitMS(const LORA_REGION_PARAMS_t* rp, int band);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* H_LORAAPI_REGION_H */
@@ -0,0 +1,31 @@
+/**
+ * Copyright 2019 Wyres
+ * Licensed under the Apache License, Version 2.0 (the "License"); 
+ * you may not use this file except in compliance with the License. 
+ * You may obtain a copy of the License at
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, 
+ * software distributed under the License is distributed on 
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, 
+ * either express or implied. See the License for the specific 
+ * language governing permissions and limitations under the License.
+*/
+#ifndef H_LORAAPI_ULQ_H
+#define H_LORAAPI_ULQ_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Uplink queue hooks for use by loraapi implementations only (not by apps) */
+
+// Initialise the queue. Call from lora_api_init()
+void lora_api_ulq_init(void);
+// Tell the queue the lorawan tx slot has been released (after the tx callback has been done)
+void lora_api_ulq_txFree(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* H_LORAAPI_ULQ_H */
@@ -0,0 +1,191 @@
+/**
+ * Copyright 2019 Wyres
+ * Licensed under the Apache License, Version 2.0 (the "License"); 
+ * you may not use this file except in compliance with the License. 
+ * You may obtain a copy of the License at
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, 
+ * software distributed under the License is distributed on 
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, 
+ * either express or implied. See the License for the specific 
+ * language governing permissions and limitations under the License.
+*/
+
+/* Link quality history shared by the loraapi implementations, to choose the SF for ULs sent with LORAWAN_SF_AUTO :
+ - DL rssi/snr (averaged) and ACK results are recorded per SF
+ - the SF steps to a faster one when the DL snr shows enough margin over the demodulation floor of the faster SF
+   (and that SF has not recently failed)
+ - the SF steps to a slower one after consecutive confirmed ULs with no ACK
+ The history is saved in the config (on SF changes, and every few ULs if it changed) so a reboot doesn't restart from the default SF.
+ The implementation must call lora_api_link_init() in its init, lora_api_link_noteUL() at the end of each UL and
+ lora_api_link_noteDL() for each DL whose rssi/snr it knows (made up values would skew the SF choice).
+ */
+#include <string.h>
+
+#include "os/os.h"
+
+#include "wyres-generic/wutils.h"
+#include "wyres-generic/configmgr.h"
+#include "loraapi/loraapi.h"
+#include "loraapi/loraapi_link.h"
+
+#define FAIL_STEP       MYNEWT_VAL(LORAAPI_LINK_FAIL_STEP)
+#define MARGIN_DB       MYNEWT_VAL(LORAAPI_LINK_MARGIN_DB)
+#define SAVE_UL         MYNEWT_VAL(LORAAPI_LINK_SAVE_UL)
+#define NB_SF           (LORAWAN_SF12 - LORAWAN_SF7 + 1)
+#define SF_IDX(__sf)    ((__sf) - LORAWAN_SF7)
+#define SAT_INC(__v)    if ((__v)<UINT8_MAX) { (__v)++; }
+
+typedef struct {
+    int16_t rssi;           // averaged DL rssi (dBm)
+    int8_t snr;             // averaged DL snr (dB)
+    uint8_t nbDL;           // DLs seen at this SF (saturates)
+    uint8_t nbAck;          // ACKs seen at this SF (saturates)
+    uint8_t failRun;        // consecutive confirmed ULs with no ACK (decays with ACKs at slower SFs)
+} LinkSF_t;
+
+// As saved in config
+typedef struct {
+    uint8_t autoSF;
+    LinkSF_t sf[NB_SF];
+} LinkHistory_t;
+
+static struct {
+    LinkHistory_t h;
+    LinkHistory_t saved;        // as last written to config, to only write it again if it changed
+    uint8_t ulSinceSave;
+} _link;
+
+static bool isLoRaSF(LORAWAN_SF_t sf) {
+    return (sf>=LORAWAN_SF7 && sf<=LORAWAN_SF12);
+}
+
+// Demodulation floor (snr in quarter dB) for a SF : -7.5dB at SF7, 2.5dB lower per SF step
+static int snrFloorQ4(int sf) {
+    return -30 - 10*(sf - LORAWAN_SF7);
+}
+
+static void save() {
+    _link.ulSinceSave = 0;
+    if (memcmp(&_link.h, &_link.saved, sizeof(_link.h))!=0) {
+        CFMgr_setElement(CFG_LORA_KEY_LINK_HISTORY, &_link.h, sizeof(_link.h));
+        _link.saved = _link.h;
+    }
+}
+
+static void setAutoSF(int sf, const char* why) {
+    log_info("LW:auto SF %d->%d (%s)", _link.h.autoSF, sf, why);
+    _link.h.autoSF = sf;
+    save();
+}
+
+// Go to the fastest SF that the snr at the current one says has MARGIN_DB of margin
+static void checkStepUp() {
+    int cur = _link.h.autoSF;
+    LinkSF_t* l = &_link.h.sf[SF_IDX(cur)];
+    if (l->nbDL==0) {
+        return;
+    }
+    int marginQ4 = l->snr*4 - snrFloorQ4(cur);
+    int target = cur;
+    while(target>LORAWAN_SF7) {
+        int next = target-1;
+        // 2.5dB less margin per faster SF
+        if (_link.h.sf[SF_IDX(next)].failRun>=FAIL_STEP || (marginQ4 - (cur-next)*10) < MARGIN_DB*4) {
+            break;
+        }
+        target = next;
+    }
+    if (target!=cur) {
+        setAutoSF(target, "margin");
+    }
+}
+
+/** API implementation */
+
+LORAWAN_SF_t lora_api_getAutoSF(int* rssi, int* snr) {
+    LinkSF_t* l = &_link.h.sf[SF_IDX(_link.h.autoSF)];
+    if (rssi!=NULL) {
+        *rssi = (l->nbDL>0 ? l->rssi : 0);
+    }
+    if (snr!=NULL) {
+        *snr = (l->nbDL>0 ? l->snr : 0);
+    }
+    return _link.h.autoSF;
+}
+
+void lora_api_resetLinkHistory(LORAWAN_SF_t sf) {
+    memset(&_link.h, 0, sizeof(_link.h));
+    _link.h.autoSF = (isLoRaSF(sf) ? sf : LORAWAN_SF10);
+    save();
+}
+
+/** Implementation hooks */
+
+void lora_api_link_init(LORAWAN_SF_t defaultSF) {
+    memset(&_link, 0, sizeof(_link));
+    _link.h.autoSF = (isLoRaSF(defaultSF) ? defaultSF : LORAWAN_SF10);
+    CFMgr_getOrAddElement(CFG_LORA_KEY_LINK_HISTORY, &_link.h, sizeof(_link.h));
+    _link.saved = _link.h;
+    if (!isLoRaSF(_link.h.autoSF)) {
+        // corrupt or from another firmware version
+        lora_api_resetLinkHistory(defaultSF);
+    }
+}
+
+LORAWAN_SF_t lora_api_link_getSF(bool useADR) {
+    return (useADR ? LORAWAN_SF_USEADR : _link.h.autoSF);
+}
+
+void lora_api_link_noteUL(LORAWAN_SF_t sf, bool reqAck, bool ackRx) {
+    if (!isLoRaSF(sf)) {
+        return;     // ADR or FSK : nothing to learn for the auto SF
+    }
+    LinkSF_t* l = &_link.h.sf[SF_IDX(sf)];
+    bool saved = false;
+    if (reqAck) {
+        if (ackRx) {
+            SAT_INC(l->nbAck);
+            l->failRun = 0;
+            // works here, so give faster SFs that failed another chance eventually
+            for(int s=LORAWAN_SF7;s<sf;s++) {
+                if (_link.h.sf[SF_IDX(s)].failRun>0) {
+                    _link.h.sf[SF_IDX(s)].failRun--;
+                }
+            }
+        } else {
+            SAT_INC(l->failRun);
+            if (sf==_link.h.autoSF && l->failRun>=FAIL_STEP && sf<LORAWAN_SF12) {
+                setAutoSF(sf+1, "no ack");
+                saved = true;
+            }
+        }
+    }
+    if (!saved) {
+        SAT_INC(_link.ulSinceSave);
+        if (_link.ulSinceSave>=SAVE_UL) {
+            save();
+        }
+    }
+}
+
+void lora_api_link_noteDL(LORAWAN_SF_t sf, int rssi, int snr) {
+    if (!isLoRaSF(sf)) {
+        return;
+    }
+    LinkSF_t* l = &_link.h.sf[SF_IDX(sf)];
+    if (l->nbDL==0) {
+        l->rssi = rssi;
+        l->snr = snr;
+    } else {
+        // average over roughly the last 4
+        l->rssi = (l->rssi*3 + rssi)/4;
+        l->snr = (l->snr*3 + snr)/4;
+    }
+    SAT_INC(l->nbDL);
+    // a DL also means the UL got through
+    l->failRun = 0;
+    if (sf==_link.h.autoSF) {
+        checkStepUp();
+    }
+}
@@ -0,0 +1,339 @@
+/**
+ * Copyright 2019 Wyres
+ * Licensed under the Apache License, Version 2.0 (the "License"); 
+ * you may not use this file except in compliance with the License. 
+ * You may obtain a copy of the License at
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, 
+ * software distributed under the License is distributed on 
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, 
+ * either express or implied. See the License for the specific 
+ * language governing permissions and limitations under the License.
+*/
+
+/* Radio access scheduler shared by the loraapi implementations. Arbitrates between LoRaWAN exchanges and raw radio tx/rx
+ slots requested for absolute times (lora_api_radio_tx/rx) :
+ - a slot is only accepted if it does not overlap (with a guard time) another slot or the LoRaWAN exchange in progress
+ - a LoRaWAN exchange is only started if it will be over (RX windows closed) before the next slot
+ - raw tx count in the duty cycle ledger of their band, and are refused if that band is still in its off time
+ - a slot can be cancelled until it starts
+ The implementation must call lora_api_radio_init() in its init, lora_api_radio_lwStart()/lwEnd() round each LoRaWAN exchange,
+ and provide lora_api_radio_hwTx()/hwRx() to drive the radio when a slot starts (or lora_api_radio_hwAvailable() returning
+ false, in which case no slots are accepted).
+ */
+#include <string.h>
+
+#include "os/os.h"
+
+#include "wyres-generic/wutils.h"
+#include "wyres-generic/timemgr.h"
+#include "loraapi/loraapi.h"
+#include "loraapi/loraapi_radio.h"
+#include "loraapi/loraapi_region.h"
+
+#define MAX_SLOTS           MYNEWT_VAL(LORAAPI_RADIO_MAX_REQS)
+#define GUARD_MS            MYNEWT_VAL(LORAAPI_RADIO_GUARD_MS)
+#define HW_MARGIN_MS        (1000)      // after the expected end of a raw tx/rx, before we give up on the radio
+#define RX2_DELAY_MS        (2000)      // LoRaWAN RECEIVE_DELAY2
+#define JOIN_RX2_DELAY_MS   (6000)      // LoRaWAN JOIN_ACCEPT_DELAY2
+#define RX2_DL_MS           (1500)      // RX2 window plus reception of a DL in it
+#define JOIN_REQ_SZ         (23)        // PHY payload of a join request
+
+typedef enum { SLOT_FREE, SLOT_WAITING, SLOT_RUNNING } SLOT_STATE_t;
+
+typedef struct {
+    SLOT_STATE_t state;
+    bool isTx;
+    uint32_t startMS;
+    uint32_t durMS;
+    uint32_t freq;
+    LORAWAN_SF_t sf;
+    int8_t power;
+    uint8_t* data;
+    uint8_t sz;
+    LORAWAN_TX_CB_t txcb;
+    LORAWAN_RX_CB_t rxcb;
+    void* userctx;
+    struct os_callout timer;        // slot start, then watchdog on the hw result
+} RadioSlot_t;
+
+static struct {
+    RadioSlot_t slots[MAX_SLOTS];
+    struct os_mutex lock;
+    struct os_event doneEvent;
+    bool lwBusy;
+    uint32_t lwEndMS;
+    // result of the running slot, as given by the implementation
+    LORAWAN_RESULT_t hwRes;
+    int hwRssi;
+    int hwSnr;
+    uint8_t hwSz;
+} _radio;
+
+static uint32_t nowMS() {
+    return TMMgr_getRelTimeMS();
+}
+
+// Do [aStart, aStart+aDur) and [bStart, bStart+bDur) come within GUARD_MS of each other?
+static bool overlaps(uint32_t aStart, uint32_t aDur, uint32_t bStart, uint32_t bDur) {
+    return ((int32_t)(aStart - (bStart + bDur + GUARD_MS)) < 0 && (int32_t)(bStart - (aStart + aDur + GUARD_MS)) < 0);
+}
+
+// Is a LoRaWAN exchange using the radio? Called with lock held
+static bool lwIsBusy(uint32_t now) {
+    if (_radio.lwBusy && (int32_t)(now - _radio.lwEndMS) >= 0) {
+        // Should have been told it was over, but its time is up anyway
+        _radio.lwBusy = false;
+    }
+    return _radio.lwBusy;
+}
+
+// Does this time range conflict with a slot? Called with lock held
+static bool slotConflicts(uint32_t startMS, uint32_t durMS) {
+    for(int i=0;i<MAX_SLOTS;i++) {
+        RadioSlot_t* s = &_radio.slots[i];
+        if (s->state!=SLOT_FREE && overlaps(startMS, durMS, s->startMS, s->durMS)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// End a slot and tell its owner
+static void finish(RadioSlot_t* slot, LORAWAN_RESULT_t res, int rssi, int snr, uint8_t sz) {
+    os_callout_stop(&slot->timer);
+    os_mutex_pend(&_radio.lock, OS_TIMEOUT_NEVER);
+    bool isTx = slot->isTx;
+    LORAWAN_TX_CB_t txcb = slot->txcb;
+    LORAWAN_RX_CB_t rxcb = slot->rxcb;
+    void* userctx = slot->userctx;
+    uint8_t* data = slot->data;
+    // free before the callback so the owner can schedule the next one from it
+    slot->state = SLOT_FREE;
+    os_mutex_release(&_radio.lock);
+    if (isTx) {
+        (*txcb)(userctx, res);
+    } else {
+        (*rxcb)(userctx, res, 0, rssi, snr, (res==LORAWAN_RES_OK ? data : NULL), (res==LORAWAN_RES_OK ? sz : 0));
+    }
+}
+
+// Start time of a slot, or its watchdog if running. Runs on the default eventq
+static void slotEvent(struct os_event* ev) {
+    RadioSlot_t* slot = (RadioSlot_t*)(ev->ev_arg);
+    if (slot->state==SLOT_RUNNING) {
+        log_warn("LW:radio no result from hw");
+        finish(slot, LORAWAN_RES_HWERR, 0, 0, 0);
+        return;
+    }
+    if (slot->state!=SLOT_WAITING) {
+        return;     // cancelled
+    }
+    LORAWAN_RESULT_t res = LORAWAN_RES_OK;
+    os_mutex_pend(&_radio.lock, OS_TIMEOUT_NEVER);
+    if (lwIsBusy(nowMS())) {
+        // LoRaWAN exchange has overrun its time
+        res = LORAWAN_RES_OCC;
+    } else {
+        slot->state = SLOT_RUNNING;
+    }
+    os_mutex_release(&_radio.lock);
+    const LORA_REGION_PARAMS_t* rp = lora_region_get(lora_api_getCurrentRegion());
+    if (res==LORAWAN_RES_OK && slot->isTx && lora_region_bandWaitMS(rp, lora_region_band4Freq(rp, slot->freq))>0) {
+        res = LORAWAN_RES_DUTYCYCLE;
+    }
+    if (res==LORAWAN_RES_OK) {
+        bool started = (slot->isTx ? lora_api_radio_hwTx(slot->freq, slot->sf, slot->power, slot->data, slot->sz) :
+                                    lora_api_radio_hwRx(slot->freq, slot->sf, slot->durMS, slot->data, slot->sz));
+        if (started) {
+            if (slot->isTx) {
+                lora_region_noteTx(rp, slot->freq, slot->durMS);
+            }
+            // result will come from the implementation, but don't wait for ever
+            os_callout_reset(&slot->timer, os_time_ms_to_ticks32(slot->durMS + HW_MARGIN_MS));
+            return;
+        }
+        res = LORAWAN_RES_HWERR;
+    }
+    log_debug("LW:radio %s at %d fails %d", (slot->isTx ? "tx" : "rx"), slot->startMS, res);
+    finish(slot, res, 0, 0, 0);
+}
+
+// Result from the implementation for the running slot
+static void doneEvent(struct os_event* ev) {
+    for(int i=0;i<MAX_SLOTS;i++) {
+        if (_radio.slots[i].state==SLOT_RUNNING) {
+            finish(&_radio.slots[i], _radio.hwRes, _radio.hwRssi, _radio.hwSnr, _radio.hwSz);
+            return;
+        }
+    }
+    // too late, the watchdog already ended it
+}
+
+// Reserve a slot for [atMS, atMS+durMS) if nothing else is using the radio then
+static RadioSlot_t* reserve(uint32_t atMS, uint32_t durMS) {
+    uint32_t now = nowMS();
+    if (atMS==0) {
+        atMS = now;
+    }
+    if ((int32_t)(atMS - now) < 0) {
+        log_debug("LW:radio slot in the past");
+        return NULL;
+    }
+    RadioSlot_t* ret = NULL;
+    os_mutex_pend(&_radio.lock, OS_TIMEOUT_NEVER);
+    if (lwIsBusy(now) && overlaps(atMS, durMS, now, _radio.lwEndMS - now)) {
+        log_debug("LW:radio slot during lorawan exchange");
+    } else if (slotConflicts(atMS, durMS)) {
+        log_debug("LW:radio slot conflicts");
+    } else {
+        for(int i=0;i<MAX_SLOTS;i++) {
+            if (_radio.slots[i].state==SLOT_FREE) {
+                ret = &_radio.slots[i];
+                ret->state = SLOT_WAITING;
+                ret->startMS = atMS;
+                ret->durMS = durMS;
+                break;
+            }
+        }
+    }
+    os_mutex_release(&_radio.lock);
+    return ret;
+}
+
+static void arm(RadioSlot_t* slot) {
+    int32_t delay = (int32_t)(slot->startMS - nowMS());
+    os_callout_reset(&slot->timer, os_time_ms_to_ticks32(delay>0 ? delay : 0));
+}
+
+/** API implementation */
+
+// Schedule direct radio tx access for specific time
+LORAWAN_REQ_ID_t lora_api_radio_tx(uint32_t abs_time, LORAWAN_SF_t sf, uint32_t freq, int txpower, uint8_t* data, uint8_t sz, LORAWAN_TX_CB_t callback, void* userctx) {
+    assert(callback!=NULL);
+    assert(data!=NULL);
+    if (!lora_api_radio_hwAvailable()) {
+        return NULL;        // this implementation can't do raw access : don't reserve a slot that can only fail
+    }
+    if (sf==LORAWAN_SF_DEFAULT || sf==LORAWAN_SF_USEADR || sf==LORAWAN_SF_AUTO || freq==0 || sz==0) {
+        return NULL;        // raw access needs explicit radio settings
+    }
+    // raw LoRa packet : 125kHz, CR4/5, explicit header, crc, 8 symbol preamble
+    uint32_t durMS = (lora_toa_us(sf, 125, 1, sz, true, true, 8) + 999)/1000;
+    const LORA_REGION_PARAMS_t* rp = lora_region_get(lora_api_getCurrentRegion());
+    if (rp->dwellTimeMS>0 && durMS>rp->dwellTimeMS) {
+        return NULL;
+    }
+    RadioSlot_t* slot = reserve(abs_time, durMS);
+    if (slot==NULL) {
+        return NULL;
+    }
+    slot->isTx = true;
+    slot->sf = sf;
+    slot->freq = freq;
+    slot->power = txpower;
+    slot->data = data;
+    slot->sz = sz;
+    slot->txcb = callback;
+    slot->rxcb = NULL;
+    slot->userctx = userctx;
+    arm(slot);
+    return slot;
+}
+
+// Schedule direct radio rx access for specific time
+LORAWAN_REQ_ID_t lora_api_radio_rx(uint32_t abs_time, LORAWAN_SF_t sf, uint32_t freq, uint32_t timeoutms, uint8_t* data, uint8_t sz, LORAWAN_RX_CB_t callback, void* userctx) {
+    assert(callback!=NULL);
+    assert(data!=NULL);
+    if (!lora_api_radio_hwAvailable()) {
+        return NULL;
+    }
+    if (sf==LORAWAN_SF_DEFAULT || sf==LORAWAN_SF_USEADR || sf==LORAWAN_SF_AUTO || freq==0 || sz==0 || timeoutms==0) {
+        return NULL;
+    }
+    RadioSlot_t* slot = reserve(abs_time, timeoutms);
+    if (slot==NULL) {
+        return NULL;
+    }
+    slot->isTx = false;
+    slot->sf = sf;
+    slot->freq = freq;
+    slot->data = data;
+    slot->sz = sz;
+    slot->txcb = NULL;
+    slot->rxcb = callback;
+    slot->userctx = userctx;
+    arm(slot);
+    return slot;
+}
+
+// Cancel a pending request. True if cancelled without action, false if already in progress (or done) and cannot be cancelled
+bool lora_api_cancel(LORAWAN_REQ_ID_t id) {
+    bool ret = false;
+    os_mutex_pend(&_radio.lock, OS_TIMEOUT_NEVER);
+    for(int i=0;i<MAX_SLOTS;i++) {
+        RadioSlot_t* slot = &_radio.slots[i];
+        if (slot==id && slot->state==SLOT_WAITING) {
+            os_callout_stop(&slot->timer);
+            slot->state = SLOT_FREE;
+            ret = true;
+        }
+    }
+    os_mutex_release(&_radio.lock);
+    return ret;
+}
+
+/** Implementation hooks */
+
+uint32_t lora_api_radio_lwExchangeMS(LORAWAN_SF_t sf, uint8_t sz, bool doRx, bool isJoin) {
+    if (isJoin) {
+        return (lora_toa_us(sf, 125, 1, JOIN_REQ_SZ, true, true, 8) + 999)/1000 + JOIN_RX2_DELAY_MS + RX2_DL_MS;
+    }
+    uint32_t toa = lora_api_estimateToA(sf, sz);
+    return (doRx ? (toa + RX2_DELAY_MS + RX2_DL_MS) : toa);
+}
+
+bool lora_api_radio_lwCanStart(uint32_t durationMS) {
+    os_mutex_pend(&_radio.lock, OS_TIMEOUT_NEVER);
+    bool ret = !slotConflicts(nowMS(), durationMS);
+    os_mutex_release(&_radio.lock);
+    return ret;
+}
+
+bool lora_api_radio_lwStart(uint32_t durationMS) {
+    uint32_t now = nowMS();
+    os_mutex_pend(&_radio.lock, OS_TIMEOUT_NEVER);
+    bool ret = !slotConflicts(now, durationMS);
+    if (ret) {
+        _radio.lwBusy = true;
+        _radio.lwEndMS = now + durationMS;
+    }
+    os_mutex_release(&_radio.lock);
+    return ret;
+}
+
+void lora_api_radio_lwEnd() {
+    _radio.lwBusy = false;
+}
+
+void lora_api_radio_txDone(LORAWAN_RESULT_t res) {
+    _radio.hwRes = res;
+    os_eventq_put(os_eventq_dflt_get(), &_radio.doneEvent);
+}
+
+void lora_api_radio_rxDone(LORAWAN_RESULT_t res, int rssi, int snr, uint8_t sz) {
+    _radio.hwRes = res;
+    _radio.hwRssi = rssi;
+    _radio.hwSnr = snr;
+    _radio.hwSz = sz;
+    os_eventq_put(os_eventq_dflt_get(), &_radio.doneEvent);
+}
+
+void lora_api_radio_init() {
+    memset(&_radio, 0, sizeof(_radio));
+    os_mutex_init(&_radio.lock);
+    _radio.doneEvent.ev_cb = &doneEvent;
+    for(int i=0;i<MAX_SLOTS;i++) {
+        os_callout_init(&_radio.slots[i].timer, os_eventq_dflt_get(), &slotEvent, &_radio.slots[i]);
+    }
+}
@@ -0,0 +1,276 @@
+/**
+ * Copyright 2019 Wyres
+ * Licensed under the Apache License, Version 2.0 (the "License"); 
+ * you may not use this file except in compliance with the License. 
+ * You may obtain a copy of the License at
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, 
+ * software distributed under the License is distributed on 
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, 
+ * either express or implied. See the License for the specific 
+ * language governing permissions and limitations under the License.
+*/
+
+/* LoRaWAN regional parameters tables (from LoRaWAN 1.0.2 regional parameters, UL side only), 
+ time on air calculation and duty cycle ledger.
+ Max payloads are the application payload sizes (N) without repeater, for every region */
+#include <string.h>
+
+#include "os/os.h"
+
+#include "wyres-generic/wutils.h"
+#include "loraapi/loraapi.h"
+#include "loraapi/loraapi_region.h"
+#include "loraapi/loraapi_link.h"
+
+// The EU like regions only differ in power
+#define EU_LIKE_DRS     .nbDR = 8, \
+                        .sf4DR = { LORAWAN_SF12, LORAWAN_SF11, LORAWAN_SF10, LORAWAN_SF9, LORAWAN_SF8, LORAWAN_SF7, 0, LORAWAN_FSK250 }, \
+                        .maxPayload4DR = { 51, 51, 51, 115, 242, 242, 242, 242 }
+#define US_LIKE_POWER   .nbTxPower = 11, \
+                        .txPower = { 30, 28, 26, 24, 22, 20, 18, 16, 14, 12, 10 }
+
+static const LORA_REGION_PARAMS_t _regions[LORAWAN_REGION_NB] = {
+    [LORAWAN_REGION_AS923] = {
+        EU_LIKE_DRS,
+        .nbTxPower = 8,
+        .txPower = { 16, 14, 12, 10, 8, 6, 4, 2 },
+        .nbBands = 0,
+        .dwellTimeMS = 400,
+    },
+    [LORAWAN_REGION_AU915] = {
+        .nbDR = 7,
+        .sf4DR = { LORAWAN_SF12, LORAWAN_SF11, LORAWAN_SF10, LORAWAN_SF9, LORAWAN_SF8, LORAWAN_SF7, 0 },
+        .maxPayload4DR = { 51, 51, 51, 115, 242, 242, 242 },
+        US_LIKE_POWER,
+        .nbBands = 0,
+        .dwellTimeMS = 0,
+    },
+    [LORAWAN_REGION_CN470] = {
+        .nbDR = 6,
+        .sf4DR = { LORAWAN_SF12, LORAWAN_SF11, LORAWAN_SF10, LORAWAN_SF9, LORAWAN_SF8, LORAWAN_SF7 },
+        .maxPayload4DR = { 51, 51, 51, 115, 242, 242 },
+        .nbTxPower = 8,
+        .txPower = { 19, 17, 15, 13, 11, 9, 7, 5 },
+        .nbBands = 0,
+        .dwellTimeMS = 0,
+    },
+    [LORAWAN_REGION_CN779] = {
+        EU_LIKE_DRS,
+        .nbTxPower = 6,
+        .txPower = { 12, 10, 8, 6, 4, 2 },
+        .nbBands = 1,
+        .bands = { { 779000000, 787000000, 10 } },
+        .dwellTimeMS = 0,
+    },
+    [LORAWAN_REGION_EU433] = {
+        EU_LIKE_DRS,
+        .nbTxPower = 6,
+        .txPower = { 12, 10, 8, 6, 4, 2 },
+        .nbBands = 1,
+        .bands = { { 433050000, 434790000, 10 } },
+        .dwellTimeMS = 0,
+    },
+    [LORAWAN_REGION_EU868] = {
+        EU_LIKE_DRS,
+        .nbTxPower = 8,
+        .txPower = { 16, 14, 12, 10, 8, 6, 4, 2 },
+        .nbBands = 6,
+        .bands = {
+            { 868000000, 868600000, 10 },   // h1.6 : default channels
+            { 865000000, 868000000, 10 },   // h1.5
+            { 868700000, 869200000, 1 },    // h1.7
+            { 869400000, 869650000, 100 },  // h1.9
+            { 869700000, 870000000, 10 },   // h1.10
+            { 863000000, 865000000, 1 },    // h1.4
+        },
+        .dwellTimeMS = 0,
+    },
+    [LORAWAN_REGION_KR920] = {
+        .nbDR = 6,
+        .sf4DR = { LORAWAN_SF12, LORAWAN_SF11, LORAWAN_SF10, LORAWAN_SF9, LORAWAN_SF8, LORAWAN_SF7 },
+        .maxPayload4DR = { 51, 51, 51, 115, 242, 242 },
+        .nbTxPower = 8,
+        .txPower = { 14, 12, 10, 8, 6, 4, 2, 0 },
+        .nbBands = 0,
+        .dwellTimeMS = 0,
+    },
+    [LORAWAN_REGION_IN865] = {
+        EU_LIKE_DRS,
+        US_LIKE_POWER,
+        .nbBands = 0,
+        .dwellTimeMS = 0,
+    },
+    [LORAWAN_REGION_US915] = {
+        .nbDR = 5,
+        .sf4DR = { LORAWAN_SF10, LORAWAN_SF9, LORAWAN_SF8, LORAWAN_SF7, 0 },
+        .maxPayload4DR = { 11, 53, 125, 242, 242 },
+        US_LIKE_POWER,
+        .nbBands = 0,
+        .dwellTimeMS = 400,
+    },
+    [LORAWAN_REGION_US915_HYBRID] = {
+        .nbDR = 5,
+        .sf4DR = { LORAWAN_SF10, LORAWAN_SF9, LORAWAN_SF8, LORAWAN_SF7, 0 },
+        .maxPayload4DR = { 11, 53, 125, 242, 242 },
+        US_LIKE_POWER,
+        .nbBands = 0,
+        .dwellTimeMS = 400,
+    },
+};
+
+// Duty cycle ledger : end of off time for each band of the current region
+static struct {
+    const LORA_REGION_PARAMS_t* rp;
+    bool offTime[LORAWAN_REGION_MAX_BANDS];
+    uint32_t freeAtMS[LORAWAN_REGION_MAX_BANDS];
+} _dc;
+
+static uint32_t nowMS() {
+    return os_time_ticks_to_ms32(os_time_get());
+}
+
+const LORA_REGION_PARAMS_t* lora_region_get(int region) {
+    if (region<0 || region>=LORAWAN_REGION_NB) {
+        log_warn("LW:unknown region %d, using EU868", region);
+        region = LORAWAN_REGION_EU868;
+    }
+    return &_regions[region];
+}
+
+int lora_region_sf2DR(const LORA_REGION_PARAMS_t* rp, LORAWAN_SF_t sf) {
+    for(int dr=0;dr<rp->nbDR;dr++) {
+        if (rp->sf4DR[dr]==sf) {
+            return dr;
+        }
+    }
+    return 0;
+}
+
+LORAWAN_SF_t lora_region_DR2sf(const LORA_REGION_PARAMS_t* rp, int dr) {
+    if (dr<0 || dr>=rp->nbDR || rp->sf4DR[dr]==0) {
+        return LORAWAN_SF_DEFAULT;
+    }
+    return rp->sf4DR[dr];
+}
+
+uint8_t lora_region_maxPayload(const LORA_REGION_PARAMS_t* rp, LORAWAN_SF_t sf, uint8_t foptsSz) {
+    uint8_t n = rp->maxPayload4DR[lora_region_sf2DR(rp, sf)];
+    if (foptsSz>LORAWAN_MAX_FOPTS_SZ) {
+        foptsSz = LORAWAN_MAX_FOPTS_SZ;
+    }
+    return (n>foptsSz ? (n-foptsSz) : 0);
+}
+
+int8_t lora_region_txPowerLevel(const LORA_REGION_PARAMS_t* rp, int8_t dbm) {
+    for(int i=0;i<rp->nbTxPower;i++) {
+        if (rp->txPower[i]<=dbm) {
+            return i;
+        }
+    }
+    // Lower than lowest : use lowest
+    return (rp->nbTxPower-1);
+}
+
+LORAWAN_SF_t lora_region_fitSF(const LORA_REGION_PARAMS_t* rp, LORAWAN_SF_t sf, uint8_t sz, uint8_t foptsSz) {
+    LORAWAN_SF_t fastest = sf;
+    for(int dr=lora_region_sf2DR(rp, sf);dr<rp->nbDR;dr++) {
+        // only LoRa DRs : stepping to FSK would change the modulation under the caller's feet
+        if (rp->sf4DR[dr]==0 || (rp->sf4DR[dr]==LORAWAN_FSK250 && sf!=LORAWAN_FSK250)) {
+            continue;
+        }
+        fastest = rp->sf4DR[dr];
+        if (sz <= lora_region_maxPayload(rp, fastest, foptsSz)) {
+            return fastest;
+        }
+    }
+    return fastest;
+}
+
+uint32_t lora_toa_us(LORAWAN_SF_t sf, uint16_t bwkHz, uint8_t cr, uint16_t plSz, bool explicitHdr, bool crc, uint8_t preambleSyms) {
+    if (sf==LORAWAN_FSK250) {
+        // 50kbps : 5 preamble + 3 sync + 1 length + payload + 2 crc bytes, at 160us per byte
+        return (5+3+1+plSz+2)*160;
+    }
+    if (sf<LORAWAN_SF7 || sf>LORAWAN_SF12) {
+        sf = LORAWAN_SF12;      // worst case
+    }
+    if (bwkHz==0) {
+        bwkHz = 125;
+    }
+    if (cr<1 || cr>4) {
+        cr = 1;
+    }
+    uint32_t tSymUS = ((1<<sf)*1000)/bwkHz;
+    int de = (tSymUS>=16000 ? 1 : 0);           // low data rate optimise is used for symbols of 16ms or more
+    int32_t num = 8*plSz - 4*sf + 28 + (crc ? 16 : 0) - (explicitHdr ? 0 : 20);
+    int32_t den = 4*(sf - 2*de);
+    int32_t nPayloadSyms = 8 + (num>0 ? ((num + den - 1)/den)*(cr+4) : 0);
+    // preamble is preambleSyms + 4.25 symbols
+    return ((preambleSyms*4 + 17)*tSymUS)/4 + nPayloadSyms*tSymUS;
+}
+
+static void checkLedger(const LORA_REGION_PARAMS_t* rp) {
+    // New region, old ledger is meaningless
+    if (_dc.rp!=rp) {
+        memset(&_dc, 0, sizeof(_dc));
+        _dc.rp = rp;
+    }
+}
+
+int lora_region_band4Freq(const LORA_REGION_PARAMS_t* rp, uint32_t freqHz) {
+    if (freqHz==0) {
+        return 0;
+    }
+    for(int i=0;i<rp->nbBands;i++) {
+        if (freqHz>=rp->bands[i].minHz && freqHz<rp->bands[i].maxHz) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void lora_region_noteTx(const LORA_REGION_PARAMS_t* rp, uint32_t freqHz, uint32_t toaMS) {
+    checkLedger(rp);
+    int b = lora_region_band4Freq(rp, freqHz);
+    if (b<0 || b>=rp->nbBands || rp->bands[b].dcPermille==0) {
+        return;     // not in a duty cycled band
+    }
+    // off time such that the band is used only dcPermille of the time
+    _dc.freeAtMS[b] = nowMS() + (toaMS*1000)/rp->bands[b].dcPermille;
+    _dc.offTime[b] = true;
+}
+
+uint32_t lora_region_bandWaitMS(const LORA_REGION_PARAMS_t* rp, int band) {
+    checkLedger(rp);
+    if (band<0 || band>=rp->nbBands || !_dc.offTime[band]) {
+        return 0;
+    }
+    int32_t wait = (int32_t)(_dc.freeAtMS[band] - nowMS());
+    if (wait<=0) {
+        _dc.offTime[band] = false;
+        return 0;
+    }
+    return wait;
+}
+
+/** API implementation common to all implementations */
+
+uint32_t lora_api_estimateToA(LORAWAN_SF_t sf, uint8_t sz) {
+    if (sf==LORAWAN_SF_AUTO) {
+        sf = lora_api_link_getSF(false);
+    }
+    if (sf==LORAWAN_SF_DEFAULT || sf==LORAWAN_SF_USEADR) {
+        sf = LORAWAN_SF12;      // can't know, so worst case
+    }
+    // LoRaWAN ULs : 125kHz, CR4/5, explicit header, crc, 8 symbol preamble
+    return (lora_toa_us(sf, 125, 1, sz + LORAWAN_OVERHEAD_SZ, true, true, 8) + 999)/1000;
+}
+
+uint32_t lora_api_nextTxPossibleMS(LORAWAN_SF_t sf, uint8_t sz) {
+    const LORA_REGION_PARAMS_t* rp = lora_region_get(lora_api_getCurrentRegion());
+    if (rp->dwellTimeMS>0 && lora_api_estimateToA(sf, sz) > rp->dwellTimeMS) {
+        return UINT32_MAX;
+    }
+    return lora_region_bandWaitMS(rp, 0);
+}
@@ -0,0 +1,315 @@
+/**
+ * Copyright 2019 Wyres
+ * Licensed under the Apache License, Version 2.0 (the "License"); 
+ * you may not use this file except in compliance with the License. 
+ * You may obtain a copy of the License at
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, 
+ * software distributed under the License is distributed on 
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, 
+ * either express or implied. See the License for the specific 
+ * language governing permissions and limitations under the License.
+*/
+
+/* Uplink queue shared by the loraapi implementations. Sits on top of lora_api_send() (which only allows 1 outstanding UL) :
+ - requests are held in a bounded pool, and the highest priority (then oldest) is sent as soon as the stack tx slot is free
+ - each request can have a max wait time after which it is dropped (callback with LORAWAN_RES_TIMEOUT)
+ - requests flagged as 'coalesce' for the same port/SF are concatenated into a single frame up to the max payload for the SF
+ The implementation must call lora_api_ulq_init() in its init, and lora_api_ulq_txFree() each time its tx slot is released.
+ */
+#include <string.h>
+
+#include "os/os.h"
+
+#include "wyres-generic/wutils.h"
+#include "loraapi/loraapi.h"
+#include "loraapi/loraapi_ulq.h"
+
+#define ULQ_SZ          MYNEWT_VAL(LORAAPI_ULQ_SZ)
+#define ULQ_RETRY_MS    MYNEWT_VAL(LORAAPI_ULQ_RETRY_MS)
+#define MAX_FRAME_SZ    (250)       // biggest LoRaWAN app payload whatever the SF/region
+
+typedef struct {
+    bool used;
+    bool inFlight;          // part of the frame currently with the stack
+    bool coalesce;
+    bool reqAck;
+    bool doRx;
+    LORAWAN_SF_t sf;
+    uint8_t port;
+    uint8_t prio;
+    uint8_t* data;
+    uint8_t sz;
+    uint32_t seq;           // enqueue order, to keep FIFO within a priority
+    uint32_t expiresAtMS;   // 0 = never
+    LORAWAN_TX_CB_t cbfn;
+    void* userctx;
+} ULQ_ENTRY_t;
+
+// Callbacks to do once the lock is released
+typedef struct {
+    LORAWAN_TX_CB_t cbfn;
+    void* userctx;
+    LORAWAN_RESULT_t res;
+} ULQ_DONE_t;
+
+static struct {
+    ULQ_ENTRY_t q[ULQ_SZ];
+    struct os_mutex lock;
+    struct os_event drainEvent;
+    struct os_callout retryTimer;
+    bool txBusy;            // our frame is with the stack
+    uint32_t nextSeq;
+    uint8_t frame[MAX_FRAME_SZ];    // used when several requests are coalesced into 1 UL
+    uint32_t nbDropped;
+} _ulq;
+
+static void txDoneCB(void* userctx, LORAWAN_RESULT_t res);
+
+static uint32_t nowMS() {
+    return os_time_ticks_to_ms32(os_time_get());
+}
+
+// Should a go before b? (higher prio, or same prio and older)
+static bool isBefore(ULQ_ENTRY_t* a, ULQ_ENTRY_t* b) {
+    if (a->prio!=b->prio) {
+        return (a->prio > b->prio);
+    }
+    return ((int32_t)(a->seq - b->seq) < 0);
+}
+
+// Find next waiting entry in tx order (after the given one, or from the start if NULL). Called with lock held
+static ULQ_ENTRY_t* findNext(ULQ_ENTRY_t* after) {
+    ULQ_ENTRY_t* best = NULL;
+    for(int i=0;i<ULQ_SZ;i++) {
+        ULQ_ENTRY_t* e = &_ulq.q[i];
+        if (e->used && !e->inFlight &&
+                (after==NULL || isBefore(after, e)) &&
+                (best==NULL || isBefore(e, best))) {
+            best = e;
+        }
+    }
+    return best;
+}
+
+// Find the entry to evict for a new request of priority prio : the last in tx order, if it has a lower priority
+static ULQ_ENTRY_t* findVictim(uint8_t prio) {
+    ULQ_ENTRY_t* victim = NULL;
+    for(int i=0;i<ULQ_SZ;i++) {
+        ULQ_ENTRY_t* e = &_ulq.q[i];
+        if (e->used && !e->inFlight && e->prio < prio &&
+                (victim==NULL || isBefore(victim, e))) {
+            victim = e;
+        }
+    }
+    return victim;
+}
+
+// Free expired entries, adding their callbacks into done[]. Returns new number in done[]. Called with lock held
+static int purgeExpired(ULQ_DONE_t* done, int nDone) {
+    uint32_t now = nowMS();
+    for(int i=0;i<ULQ_SZ;i++) {
+        ULQ_ENTRY_t* e = &_ulq.q[i];
+        if (e->used && !e->inFlight && e->expiresAtMS!=0 && (int32_t)(now - e->expiresAtMS) >= 0) {
+            done[nDone].cbfn = e->cbfn;
+            done[nDone].userctx = e->userctx;
+            done[nDone].res = LORAWAN_RES_TIMEOUT;
+            nDone++;
+            e->used = false;
+            _ulq.nbDropped++;
+        }
+    }
+    return nDone;
+}
+
+static void callDone(ULQ_DONE_t* done, int nDone) {
+    for(int i=0;i<nDone;i++) {
+        (*done[i].cbfn)(done[i].userctx, done[i].res);
+    }
+}
+
+// Build the next frame from the queue and give it to the stack. Always run from the default eventq
+static void drain(struct os_event* ev) {
+    ULQ_DONE_t done[ULQ_SZ];
+    int nDone = 0;
+    bool retry = false;
+    os_mutex_pend(&_ulq.lock, OS_TIMEOUT_NEVER);
+    nDone = purgeExpired(done, nDone);
+    ULQ_ENTRY_t* head = (_ulq.txBusy ? NULL : findNext(NULL));
+    if (head!=NULL) {
+        uint8_t* data = head->data;
+        uint8_t sz = head->sz;
+        bool reqAck = head->reqAck;
+        bool doRx = head->doRx;
+        head->inFlight = true;
+        if (head->coalesce) {
+            // Add following coalescable requests for same port/SF, in tx order, while they fit
+            uint8_t maxSz = lora_api_getMaxPayloadSz(head->sf);
+            ULQ_ENTRY_t* e = head;
+            while((e=findNext(e))!=NULL) {
+                if (e->coalesce && e->port==head->port && e->sf==head->sf && (sz+e->sz)<=maxSz) {
+                    if (data!=_ulq.frame) {
+                        memcpy(_ulq.frame, data, sz);
+                        data = _ulq.frame;
+                    }
+                    memcpy(&_ulq.frame[sz], e->data, e->sz);
+                    sz += e->sz;
+                    reqAck |= e->reqAck;
+                    doRx |= e->doRx;
+                    e->inFlight = true;
+                }
+            }
+        }
+        _ulq.txBusy = true;
+        LORAWAN_RESULT_t res = lora_api_send(head->sf, head->port, reqAck, doRx, data, sz, txDoneCB, NULL);
+        if (res!=LORAWAN_RES_OK) {
+            // put them all back
+            _ulq.txBusy = false;
+            for(int i=0;i<ULQ_SZ;i++) {
+                _ulq.q[i].inFlight = false;
+            }
+            if (res!=LORAWAN_RES_OCC && res!=LORAWAN_RES_DUTYCYCLE) {
+                // Hard failure (not init etc) : fail the head request only, others may still succeed later
+                log_warn("LW:ULQ tx fails %d", res);
+                done[nDone].cbfn = head->cbfn;
+                done[nDone].userctx = head->userctx;
+                done[nDone].res = res;
+                nDone++;
+                head->used = false;
+            }
+            // stack busy (direct lora_api_send() user?) : txFree() should kick us, but retry anyway in case
+            retry = true;
+        } else {
+            log_debug("LW:ULQ tx %d bytes on port %d", sz, head->port);
+        }
+    }
+    os_mutex_release(&_ulq.lock);
+    if (retry) {
+        os_callout_reset(&_ulq.retryTimer, os_time_ms_to_ticks32(ULQ_RETRY_MS));
+    }
+    // callbacks outside of lock as they may well queue a new request
+    callDone(done, nDone);
+}
+
+// Result of our frame : tell everyone who was in it
+static void txDoneCB(void* userctx, LORAWAN_RESULT_t res) {
+    ULQ_DONE_t done[ULQ_SZ];
+    int nDone = 0;
+    os_mutex_pend(&_ulq.lock, OS_TIMEOUT_NEVER);
+    for(int i=0;i<ULQ_SZ;i++) {
+        ULQ_ENTRY_t* e = &_ulq.q[i];
+        if (e->used && e->inFlight) {
+            done[nDone].cbfn = e->cbfn;
+            done[nDone].userctx = e->userctx;
+            done[nDone].res = res;
+            nDone++;
+            e->used = false;
+            e->inFlight = false;
+        }
+    }
+    _ulq.txBusy = false;
+    os_mutex_release(&_ulq.lock);
+    callDone(done, nDone);
+    // and go again
+    os_eventq_put(os_eventq_dflt_get(), &_ulq.drainEvent);
+}
+
+/** API implementation */
+
+// Queue an UL request
+LORAWAN_RESULT_t lora_api_sendQ(LORAWAN_SF_t sf, uint8_t port, bool reqAck, bool doRx,
+                uint8_t* data, uint8_t sz, LORAWAN_PRIO_t prio, uint32_t maxWaitMS, bool coalesce,
+                LORAWAN_TX_CB_t callback, void* userctx) {
+    assert(callback!=NULL);
+    assert(data!=NULL);
+    if (sz>lora_api_getMaxPayloadSz(sf)) {
+        return LORAWAN_RES_BADPARAM;
+    }
+    ULQ_DONE_t evicted = { .cbfn=NULL };
+    os_mutex_pend(&_ulq.lock, OS_TIMEOUT_NEVER);
+    ULQ_ENTRY_t* e = NULL;
+    for(int i=0;i<ULQ_SZ;i++) {
+        if (!_ulq.q[i].used) {
+            e = &_ulq.q[i];
+            break;
+        }
+    }
+    if (e==NULL) {
+        // Full : can we bump someone less important?
+        e = findVictim(prio);
+        if (e==NULL) {
+            os_mutex_release(&_ulq.lock);
+            return LORAWAN_RES_OCC;
+        }
+        evicted.cbfn = e->cbfn;
+        evicted.userctx = e->userctx;
+        evicted.res = LORAWAN_RES_OCC;
+        _ulq.nbDropped++;
+    }
+    e->used = true;
+    e->inFlight = false;
+    e->coalesce = coalesce;
+    e->reqAck = reqAck;
+    e->doRx = doRx;
+    e->sf = sf;
+    e->port = port;
+    e->prio = prio;
+    e->data = data;
+    e->sz = sz;
+    e->seq = _ulq.nextSeq++;
+    e->expiresAtMS = 0;
+    if (maxWaitMS>0) {
+        e->expiresAtMS = nowMS()+maxWaitMS;
+        if (e->expiresAtMS==0) {
+            e->expiresAtMS = 1;     // 0 means never
+        }
+    }
+    e->cbfn = callback;
+    e->userctx = userctx;
+    os_mutex_release(&_ulq.lock);
+    if (evicted.cbfn!=NULL) {
+        log_debug("LW:ULQ full, evicted 1");
+        callDone(&evicted, 1);
+    }
+    os_eventq_put(os_eventq_dflt_get(), &_ulq.drainEvent);
+    return LORAWAN_RES_OK;
+}
+
+// Remove a queued request that has not yet been given to the stack
+bool lora_api_cancelQ(LORAWAN_TX_CB_t callback, void* userctx) {
+    bool ret = false;
+    os_mutex_pend(&_ulq.lock, OS_TIMEOUT_NEVER);
+    for(int i=0;i<ULQ_SZ;i++) {
+        ULQ_ENTRY_t* e = &_ulq.q[i];
+        if (e->used && !e->inFlight && e->cbfn==callback && e->userctx==userctx) {
+            e->used = false;
+            ret = true;
+        }
+    }
+    os_mutex_release(&_ulq.lock);
+    return ret;
+}
+
+// How many requests are queued or being sent
+int lora_api_getQLen() {
+    int n = 0;
+    for(int i=0;i<ULQ_SZ;i++) {
+        if (_ulq.q[i].used) {
+            n++;
+        }
+    }
+    return n;
+}
+
+/** Implementation hooks */
+
+void lora_api_ulq_txFree() {
+    os_eventq_put(os_eventq_dflt_get(), &_ulq.drainEvent);
+}
+
+void lora_api_ulq_init() {
+    memset(&_ulq, 0, sizeof(_ulq));
+    os_mutex_init(&_ulq.lock);
+    _ulq.drainEvent.ev_cb = &drain;
+    os_callout_init(&_ulq.retryTimer, os_eventq_dflt_get(), &drain, NULL);
+}
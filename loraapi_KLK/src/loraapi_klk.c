@@ -17,7 +17,7 @@
  - KLK api does not allow UL without RX -> request UL with doRx=false is not honoured
  - KLK api does not allow DL RX on wildcard port -> cannot register RX with wildcard port simply
  - KLK api does not allow handling of txpower/SF per-tx -> must reconfig socket every time?
- - radio access apis not yet implemented
+ - KLK api gives no raw radio access -> lora_api_radio_tx/rx requests are refused immediately (return NULL), no slot is reserved
  */
 #include <string.h>
 
@@ -31,20 +31,31 @@
 #include "wyres-generic/timemgr.h"
 #include "wyres-generic/lowpowermgr.h"
 #include "loraapi/loraapi.h"
+#include "loraapi/loraapi_ulq.h"
+#include "loraapi/loraapi_region.h"
+#include "loraapi/loraapi_radio.h"
+#include "loraapi/loraapi_link.h"
 // Kerlink lorawan api
 #include "lorawan_api/lorawan_api.h"
+#if MYNEWT_VAL(SX1272)
+// for the last packet rssi/snr, which the KLK api does not give
+#include "sx1272/sx1272.h"
+#endif
 
 #define LORAAPI_TASK_PRIO       MYNEWT_VAL(LORAAPI_TASK_PRIO)
 #define LORAAPI_TASK_STACK_SZ   OS_STACK_ALIGN(256)
 #define MAX_RXCBS   (2)         // can register 2 rx callbacks on different ports if required
-#define MAX_TXRADIOCBS   (1)    // as not yet implemented
-#define MAX_RXRADIOCBS   (1)    // or maybe coz don't need this fn
+#define MAX_RX_SZ   (255)
+#define RX2_DELAY_MS    MYNEWT_VAL(LORAAPI_KLK_RX2_DELAY_MS)
+#define RX2_MAX_DL_SZ   (51)        // biggest DL app payload at the slowest RX2 DR (EU868 DR0)
+#define RX_POLL_MS      MYNEWT_VAL(LORAAPI_KLK_RX_POLL_MS)
+#define FOPTS_RESERVE   MYNEWT_VAL(LORAAPI_FOPTS_RESERVE)
 
-#define MAX_LWEVTS  (2)     // number of outstanding API->task events at any time
+#define MAX_LWEVTS  (2)     // number of outstanding API->task events at any time (1 join + 1 tx, as UL requests are serialised by the UL queue)
 
 // Events sent on a task q to be executed asynchronously
 typedef enum { LWEVT_TYPE_UNUSED, 
-    LWEVT_TYPE_DOJOIN, LWEVT_TYPE_DOTXLW, LWEVT_TYPE_DOTXRADIO, LWEVT_TYPE_DORXRADIO
+    LWEVT_TYPE_DOJOIN, LWEVT_TYPE_DOTXLW
  } LWEVT_TYPE_t;
 typedef struct {
     LWEVT_TYPE_t type;
@@ -64,6 +75,7 @@ typedef struct  {
         bool doRx;
         uint8_t* data;         
         uint8_t sz;
+        uint32_t txStartMS;
         LORAWAN_TX_CB_t cbfn;
         void* userctx;
     } TxLoraWanReq_t;
@@ -74,42 +86,17 @@ typedef struct  {
         void* userctx;
     } RxLoraWanReq_t;
 
-typedef struct  {
-        struct os_callout timer;
-        uint32_t atTxMS;
-        int8_t power;
-        uint32_t freq;
-        LORAWAN_SF_t sf;
-        uint8_t* data;
-        uint8_t sz;
-        LORAWAN_TX_CB_t cbfn;
-        void* userctx;        
-    } TxRadioReq_t;
-
-typedef struct  {
-        struct os_callout timer;
-        uint32_t atRxMS;
-        uint32_t tRxMS;
-        uint32_t freq;
-        LORAWAN_SF_t sf;
-        uint8_t* data;
-        uint8_t sz;
-        LORAWAN_RX_CB_t cbfn;
-        void* userctx;        
-    } RxRadioReq_t;
-
 static struct loraapi_ctx {
     bool isJoin;
     LP_ID_t lpUserId;
     LORAWAN_SF_t defaultSF;
     int defaultLWPower;
+    const LORA_REGION_PARAMS_t* regionParams;
     bool useADR;
     uint32_t txTimeoutMS;
     JoinReq_t joinLoraWANReq;
     TxLoraWanReq_t txLoraWANReq;
     RxLoraWanReq_t rxLoraWANReqs[MAX_RXCBS];        // can have multiple rx listeners
-    TxRadioReq_t txRadioReqs[MAX_TXRADIOCBS];
-    RxRadioReq_t rxRadioReqs[MAX_RXRADIOCBS];
     uint8_t deveui[8];
     uint8_t appeui[8];
     uint8_t appkey[16];
@@ -118,7 +105,9 @@ static struct loraapi_ctx {
     lorawan_sock_t sock_tx;
     lorawan_sock_t sock_rx;
     struct os_eventq* lwevt_q;
-    struct os_sem lora_tx_sem;
+    struct os_eventq task_q;            // for the actions that block in the KLK api, run by our task
+    struct os_event txWaitEvent;
+    uint8_t rxBuf[MAX_RX_SZ];
     // lwevt pool
     struct {
         struct os_event e;
@@ -129,7 +118,8 @@ static struct loraapi_ctx {
 } _loraCtx;     // Note : initialised to all 0 in init method and then to specific defaults
 
 static void loraapi_task(void* data);
-static struct os_event* allocEvent();
+static void txWaitEvent(struct os_event* e);
+static struct os_event* allocEvent(LWEVT_TYPE_t type);
 static void freeEvent(struct os_event* e);
 static uint8_t maxSz4SF(int sf);
 
@@ -168,10 +158,9 @@ LORAWAN_RESULT_t lora_api_join(LORAWAN_JOIN_CB_t callback, LORAWAN_SF_t sf, void
         _loraCtx.joinLoraWANReq.cbfn = callback;
         _loraCtx.joinLoraWANReq.userctx = userctx;
         // kick off join request
-        struct os_event* e = allocEvent();
+        struct os_event* e = allocEvent(LWEVT_TYPE_DOJOIN);
         if (e!=NULL) {
             LWEVT_t* evt = (LWEVT_t*)e->ev_arg;
-            evt->type = LWEVT_TYPE_DOJOIN;
             evt->req = NULL;        // not required
             log_info("LW: JOINing as [%02x%02x%02x%02x%02x%02x%02x%02x]",
                 _loraCtx.deveui[0],_loraCtx.deveui[1],_loraCtx.deveui[2],_loraCtx.deveui[3],_loraCtx.deveui[4],_loraCtx.deveui[5],_loraCtx.deveui[6],_loraCtx.deveui[7]);
@@ -244,12 +233,23 @@ LORAWAN_RESULT_t lora_api_send(LORAWAN_SF_t sf, uint8_t port, bool reqAck, bool
     if (_loraCtx.sock_tx<=0) {
         return LORAWAN_RES_FWERR;       // can't tx before init
     }
+    if (sf==LORAWAN_SF_AUTO) {
+        sf = lora_api_link_getSF(_loraCtx.useADR);
+    }
     if (sf==LORAWAN_SF_DEFAULT) {
         sf = _loraCtx.defaultSF;
     }
+    if (sf!=LORAWAN_SF_USEADR) {
+        // Go faster rather than truncate if it doesn't fit in this SF
+        sf = lora_region_fitSF(_loraCtx.regionParams, sf, sz, FOPTS_RESERVE);
+    }
     if (sz>maxSz4SF(sf)) {
         sz=maxSz4SF(sf);
     }
+    // Would it run into a scheduled radio tx/rx? (KLK always opens the RX windows, and joins first if required)
+    if (!lora_api_radio_lwCanStart(lora_api_radio_lwExchangeMS(sf, sz, true, !lora_api_isJoined()))) {
+        return LORAWAN_RES_OCC;
+    }
     // Check not already ongoing
     if (_loraCtx.txLoraWANReq.cbfn==NULL) {
         _loraCtx.txLoraWANReq.cbfn = callback;
@@ -262,10 +262,9 @@ LORAWAN_RESULT_t lora_api_send(LORAWAN_SF_t sf, uint8_t port, bool reqAck, bool
         _loraCtx.txLoraWANReq.doRx = doRx;
         _loraCtx.txLoraWANReq.reqAck = reqAck;
         // kick off request
-        struct os_event* e = allocEvent();
+        struct os_event* e = allocEvent(LWEVT_TYPE_DOTXLW);
         if (e!=NULL) {
             LWEVT_t* evt = (LWEVT_t*)e->ev_arg;
-            evt->type = LWEVT_TYPE_DOTXLW;
             evt->req = &_loraCtx.txLoraWANReq;
             os_eventq_put(_loraCtx.lwevt_q, e);
             return LORAWAN_RES_OK;
@@ -280,60 +279,15 @@ LORAWAN_RESULT_t lora_api_send(LORAWAN_SF_t sf, uint8_t port, bool reqAck, bool
     return LORAWAN_RES_OCC;
 }
 
-// Schedule direct radio tx access for specific time
-LORAWAN_REQ_ID_t lora_api_radio_tx(uint32_t abs_time, LORAWAN_SF_t sf, uint32_t freq, int txpower, uint8_t* data, uint8_t sz, LORAWAN_TX_CB_t callback, void* userctx) {
-    assert(callback!=NULL);
-    assert(data!=NULL);
-    // Check for a free slot
-    for(int i=0;i<MAX_TXRADIOCBS;i++) {
-        TxRadioReq_t* req = &_loraCtx.txRadioReqs[i];
-        if (req->cbfn==NULL) {
-            req->cbfn = callback;
-            req->userctx = userctx;
-            req->data = data;
-            req->sz = sz;
-            req->sf = sf;
-            req->freq = freq;
-            req->power = txpower;
-            req->atTxMS = abs_time;
-
-            // TODO : check time is after now, and no other radio request using it....
-            os_callout_reset(&req->timer, os_time_ms_to_ticks32(abs_time - TMMgr_getRelTimeMS()));
-
-            return req;
-        }
+// Max app payload for an UL at this SF
+uint8_t lora_api_getMaxPayloadSz(LORAWAN_SF_t sf) {
+    if (sf==LORAWAN_SF_AUTO) {
+        sf = lora_api_link_getSF(_loraCtx.useADR);
     }
-    return NULL;
-}
-// Schedule direct radio rx access for specific time
-LORAWAN_REQ_ID_t lora_api_radio_rx(uint32_t abs_time, LORAWAN_SF_t sf, uint32_t freq, uint32_t timeoutms, uint8_t* data, uint8_t sz, LORAWAN_RX_CB_t callback, void* userctx) {
-    assert(callback!=NULL);
-    assert(data!=NULL);
-    // Check for a free slot
-    for(int i=0;i<MAX_RXCBS;i++) {
-        RxRadioReq_t* req = &_loraCtx.rxRadioReqs[i];
-        if (req->cbfn==NULL) {
-            req->cbfn = callback;
-            req->userctx = userctx;
-            req->data = data;
-            req->sz = sz;
-            req->sf = sf;
-            req->freq = freq;
-            req->atRxMS = abs_time;
-            req->tRxMS = timeoutms;
-            // TODO : check time is after now, and no other radio request using it....
-            os_callout_reset(&req->timer, os_time_ms_to_ticks32(abs_time - TMMgr_getRelTimeMS()));
-
-            return req;
-        }
+    if (sf==LORAWAN_SF_DEFAULT) {
+        sf = _loraCtx.defaultSF;
     }
-    return NULL;
-}
-
-// Cancel a pending request. True if cancelled without action, false if already in progress and cannot be cancelled
-bool lora_api_cancel(LORAWAN_REQ_ID_t id) {
-    // TODO - find req in one of the lists, cancel it
-    return true;
+    return maxSz4SF(sf);
 }
 
 // Get current lora region
@@ -353,15 +307,15 @@ LORAWAN_RESULT_t lora_api_setCurrentRegion(int r) {
 
 // Internals
 
-static struct os_event* allocEvent() {
+static struct os_event* allocEvent(LWEVT_TYPE_t type) {
     // Find an unused one in list
     struct os_event* ret = NULL;
     // mutex access to this list for concurrent calls to allocEvent
     os_mutex_pend(&_loraCtx.lwevts_mutex, OS_TIMEOUT_NEVER);
     for(int i=0;i<MAX_LWEVTS;i++) {
         if (_loraCtx.lwevts[i].lwevt.type==LWEVT_TYPE_UNUSED) {
-            // flag in use
-            _loraCtx.lwevts[i].lwevt.type = LWEVT_TYPE_UNUSED;
+            // flag in use (with its type) before releasing the mutex
+            _loraCtx.lwevts[i].lwevt.type = type;
             ret = &_loraCtx.lwevts[i].e;
             break;
         }
@@ -429,57 +383,31 @@ static bool checkRadio() {
 }
 */
 
+// Stack power level (0=max of region) for a dBm value
 static int8_t mapPowerDb2PowerLevel(int8_t db) {
-    // 868MHz : 0=highest, 1=14, 2=11, 3=8, 4=5, 5=2...
-    // MApping from dbM to power level is regional dependant...
-    int8_t txPowerLevel = ((14-db)/2);
-    // Ensure not negative (eg for >14dm permitted regions)
-    if (txPowerLevel<0) {
-        txPowerLevel = 0;
-    }
-    return txPowerLevel;
+    return lora_region_txPowerLevel(_loraCtx.regionParams, db);
 }
-// TODO use stack regional params functions to find max pkt size per SF per region
+// Max app payload for the SF in the current region (ADR : the slowest DR's)
 static uint8_t maxSz4SF(int sf) {
-    switch(sf) {
-        case LORAWAN_SF12: 
-            return 52;
-        case LORAWAN_SF11: 
-            return 52;
-        case LORAWAN_SF10: 
-            return 52;
-        case LORAWAN_SF9: 
-            return 98;
-        case LORAWAN_SF8: 
-            return 98;
-        case LORAWAN_SF7: 
-            return 250;
-        case LORAWAN_FSK250: 
-            return 250;
-        default:
-            return 52;
-    }
+    return lora_region_maxPayload(_loraCtx.regionParams, sf, FOPTS_RESERVE);
 }
 
 static int mapSF2DR(int sf) {
-    switch(sf) {
-        case LORAWAN_SF12: 
-            return 0;
-        case LORAWAN_SF11: 
-            return 1;
-        case LORAWAN_SF10: 
-            return 2;
-        case LORAWAN_SF9: 
-            return 3;
-        case LORAWAN_SF8: 
-            return 4;
-        case LORAWAN_SF7: 
-            return 5;
-        case LORAWAN_FSK250: 
-            return 6;
-        default:
-            return 2;       // If your SF is weird, you get SF10
+    if (sf==LORAWAN_SF_USEADR || sf==LORAWAN_SF_DEFAULT) {
+        sf = _loraCtx.defaultSF;
+    }
+    return lora_region_sf2DR(_loraCtx.regionParams, sf);
+}
+// SF the stack uses for this UL : the requested one, or the stack's current DR's with ADR (SF12 worst case if it can't say)
+static LORAWAN_SF_t ulSF(LORAWAN_SF_t sf) {
+    if (sf==LORAWAN_SF_USEADR || sf==LORAWAN_SF_DEFAULT) {
+        lorawan_attribute_t mib;
+        mib.Type = LORAWAN_ATTR_CHANNELS_DATARATE;
+        if (lorawan_getsockopt(_loraCtx.sock_tx, &mib)==LORAWAN_STATUS_OK) {
+            return lora_region_DR2sf(_loraCtx.regionParams, mib.Param.ChannelsDefaultDatarate);
+        }
     }
+    return sf;
 }
 static bool configTxSocket(lorawan_sock_t skt, bool useAck, LORAWAN_SF_t sf, int txPower) {
     bool ret = true;
@@ -523,34 +451,48 @@ static bool do_lora_send(TxLoraWanReq_t* req) {
     if (configTxSocket(_loraCtx.sock_tx, req->reqAck, req->sf, req->power)) {
         log_debug("LW:tx cfg ok");
     }
-    // and schedule the sending
-    int ret = lorawan_send(_loraCtx.sock_tx, req->port, req->data, req->sz);
+    // and schedule the sending, if a radio tx/rx slot doesn't need the radio before the RX windows are closed
+    int ret = LORAWAN_STATUS_PORT_BUSY;
+    if (lora_api_radio_lwStart(lora_api_radio_lwExchangeMS(req->sf, req->sz, true, !lora_api_isJoined()))) {
+        ret = lorawan_send(_loraCtx.sock_tx, req->port, req->data, req->sz);
+        if (ret!=LORAWAN_STATUS_OK) {
+            lora_api_radio_lwEnd();
+        }
+    }
     switch(ret) {
         case LORAWAN_STATUS_OK: {
             log_debug("LW:tx %d bytes ok on port:%d sf:%d txpower:%d ackReq:%d doRx %d]",
                 req->sz, req->port, 
                 req->sf, req->power, req->reqAck,
                 req->doRx);
-            // release the task to wait for result 
-            os_sem_release(&_loraCtx.lora_tx_sem);
+            req->txStartMS = TMMgr_getRelTimeMS();
+            lora_region_noteTx(_loraCtx.regionParams, 0, lora_api_estimateToA(ulSF(req->sf), req->sz));
+            // radio must stay up till the RX windows are done
+            LPMgr_setLPMode(_loraCtx.lpUserId, LP_SLEEP);
+            // get the task to wait for result 
+            os_eventq_put(&_loraCtx.task_q, &_loraCtx.txWaitEvent);
             // yes, started tx. Will call sender back once tx done
             return true;
         }
         case LORAWAN_STATUS_PORT_BUSY: {
             log_debug("LW:tx  busy");
             // tell sender we failed
-            (*req->cbfn)(req->userctx, LORAWAN_RES_OCC);
-            // And free his slot
+            LORAWAN_TX_CB_t cbfn = req->cbfn;
+            // And free his slot (before the callback so he can retry in it)
             req->cbfn = NULL;
+            (*cbfn)(req->userctx, LORAWAN_RES_OCC);
+            lora_api_ulq_txFree();
             return false;
         }
         default: {
             log_warn("LW:tx fatal error (%d).",
                 ret);
             // tell sender failed 
-            (*req->cbfn)(req->userctx, LORAWAN_RES_HWERR);
+            LORAWAN_TX_CB_t cbfn = req->cbfn;
             // And free his slot
             req->cbfn = NULL;
+            (*cbfn)(req->userctx, LORAWAN_RES_HWERR);
+            lora_api_ulq_txFree();
             return false;       // best you reset mate
         }
     }
@@ -631,6 +573,13 @@ static void execReqEvent(struct os_event* e) {
                     (_loraCtx.joinLoraWANReq.cbfn)(_loraCtx.joinLoraWANReq.userctx, LORAWAN_RES_JOIN_OK);
                     _loraCtx.joinLoraWANReq.cbfn=NULL;
                 }
+            } else if (_loraCtx.txLoraWANReq.cbfn!=NULL) {
+                // join is done with an UL, and one is already in progress : try again later
+                log_debug("LW:J req but tx busy");
+                if (_loraCtx.joinLoraWANReq.cbfn!=NULL) {
+                    (_loraCtx.joinLoraWANReq.cbfn)(_loraCtx.joinLoraWANReq.userctx, LORAWAN_RES_OCC);
+                    _loraCtx.joinLoraWANReq.cbfn=NULL;
+                }
             } else {
                 // try to send a JOIN request (devEUI, appKey, use ADR etc already setup in init)
                 if (do_lora_join()) {
@@ -654,18 +603,14 @@ static void execReqEvent(struct os_event* e) {
             } else {
                 log_debug("LW:TXUL not joined");
                 // tell sender failed as not join
-                (*req->cbfn)(req->userctx, LORAWAN_RES_NOT_JOIN);
+                LORAWAN_TX_CB_t cbfn = req->cbfn;
                 // And free his slot
                 req->cbfn = NULL;
+                (*cbfn)(req->userctx, LORAWAN_RES_NOT_JOIN);
+                lora_api_ulq_txFree();
             }
             break;            
         }
-        case LWEVT_TYPE_DORXRADIO: {
-            break;            
-        }
-        case LWEVT_TYPE_DOTXRADIO: {
-            break;            
-        }
         default:{
             log_debug("LW:? event:%d", evt->type);
             break;
@@ -674,13 +619,17 @@ static void execReqEvent(struct os_event* e) {
     freeEvent(e);
 }
 
-static void execTxRadio(struct os_event* e) {
-    // TODO access to stack not yet possible
-    log_warn("LW:DRTX TBI");
+// Raw radio access for the scheduled radio tx/rx : the KLK api does not give any, so none are scheduled
+bool lora_api_radio_hwAvailable() {
+    return false;
 }
-static void execRxRadio(struct os_event* e) {
-    // TODO access to stack not yet possible
-    log_warn("LW:DRRX TBI");
+bool lora_api_radio_hwTx(uint32_t freq, LORAWAN_SF_t sf, int8_t power, uint8_t* data, uint8_t sz) {
+    log_warn("LW:DRTX not possible with KLK api");
+    return false;
+}
+bool lora_api_radio_hwRx(uint32_t freq, LORAWAN_SF_t sf, uint32_t timeoutMS, uint8_t* data, uint8_t sz) {
+    log_warn("LW:DRRX not possible with KLK api");
+    return false;
 }
 
 extern void lorawan_init(void);
@@ -748,8 +697,9 @@ void lora_api_init(uint8_t* devEUI, uint8_t* appEUI, uint8_t* appKey, bool enabl
     _loraCtx.txTimeoutMS = 16000;       // longest time it should take in SF12 to send max packet, and wait for max DL on RX2...
     // execute our api requests on the default event q
     _loraCtx.lwevt_q = os_eventq_dflt_get();
-    // need a semaphore...
-    os_sem_init(&_loraCtx.lora_tx_sem,0);
+    // and the blocking waits on the stack in our task
+    os_eventq_init(&_loraCtx.task_q);
+    _loraCtx.txWaitEvent.ev_cb = &txWaitEvent;
 
     for(int i=0;i<8;i++) {
         _loraCtx.deveui[i] = devEUI[i];
@@ -763,21 +713,18 @@ void lora_api_init(uint8_t* devEUI, uint8_t* appEUI, uint8_t* appKey, bool enabl
     _loraCtx.useADR = enableADR;
     _loraCtx.defaultSF = defaultSF;
     _loraCtx.defaultLWPower = defaultTxPower;
+    // KLK wrapper region is fixed at build time
+    _loraCtx.regionParams = lora_region_get(lora_api_getCurrentRegion());
     // init events (mutex, q, each event in the pool)
     os_mutex_init(&_loraCtx.lwevts_mutex);
+    lora_api_ulq_init();
     for(int i=0;i<MAX_LWEVTS;i++) {
         _loraCtx.lwevts[i].e.ev_cb = &execReqEvent;
         _loraCtx.lwevts[i].e.ev_arg = &(_loraCtx.lwevts[i].lwevt);
         _loraCtx.lwevts[i].lwevt.type = LWEVT_TYPE_UNUSED;
     }
-    for(int i=0;i<MAX_TXRADIOCBS;i++) {
-        TxRadioReq_t* req = &_loraCtx.txRadioReqs[i];
-        os_callout_init(&req->timer, _loraCtx.lwevt_q, execTxRadio, req);    
-    }
-    for(int i=0;i<MAX_RXRADIOCBS;i++) {
-        RxRadioReq_t* req = &_loraCtx.rxRadioReqs[i];
-        os_callout_init(&req->timer, _loraCtx.lwevt_q, execRxRadio, req);    
-    }
+    lora_api_radio_init();
+    lora_api_link_init(_loraCtx.defaultSF);
 
 /*    // Check SX1272 is alive
     if (checkRadio()) {
@@ -819,7 +766,7 @@ void lora_api_init(uint8_t* devEUI, uint8_t* appEUI, uint8_t* appKey, bool enabl
     _loraCtx.sock_rx = lorawan_socket(SOCKET_TYPE_RX);
     assert(_loraCtx.sock_rx > 0);
 
-    // Create task to run TX/RX as KLK wrapper uses blocking calls... 
+    // Create task to wait for TX/RX results as KLK wrapper uses blocking calls... 
     os_task_init(&_loraCtx.loraapi_task_str, "lw_eventq",
                  loraapi_task, NULL,
                  LORAAPI_TASK_PRIO, OS_WAIT_FOREVER,
@@ -827,6 +774,10 @@ void lora_api_init(uint8_t* devEUI, uint8_t* appEUI, uint8_t* appKey, bool enabl
                  LORAAPI_TASK_STACK_SZ);
     // register with lowpowermgr to know when to deinit/init the radio
     _loraCtx.lpUserId = LPMgr_register(lp_change);
+    // radio is only affected by DEEPSLEEP or lower
+    LPMgr_setCBMode(_loraCtx.lpUserId, LP_SLEEP);
+    // and it can be turned off when no tx/rx is going on
+    LPMgr_setLPMode(_loraCtx.lpUserId, LP_DEEPSLEEP);
 
     // ok lorawan api all init ok
     log_info("LW: cfgd [%02x%02x%02x%02x%02x%02x%02x%02x] adr:%d, sf:%d, txpower:%d",
@@ -836,6 +787,9 @@ void lora_api_init(uint8_t* devEUI, uint8_t* appEUI, uint8_t* appKey, bool enabl
 }
 
 static void callTxCB(lorawan_event_t txev) {
+    if (txev & (LORAWAN_EVENT_ACK|LORAWAN_EVENT_SENT)) {
+        lora_api_link_noteUL(_loraCtx.txLoraWANReq.sf, _loraCtx.txLoraWANReq.reqAck, (txev & LORAWAN_EVENT_ACK)!=0);
+    }
     if (_loraCtx.txLoraWANReq.cbfn!=NULL) {
         LORAWAN_TX_CB_t txcbfn = _loraCtx.txLoraWANReq.cbfn;
         void* userctx = _loraCtx.txLoraWANReq.userctx;
@@ -868,6 +822,8 @@ static void callTxCB(lorawan_event_t txev) {
         // shouldn't happen? Assrt?
         log_warn("LW: tx ev no cbfn");
     }
+    // tx slot is free, next queued UL can go
+    lora_api_ulq_txFree();
 }
 static void callRxCB(uint8_t port, uint8_t* data, uint8_t sz, int rssi, int snr) {
     // Find all registered users for this port and call them
@@ -879,33 +835,68 @@ static void callRxCB(uint8_t port, uint8_t* data, uint8_t sz, int rssi, int snr)
     }
 }
 
-static void loraapi_task(void* data) {
-    while(1) {
-        if (_loraCtx.sock_tx>0) {
-            // Wait till we have tx'd something
-            os_sem_pend(&_loraCtx.lora_tx_sem, OS_TIMEOUT_NEVER);
-            lorawan_event_t txev = lorawan_wait_ev(_loraCtx.sock_tx, (LORAWAN_EVENT_ACK|LORAWAN_EVENT_ERROR|LORAWAN_EVENT_SENT), 
-                                _loraCtx.txTimeoutMS);
-            // process event
-            callTxCB(txev);
+// Rssi/snr of last packet received. Returns false (and 0/0) if the radio driver doesn't make them available
+static bool getLastRxQuality(int* rssi, int* snr) {
+#if MYNEWT_VAL(SX1272)
+    *rssi = SX1272.Settings.LoRaPacketHandler.RssiValue;
+    *snr = SX1272.Settings.LoRaPacketHandler.SnrValue;
+    return true;
+#else
+    *rssi = 0;
+    *snr = 0;
+    return false;
+#endif
+}
+
+// Get any DLs the stack has for us, waiting at most timeoutMS for the first one
+static void checkRx(uint32_t timeoutMS) {
+    uint32_t devAddr;
+    uint8_t port;
+    uint8_t rxsz;
+    while((rxsz = lorawan_recv(_loraCtx.sock_rx, &devAddr, &port, _loraCtx.rxBuf, MAX_RX_SZ, timeoutMS))>0) {
+        int rssi, snr;
+        bool qualityOk = getLastRxQuality(&rssi, &snr);
+        log_debug("LW: rx [%d] bytes port %d rssi %d snr %d", rxsz, port, rssi, snr);
+        if (qualityOk) {
+            // (a fake 0/0 would look like a big margin and push the auto SF too fast)
+            lora_api_link_noteDL(_loraCtx.txLoraWANReq.sf, rssi, snr);
         }
-        // TX done. try for an RX while we're here... 
-        if (_loraCtx.sock_rx>0) {
-            uint32_t devAddr;
-            uint8_t port;
-            uint8_t payload[256];
-            // Wait in theory for 18s as gotta wait for RX2 delay (up to 16s) + SF12 (2s)
-            uint8_t rxsz = lorawan_recv(_loraCtx.sock_rx, &devAddr, &port, payload, 255, 18000);
-            log_debug("LW: rx [%d] bytes", rxsz);
-            if (rxsz>0) {
-                // TODO need to get rssi, snr please!
-                callRxCB(port, payload, rxsz, 0, 0);
+        callRxCB(port, _loraCtx.rxBuf, rxsz, rssi, snr);
+        // more already received?
+        timeoutMS = RX_POLL_MS;
+    }
+}
+
+// Run by our task after an UL has been given to the stack : wait for the tx result, then for the RX windows to close
+static void txWaitEvent(struct os_event* e) {
+    TxLoraWanReq_t* req = &_loraCtx.txLoraWANReq;
+    lorawan_event_t txev = lorawan_wait_ev(_loraCtx.sock_tx, (LORAWAN_EVENT_ACK|LORAWAN_EVENT_ERROR|LORAWAN_EVENT_SENT), 
+                                _loraCtx.txTimeoutMS);
+    if (_loraCtx.sock_rx>0) {
+        uint32_t waitMS = RX_POLL_MS;
+        if (req->doRx && !(txev & (LORAWAN_EVENT_ACK|LORAWAN_EVENT_ERROR))) {
+            // DL may still come in RX2 : wait till it closes (ACK means the DL was already received in RX1)
+            // RX2 opens RX2_DELAY_MS after the end of the UL, and may hold a DL of the biggest size at SF12
+            uint32_t rx2CloseMS = lora_api_estimateToA(req->sf, req->sz) + RX2_DELAY_MS 
+                                    + lora_api_estimateToA(LORAWAN_SF12, RX2_MAX_DL_SZ);
+            uint32_t elapsed = TMMgr_getRelTimeMS() - req->txStartMS;
+            if (elapsed < rx2CloseMS) {
+                waitMS = rx2CloseMS - elapsed;
             }
         }
-        // If no socket open, then just wait (else we wait either for a tx or for an rx)
-        // this should never be the case as this layer always opens both tx and rx sockets
-        if (!(_loraCtx.sock_tx>0 || _loraCtx.sock_rx>0)) {
-            os_time_delay(OS_TICKS_PER_SEC*60);
-        }
+        checkRx(waitMS);
+    }
+    // RX2 closed, radio can go to sleep (or be used for a scheduled radio tx/rx)
+    lora_api_radio_lwEnd();
+    LPMgr_setLPMode(_loraCtx.lpUserId, LP_DEEPSLEEP);
+    // process event
+    callTxCB(txev);
+}
+
+static void loraapi_task(void* data) {
+    while(1) {
+        // Execute events for blocking calls on the stack
+        os_eventq_run(&_loraCtx.task_q);
     }
+    assert(0);
 }
@@ -0,0 +1,69 @@
+/**
+ * Copyright 2019 Wyres
+ * Licensed under the Apache License, Version 2.0 (the "License"); 
+ * you may not use this file except in compliance with the License. 
+ * You may obtain a copy of the License at
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, 
+ * software distributed under the License is distributed on 
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, 
+ * either express or implied. See the License for the specific 
+ * language governing permissions and limitations under the License.
+*/
+#ifndef H_LORAAPI_SIM_H
+#define H_LORAAPI_SIM_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include "loraapi/loraapi.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Control of the simulated lorawan network behind the loraapi_SIM implementation of the loraapi */
+typedef struct {
+    uint32_t joinLatencyMS;     // time from join request to join accept/fail
+    uint32_t rx1DelayMS;        // from end of UL to RX1
+    uint32_t rx2DelayMS;        // from end of UL to RX2
+    uint8_t dutyCyclePct;       // regulatory duty cycle : UL before the off time is over is rejected (0=no limit)
+    uint8_t dcRejectPct;        // % of ULs randomly rejected for duty cycle (eg network imposed)
+    uint8_t joinFailPct;        // % of join requests with no accept
+    uint8_t ackLossPct;         // % of confirmed ULs with no ACK
+    int16_t rssi;               // given to rx callbacks for DLs
+    int8_t snr;
+} LORA_SIM_CFG_t;
+
+typedef struct {
+    uint32_t nbJoin;
+    uint32_t nbJoinOK;
+    uint32_t nbUL;              // requests given to lora_api_send()
+    uint32_t nbULOK;
+    uint32_t nbDCReject;
+    uint32_t nbNoAck;
+    uint32_t nbDL;
+    uint32_t nbRadioTx;         // raw radio tx/rx done for lora_api_radio_tx/rx()
+    uint32_t nbRadioRx;         // (rx that got a packet)
+    uint32_t airtimeMS;         // total UL airtime
+    uint32_t sumLatencyMS;      // sum/max of times from lora_api_send() to its callback
+    uint32_t maxLatencyMS;
+} LORA_SIM_STATS_t;
+
+// Get/set the network conditions (initialised from syscfg)
+void lora_sim_getCfg(LORA_SIM_CFG_t* cfg);
+void lora_sim_setCfg(LORA_SIM_CFG_t* cfg);
+// Script a DL to be sent in the RX1 (or RX2) window of the next UL that does RX. Data is copied.
+// Returns LORAWAN_RES_OCC if too many DLs are already waiting, LORAWAN_RES_BADPARAM if too big.
+LORAWAN_RESULT_t lora_sim_addDL(uint8_t port, uint8_t* data, uint8_t sz, bool inRX2);
+// Script a packet to be received by the next raw radio rx (lora_api_radio_rx()). Data is copied.
+// Returns LORAWAN_RES_OCC if one is already waiting, LORAWAN_RES_BADPARAM if too big.
+LORAWAN_RESULT_t lora_sim_addRadioRx(uint8_t* data, uint8_t sz);
+void lora_sim_getStats(LORA_SIM_STATS_t* stats);
+void lora_sim_resetStats();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* H_LORAAPI_SIM_H */
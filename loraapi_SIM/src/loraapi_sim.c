@@ -0,0 +1,503 @@
+/**
+ * Copyright 2019 Wyres
+ * Licensed under the Apache License, Version 2.0 (the "License"); 
+ * you may not use this file except in compliance with the License. 
+ * You may obtain a copy of the License at
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, 
+ * software distributed under the License is distributed on 
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, 
+ * either express or implied. See the License for the specific 
+ * language governing permissions and limitations under the License.
+*/
+
+/* loraapi implementation with a simulated lorawan network, for running the app (and the UL queue) without radio/stack
+ (eg on the native bsp) under scripted network conditions :
+ - join accepted after a configured latency (or fails for a % of them)
+ - UL takes its airtime then waits for RX1 and RX2 delays (if doRx/reqAck) before the tx callback, as a class A device would
+ - ULs can be rejected for duty cycle (regulatory off time after each UL, or randomly for a %)
+ - scripted DLs are delivered in RX1 or RX2 of the next UL
+ - raw radio tx take their airtime, raw radio rx get a scripted packet (or time out)
+ Timing and results are counted in stats to measure latency/throughput of the app's use of the api.
+ Everything runs from a callout on the default eventq, no task required.
+ */
+#include <string.h>
+
+#include "os/os.h"
+
+#include "wyres-generic/wutils.h"
+#include "loraapi/loraapi.h"
+#include "loraapi/loraapi_ulq.h"
+#include "loraapi/loraapi_region.h"
+#include "loraapi/loraapi_radio.h"
+#include "loraapi/loraapi_link.h"
+#include "loraapi_sim/loraapi_sim.h"
+
+#define MAX_RXCBS   (2)
+#define MAX_DLS     MYNEWT_VAL(LORAAPI_SIM_MAX_DLS)
+#define MAX_DL_SZ   (64)
+
+typedef enum { SIM_IDLE, SIM_JOINING, SIM_TX_START, SIM_TX_RX1, SIM_TX_RX2 } SIM_STATE_t;
+
+typedef struct  {
+        LORAWAN_SF_t sf;
+        uint8_t port;
+        bool reqAck;
+        bool doRx;
+        uint8_t* data;
+        uint8_t sz;
+        uint32_t submitTSMS;
+        bool ackLost;
+        LORAWAN_TX_CB_t cbfn;
+        void* userctx;
+    } TxLoraWanReq_t;
+
+typedef struct  {
+        int port;       // as can be -1 to say all (app) ports
+        LORAWAN_RX_CB_t cbfn;
+        void* userctx;
+    } RxLoraWanReq_t;
+
+typedef struct {
+    bool used;
+    bool inRX2;
+    uint8_t port;
+    uint8_t sz;
+    uint8_t data[MAX_DL_SZ];
+} SimDL_t;
+
+static struct {
+    bool isInit;
+    bool isJoin;
+    LORAWAN_SF_t defaultSF;
+    int region;
+    const LORA_REGION_PARAMS_t* regionParams;
+    SIM_STATE_t state;
+    LORAWAN_JOIN_CB_t joinCB;
+    void* joinCtx;
+    TxLoraWanReq_t txReq;
+    RxLoraWanReq_t rxReqs[MAX_RXCBS];
+    SimDL_t dls[MAX_DLS];
+    SimDL_t radioRx;            // packet for the next raw radio rx
+    struct os_callout stepTimer;
+    struct os_callout radioTimer;
+    bool radioIsTx;             // raw radio tx/rx in progress
+    bool radioBusy;
+    uint8_t* radioData;
+    uint8_t radioSz;
+    uint32_t nextTxOKTSMS;      // end of duty cycle off time
+    uint32_t rand;
+    LORA_SIM_CFG_t cfg;
+    LORA_SIM_STATS_t stats;
+} _simCtx;
+
+static void simStep(struct os_event* ev);
+static void simRadioEnd(struct os_event* ev);
+
+static uint32_t nowMS() {
+    return os_time_ticks_to_ms32(os_time_get());
+}
+
+// Simple LCG is plenty for deciding if this one is lost
+static bool chance(uint8_t pct) {
+    _simCtx.rand = _simCtx.rand * 1103515245 + 12345;
+    return (((_simCtx.rand >> 16) % 100) < pct);
+}
+
+static void stepIn(uint32_t ms) {
+    os_callout_reset(&_simCtx.stepTimer, os_time_ms_to_ticks32(ms));
+}
+
+static uint8_t maxSz4SF(int sf) {
+    return lora_region_maxPayload(_simCtx.regionParams, sf, MYNEWT_VAL(LORAAPI_FOPTS_RESERVE));
+}
+
+static void callRxCBs(SimDL_t* dl) {
+    _simCtx.stats.nbDL++;
+    lora_api_link_noteDL(_simCtx.txReq.sf, _simCtx.cfg.rssi, _simCtx.cfg.snr);
+    for(int i=0;i<MAX_RXCBS;i++) {
+        if (_simCtx.rxReqs[i].cbfn!=NULL &&
+            (_simCtx.rxReqs[i].port==dl->port || _simCtx.rxReqs[i].port==-1)) {
+            (*_simCtx.rxReqs[i].cbfn)(_simCtx.rxReqs[i].userctx, LORAWAN_RES_OK, dl->port,
+                _simCtx.cfg.rssi, _simCtx.cfg.snr, dl->data, dl->sz);
+        }
+    }
+}
+
+// Deliver the first waiting DL for this window if any
+static bool deliverDL(bool rx2) {
+    for(int i=0;i<MAX_DLS;i++) {
+        if (_simCtx.dls[i].used && _simCtx.dls[i].inRX2==rx2) {
+            callRxCBs(&_simCtx.dls[i]);
+            _simCtx.dls[i].used = false;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void endTx(LORAWAN_RESULT_t res) {
+    TxLoraWanReq_t* req = &_simCtx.txReq;
+    uint32_t latency = nowMS() - req->submitTSMS;
+    _simCtx.stats.sumLatencyMS += latency;
+    if (latency > _simCtx.stats.maxLatencyMS) {
+        _simCtx.stats.maxLatencyMS = latency;
+    }
+    if (res==LORAWAN_RES_OK) {
+        _simCtx.stats.nbULOK++;
+    }
+    if (res==LORAWAN_RES_OK || res==LORAWAN_RES_NO_RESP) {
+        // it was sent
+        lora_api_link_noteUL(req->sf, req->reqAck, (res==LORAWAN_RES_OK));
+    }
+    _simCtx.state = SIM_IDLE;
+    lora_api_radio_lwEnd();
+    LORAWAN_TX_CB_t cbfn = req->cbfn;
+    req->cbfn = NULL;       // so app can do a tx in the cb
+    (*cbfn)(req->userctx, res);
+    // tx slot is free, next queued UL can go
+    lora_api_ulq_txFree();
+}
+
+static void simStep(struct os_event* ev) {
+    TxLoraWanReq_t* req = &_simCtx.txReq;
+    switch(_simCtx.state) {
+        case SIM_JOINING: {
+            _simCtx.state = SIM_IDLE;
+            lora_api_radio_lwEnd();
+            LORAWAN_RESULT_t res = LORAWAN_RES_NO_RESP;
+            if (!chance(_simCtx.cfg.joinFailPct)) {
+                _simCtx.isJoin = true;
+                _simCtx.stats.nbJoinOK++;
+                res = LORAWAN_RES_JOIN_OK;
+            }
+            log_debug("LWS: join %d", res);
+            if (_simCtx.joinCB!=NULL) {
+                LORAWAN_JOIN_CB_t cb = _simCtx.joinCB;
+                _simCtx.joinCB = NULL;
+                (*cb)(_simCtx.joinCtx, res);
+            }
+            // A tx may have been requested during the join
+            if (req->cbfn!=NULL) {
+                _simCtx.state = SIM_TX_START;
+                stepIn(0);
+            }
+            break;
+        }
+        case SIM_TX_START: {
+            uint32_t now = nowMS();
+            if (!_simCtx.isJoin) {
+                endTx(LORAWAN_RES_NOT_JOIN);
+                break;
+            }
+            if (!lora_api_radio_lwStart(lora_api_radio_lwExchangeMS(req->sf, req->sz, (req->doRx || req->reqAck), false))) {
+                // a raw radio slot has been scheduled since the request
+                endTx(LORAWAN_RES_OCC);
+                break;
+            }
+            if ((int32_t)(now - _simCtx.nextTxOKTSMS) < 0 || chance(_simCtx.cfg.dcRejectPct)) {
+                log_debug("LWS: tx DC reject");
+                _simCtx.stats.nbDCReject++;
+                endTx(LORAWAN_RES_DUTYCYCLE);
+                break;
+            }
+            uint32_t airtime = lora_api_estimateToA(req->sf, req->sz);
+            lora_region_noteTx(_simCtx.regionParams, 0, airtime);
+            _simCtx.stats.airtimeMS += airtime;
+            req->ackLost = (req->reqAck && chance(_simCtx.cfg.ackLossPct));
+            if (_simCtx.cfg.dutyCyclePct>0) {
+                _simCtx.nextTxOKTSMS = now + airtime + (airtime*(100-_simCtx.cfg.dutyCyclePct))/_simCtx.cfg.dutyCyclePct;
+            }
+            log_debug("LWS: tx %d bytes port %d sf %d : %dms", req->sz, req->port, req->sf, airtime);
+            if (req->doRx || req->reqAck) {
+                _simCtx.state = SIM_TX_RX1;
+                stepIn(airtime + _simCtx.cfg.rx1DelayMS);
+            } else {
+                // Just wait end of tx
+                _simCtx.state = SIM_TX_RX2;
+                stepIn(airtime);
+            }
+            break;
+        }
+        case SIM_TX_RX1: {
+            // Any ACK comes with the DL (if the network has one for us)
+            if (!req->ackLost && deliverDL(false)) {
+                endTx(LORAWAN_RES_OK);
+                break;
+            }
+            _simCtx.state = SIM_TX_RX2;
+            stepIn(_simCtx.cfg.rx2DelayMS - _simCtx.cfg.rx1DelayMS);
+            break;
+        }
+        case SIM_TX_RX2: {
+            if (req->cbfn==NULL) {
+                _simCtx.state = SIM_IDLE;
+                break;
+            }
+            if (req->ackLost) {
+                _simCtx.stats.nbNoAck++;
+                endTx(LORAWAN_RES_NO_RESP);
+            } else {
+                if (req->doRx || req->reqAck) {
+                    deliverDL(true);
+                }
+                endTx(LORAWAN_RES_OK);
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+/** API implementation */
+
+bool lora_api_isJoined() {
+    return _simCtx.isJoin;
+}
+
+LORAWAN_RESULT_t lora_api_join(LORAWAN_JOIN_CB_t callback, LORAWAN_SF_t sf, void* userctx) {
+    assert(callback!=NULL);
+    if (!_simCtx.isInit) {
+        return LORAWAN_RES_FWERR;
+    }
+    if (_simCtx.isJoin) {
+        return LORAWAN_RES_JOIN_OK;
+    }
+    if (_simCtx.joinCB!=NULL || _simCtx.state!=SIM_IDLE || _simCtx.radioBusy ||
+            !lora_api_radio_lwStart(lora_api_radio_lwExchangeMS(sf, 0, true, true))) {
+        return LORAWAN_RES_OCC;
+    }
+    _simCtx.defaultSF = sf;
+    _simCtx.joinCB = callback;
+    _simCtx.joinCtx = userctx;
+    _simCtx.stats.nbJoin++;
+    _simCtx.state = SIM_JOINING;
+    stepIn(_simCtx.cfg.joinLatencyMS);
+    return LORAWAN_RES_OK;
+}
+
+LORAWAN_RESULT_t lora_api_registerRxCB(int port, LORAWAN_RX_CB_t callback, void* userctx) {
+    assert(callback!=NULL);
+    assert(port!=0);        // not allowed to register for mac comands
+    for(int i=0;i<MAX_RXCBS;i++) {
+        if (_simCtx.rxReqs[i].cbfn==NULL) {
+            _simCtx.rxReqs[i].cbfn = callback;
+            _simCtx.rxReqs[i].userctx = userctx;
+            _simCtx.rxReqs[i].port = port;
+            return LORAWAN_RES_OK;
+        }
+    }
+    return LORAWAN_RES_OCC;
+}
+
+void lora_api_cancelRxCB(int port, LORAWAN_RX_CB_t callback) {
+    for(int i=0;i<MAX_RXCBS;i++) {
+        if (_simCtx.rxReqs[i].cbfn==callback &&
+            _simCtx.rxReqs[i].port==port) {
+            _simCtx.rxReqs[i].cbfn=NULL;
+            _simCtx.rxReqs[i].port=0;
+            return;
+        }
+    }
+}
+
+LORAWAN_RESULT_t lora_api_send(LORAWAN_SF_t sf, uint8_t port, bool reqAck, bool doRx,
+                uint8_t* data, uint8_t sz, LORAWAN_TX_CB_t callback, void* userctx) {
+    assert(callback!=NULL);
+    assert(data!=NULL);
+    if (!_simCtx.isInit) {
+        return LORAWAN_RES_FWERR;
+    }
+    if (sf==LORAWAN_SF_AUTO) {
+        sf = lora_api_link_getSF(false);        // no ADR in the sim
+    }
+    if (sf==LORAWAN_SF_DEFAULT || sf==LORAWAN_SF_USEADR) {
+        sf = _simCtx.defaultSF;
+    }
+    // Go faster rather than truncate if it doesn't fit in this SF
+    sf = lora_region_fitSF(_simCtx.regionParams, sf, sz, MYNEWT_VAL(LORAAPI_FOPTS_RESERVE));
+    if (sz>maxSz4SF(sf)) {
+        sz=maxSz4SF(sf);
+    }
+    if (_simCtx.txReq.cbfn!=NULL || !lora_api_radio_lwCanStart(lora_api_radio_lwExchangeMS(sf, sz, (doRx || reqAck), false))) {
+        return LORAWAN_RES_OCC;
+    }
+    TxLoraWanReq_t* req = &_simCtx.txReq;
+    req->cbfn = callback;
+    req->userctx = userctx;
+    req->sf = sf;
+    req->port = port;
+    req->reqAck = reqAck;
+    req->doRx = doRx;
+    req->data = data;
+    req->sz = sz;
+    req->submitTSMS = nowMS();
+    _simCtx.stats.nbUL++;
+    // If joining, tx starts once join is done
+    if (_simCtx.state==SIM_IDLE) {
+        _simCtx.state = SIM_TX_START;
+        stepIn(0);
+    }
+    return LORAWAN_RES_OK;
+}
+
+uint8_t lora_api_getMaxPayloadSz(LORAWAN_SF_t sf) {
+    if (sf==LORAWAN_SF_AUTO) {
+        sf = lora_api_link_getSF(false);        // no ADR in the sim
+    }
+    if (sf==LORAWAN_SF_DEFAULT || sf==LORAWAN_SF_USEADR) {
+        sf = _simCtx.defaultSF;
+    }
+    return maxSz4SF(sf);
+}
+
+// Raw radio access for the scheduled radio tx/rx
+bool lora_api_radio_hwAvailable() {
+    return true;
+}
+bool lora_api_radio_hwTx(uint32_t freq, LORAWAN_SF_t sf, int8_t power, uint8_t* data, uint8_t sz) {
+    if (_simCtx.state!=SIM_IDLE || _simCtx.radioBusy) {
+        return false;
+    }
+    uint32_t airtime = (lora_toa_us(sf, 125, 1, sz, true, true, 8) + 999)/1000;
+    _simCtx.stats.nbRadioTx++;
+    _simCtx.stats.airtimeMS += airtime;
+    _simCtx.radioBusy = true;
+    _simCtx.radioIsTx = true;
+    log_debug("LWS: radio tx %d bytes sf %d at %d : %dms", sz, sf, freq, airtime);
+    os_callout_reset(&_simCtx.radioTimer, os_time_ms_to_ticks32(airtime));
+    return true;
+}
+bool lora_api_radio_hwRx(uint32_t freq, LORAWAN_SF_t sf, uint32_t timeoutMS, uint8_t* data, uint8_t sz) {
+    if (_simCtx.state!=SIM_IDLE || _simCtx.radioBusy) {
+        return false;
+    }
+    _simCtx.radioBusy = true;
+    _simCtx.radioIsTx = false;
+    _simCtx.radioData = data;
+    _simCtx.radioSz = sz;
+    if (_simCtx.radioRx.used) {
+        // received once its airtime is over, if that's within the rx time
+        uint32_t airtime = (lora_toa_us(sf, 125, 1, _simCtx.radioRx.sz, true, true, 8) + 999)/1000;
+        if (airtime < timeoutMS) {
+            timeoutMS = airtime;
+        }
+    }
+    os_callout_reset(&_simCtx.radioTimer, os_time_ms_to_ticks32(timeoutMS));
+    return true;
+}
+
+static void simRadioEnd(struct os_event* ev) {
+    _simCtx.radioBusy = false;
+    if (_simCtx.radioIsTx) {
+        lora_api_radio_txDone(LORAWAN_RES_OK);
+    } else if (_simCtx.radioRx.used) {
+        uint8_t sz = (_simCtx.radioRx.sz < _simCtx.radioSz ? _simCtx.radioRx.sz : _simCtx.radioSz);
+        memcpy(_simCtx.radioData, _simCtx.radioRx.data, sz);
+        _simCtx.radioRx.used = false;
+        _simCtx.stats.nbRadioRx++;
+        lora_api_radio_rxDone(LORAWAN_RES_OK, _simCtx.cfg.rssi, _simCtx.cfg.snr, sz);
+    } else {
+        lora_api_radio_rxDone(LORAWAN_RES_TIMEOUT, 0, 0, 0);
+    }
+}
+
+int lora_api_getCurrentRegion() {
+    return _simCtx.region;
+}
+LORAWAN_RESULT_t lora_api_setCurrentRegion(int r) {
+    if (_simCtx.isJoin || r<0 || r>=LORAWAN_REGION_NB) {
+        return LORAWAN_RES_BADPARAM;
+    }
+    _simCtx.region = r;
+    _simCtx.regionParams = lora_region_get(r);
+    return LORAWAN_RES_OK;
+}
+
+bool lora_api_canDeepSleep() {
+    return (_simCtx.state==SIM_IDLE && !_simCtx.radioBusy);
+}
+void lora_api_deepSleep() {
+}
+void lora_api_wake() {
+}
+
+void lora_api_deinit(void) {
+    os_callout_stop(&_simCtx.stepTimer);
+    os_callout_stop(&_simCtx.radioTimer);
+    _simCtx.isInit = false;
+}
+
+void lora_api_init(uint8_t* devEUI, uint8_t* appEUI, uint8_t* appKey, bool enableADR, LORAWAN_SF_t defaultSF, int8_t defaultTxPower) {
+    memset(&_simCtx, 0, sizeof(_simCtx));
+    _simCtx.defaultSF = defaultSF;
+    _simCtx.region = LORAWAN_REGION_EU868;
+    _simCtx.regionParams = lora_region_get(_simCtx.region);
+    _simCtx.rand = MYNEWT_VAL(LORAAPI_SIM_SEED);
+    _simCtx.cfg.joinLatencyMS = MYNEWT_VAL(LORAAPI_SIM_JOIN_MS);
+    _simCtx.cfg.rx1DelayMS = MYNEWT_VAL(LORAAPI_SIM_RX1_MS);
+    _simCtx.cfg.rx2DelayMS = MYNEWT_VAL(LORAAPI_SIM_RX2_MS);
+    _simCtx.cfg.dutyCyclePct = MYNEWT_VAL(LORAAPI_SIM_DUTYCYCLE_PCT);
+    _simCtx.cfg.dcRejectPct = MYNEWT_VAL(LORAAPI_SIM_DC_REJECT_PCT);
+    _simCtx.cfg.joinFailPct = MYNEWT_VAL(LORAAPI_SIM_JOIN_FAIL_PCT);
+    _simCtx.cfg.ackLossPct = MYNEWT_VAL(LORAAPI_SIM_ACK_LOSS_PCT);
+    _simCtx.cfg.rssi = -90;
+    _simCtx.cfg.snr = 5;
+    lora_api_ulq_init();
+    lora_api_radio_init();
+    lora_api_link_init(defaultSF);
+    os_callout_init(&_simCtx.stepTimer, os_eventq_dflt_get(), simStep, NULL);
+    os_callout_init(&_simCtx.radioTimer, os_eventq_dflt_get(), simRadioEnd, NULL);
+    _simCtx.isInit = true;
+    log_info("LWS: simulated lorawan [%02x%02x%02x%02x%02x%02x%02x%02x] sf:%d",
+            devEUI[0],devEUI[1],devEUI[2],devEUI[3],devEUI[4],devEUI[5],devEUI[6],devEUI[7], defaultSF);
+}
+
+/** Simulation control */
+
+void lora_sim_getCfg(LORA_SIM_CFG_t* cfg) {
+    *cfg = _simCtx.cfg;
+}
+void lora_sim_setCfg(LORA_SIM_CFG_t* cfg) {
+    assert(cfg->rx2DelayMS >= cfg->rx1DelayMS);
+    _simCtx.cfg = *cfg;
+}
+
+LORAWAN_RESULT_t lora_sim_addDL(uint8_t port, uint8_t* data, uint8_t sz, bool inRX2) {
+    if (sz>MAX_DL_SZ) {
+        return LORAWAN_RES_BADPARAM;
+    }
+    for(int i=0;i<MAX_DLS;i++) {
+        SimDL_t* dl = &_simCtx.dls[i];
+        if (!dl->used) {
+            dl->port = port;
+            dl->sz = sz;
+            dl->inRX2 = inRX2;
+            memcpy(dl->data, data, sz);
+            dl->used = true;
+            return LORAWAN_RES_OK;
+        }
+    }
+    return LORAWAN_RES_OCC;
+}
+
+LORAWAN_RESULT_t lora_sim_addRadioRx(uint8_t* data, uint8_t sz) {
+    if (sz>MAX_DL_SZ) {
+        return LORAWAN_RES_BADPARAM;
+    }
+    if (_simCtx.radioRx.used) {
+        return LORAWAN_RES_OCC;
+    }
+    _simCtx.radioRx.sz = sz;
+    memcpy(_simCtx.radioRx.data, data, sz);
+    _simCtx.radioRx.used = true;
+    return LORAWAN_RES_OK;
+}
+
+void lora_sim_getStats(LORA_SIM_STATS_t* stats) {
+    *stats = _simCtx.stats;
+}
+void lora_sim_resetStats() {
+    memset(&_simCtx.stats, 0, sizeof(_simCtx.stats));
+}
@@ -11,13 +11,19 @@
  * language governing permissions and limitations under the License.
 */
 
-/* loraapi implmementation using direct access to the stackforce apis. */
+/* loraapi implmementation using direct access to the stackforce apis. 
+ LoRaMac owns the radio driver events, so raw radio access is not possible alongside it : lora_api_radio_tx/rx requests 
+ are refused immediately (return NULL) and no slot is reserved */
 #include <string.h>
 
 #include "os/os.h"
 
 #include "wyres-generic/wutils.h"
 #include "loraapi/loraapi.h"
+#include "loraapi/loraapi_ulq.h"
+#include "loraapi/loraapi_region.h"
+#include "loraapi/loraapi_radio.h"
+#include "loraapi/loraapi_link.h"
 #include "LoRaMac.h"
 
 #define LORAAPI_TASK_PRIO       MYNEWT_VAL(LORAAPI_TASK_PRIO)
@@ -25,15 +31,14 @@
 
 // How many people can wait for something at same time? also indicates how many outstanding requests can exist together
 #define MAX_RXCBS   (2)         // can register 2 rx callbacks on different ports
-#define MAX_TXRADIOCBS   (1)    // as not yet implemented
-#define MAX_RXRADIOCBS   (1)    // or maybe coz don't need this fn
 #define MAX_LORA_DATA_SZ (250)
+#define FOPTS_RESERVE   MYNEWT_VAL(LORAAPI_FOPTS_RESERVE)
 
 #define MAX_LWEVTS  (4)     // only 4 outstanding lorawan->task events at any time
 
 typedef enum { LWEVT_TYPE_UNUSED, 
     LWEVT_TYPE_MCPS_CONFIRM, LWEVT_TYPE_MCPS_INDICATION, LWEVT_TYPE_MLME_CONFIRM, LWEVT_TYPE_MLME_INDICATION,
-    LWEVT_TYPE_DOJOIN, LWEVT_TYPE_DOTXLW, LWEVT_TYPE_DOTXRADIO, LWEVT_TYPE_DORXRADIO
+    LWEVT_TYPE_DOJOIN, LWEVT_TYPE_DOTXLW
  } LWEVT_TYPE_t;
 typedef struct {
     LWEVT_TYPE_t type;
@@ -70,39 +75,15 @@ typedef struct  {
         void* userctx;
     } RxLoraWanReq_t;
 
-typedef struct  {
-        struct os_callout timer;
-        uint32_t atTxMS;
-        int8_t power;
-        uint32_t freq;
-        LORAWAN_SF_t sf;
-        uint8_t* data;
-        uint8_t sz;
-        LORAWAN_TX_CB_t cbfn;
-        void* userctx;        
-    } TxRadioReq_t;
-
-typedef struct  {
-        struct os_callout timer;
-        uint32_t atRxMS;
-        uint32_t tRxMS;
-        uint32_t freq;
-        LORAWAN_SF_t sf;
-        uint8_t* data;
-        uint8_t sz;
-        LORAWAN_RX_CB_t cbfn;
-        void* userctx;        
-    } RxRadioReq_t;
-
 static struct loraapi_ctx {
     bool isJoin;
     LORAWAN_SF_t defaultSF;
     int defaultLWPower;
+    int region;
+    const LORA_REGION_PARAMS_t* regionParams;
     JoinReq_t joinLoraWANReq;
     TxLoraWanReq_t txLoraWANReq;
     RxLoraWanReq_t rxLoraWANReqs[MAX_RXCBS];
-    TxRadioReq_t txRadioReqs[MAX_TXRADIOCBS];
-    RxRadioReq_t rxRadioReqs[MAX_RXRADIOCBS];
     uint8_t deveui[8];
     uint8_t appeui[8];
     uint8_t appkey[16];
@@ -118,14 +99,11 @@ static struct loraapi_ctx {
     uint32_t noEventCnt;        // could each time we have event pool starvation
 } _loraCtx;     // Note : initialised to all 0 in init method
 
-static struct os_event* allocEvent();
+static struct os_event* allocEvent(LWEVT_TYPE_t type);
 static void freeEvent(struct os_event* e);
 static void loraapi_task(void* data);
 static void execStackEvent(struct os_event* e);
 static void execTxLora(struct os_event* e);
-static void execTxRadio(struct os_event* e);
-static void execRxRadio(struct os_event* e);
-static uint32_t getNowMS();
 static uint8_t maxSz4SF(int sf);
 
 /** API implementation */
@@ -147,10 +125,9 @@ LORAWAN_RESULT_t lora_api_join(LORAWAN_JOIN_CB_t callback, LORAWAN_SF_t sf, void
         _loraCtx.joinLoraWANReq.cbfn = callback;
         _loraCtx.joinLoraWANReq.userctx = userctx;
         // kick off join request
-        struct os_event* e = allocEvent();
+        struct os_event* e = allocEvent(LWEVT_TYPE_DOJOIN);
         if (e!=NULL) {
             LWEVT_t* evt = (LWEVT_t*)e->ev_arg;
-            evt->type = LWEVT_TYPE_DOJOIN;
             os_eventq_put(&_loraCtx.lwevt_q, e);
             return LORAWAN_RES_OK;
         } else {
@@ -187,12 +164,23 @@ LORAWAN_RESULT_t lora_api_send(LORAWAN_SF_t sf, uint8_t port, bool reqAck, bool
                 uint8_t* data, uint8_t sz, LORAWAN_TX_CB_t callback, void* userctx) {
     assert(callback!=NULL);
     assert(data!=NULL);
+    if (sf==LORAWAN_SF_AUTO) {
+        sf = lora_api_link_getSF(false);
+    }
     if (sf==LORAWAN_SF_DEFAULT) {
         sf = _loraCtx.defaultSF;
     }
+    if (sf!=LORAWAN_SF_USEADR) {
+        // Go faster rather than truncate if it doesn't fit in this SF
+        sf = lora_region_fitSF(_loraCtx.regionParams, sf, sz, FOPTS_RESERVE);
+    }
     if (sz>maxSz4SF(sf)) {
         sz=maxSz4SF(sf);
     }
+    // Would it run into a scheduled radio tx/rx? (LoRaMac always opens the RX windows)
+    if (!lora_api_radio_lwCanStart(lora_api_radio_lwExchangeMS(sf, sz, true, false))) {
+        return LORAWAN_RES_OCC;
+    }
     // Check for a free slot
     if (_loraCtx.txLoraWANReq.cbfn==NULL) {
         _loraCtx.txLoraWANReq.cbfn = callback;
@@ -204,10 +192,9 @@ LORAWAN_RESULT_t lora_api_send(LORAWAN_SF_t sf, uint8_t port, bool reqAck, bool
         _loraCtx.txLoraWANReq.sz = sz;
         _loraCtx.txLoraWANReq.doRx = doRx;
         _loraCtx.txLoraWANReq.reqAck = reqAck;
-        struct os_event* e = allocEvent();
+        struct os_event* e = allocEvent(LWEVT_TYPE_DOTXLW);
         if (e!=NULL) {
             LWEVT_t* evt = (LWEVT_t*)e->ev_arg;
-            evt->type = LWEVT_TYPE_DOTXLW;
             os_eventq_put(&_loraCtx.lwevt_q, e);
             return LORAWAN_RES_OK;
         } else {
@@ -220,83 +207,33 @@ LORAWAN_RESULT_t lora_api_send(LORAWAN_SF_t sf, uint8_t port, bool reqAck, bool
     return LORAWAN_RES_OCC;
 }
 
-// Schedule direct radio tx access for specific time
-LORAWAN_REQ_ID_t lora_api_radio_tx(uint32_t abs_time, LORAWAN_SF_t sf, uint32_t freq, int txpower, uint8_t* data, uint8_t sz, LORAWAN_TX_CB_t callback, void* userctx) {
-    assert(callback!=NULL);
-    assert(data!=NULL);
-    // Check for a free slot
-    for(int i=0;i<MAX_TXRADIOCBS;i++) {
-        TxRadioReq_t* req = &_loraCtx.txRadioReqs[i];
-        if (req->cbfn==NULL) {
-            req->cbfn = callback;
-            req->userctx = userctx;
-            req->data = data;
-            req->sz = sz;
-            req->sf = sf;
-            req->freq = freq;
-            req->power = txpower;
-            req->atTxMS = abs_time;
-
-            // TODO : check time is after now, and no other radio request using it....
-            os_callout_reset(&req->timer, os_time_ms_to_ticks32(abs_time - getNowMS()));
-
-            return req;
-        }
+// Max app payload for an UL at this SF
+uint8_t lora_api_getMaxPayloadSz(LORAWAN_SF_t sf) {
+    if (sf==LORAWAN_SF_AUTO) {
+        sf = lora_api_link_getSF(false);
     }
-    return NULL;
-}
-// Schedule direct radio rx access for specific time
-LORAWAN_REQ_ID_t lora_api_radio_rx(uint32_t abs_time, LORAWAN_SF_t sf, uint32_t freq, uint32_t timeoutms, uint8_t* data, uint8_t sz, LORAWAN_RX_CB_t callback, void* userctx) {
-    assert(callback!=NULL);
-    assert(data!=NULL);
-    // Check for a free slot
-    for(int i=0;i<MAX_RXCBS;i++) {
-        RxRadioReq_t* req = &_loraCtx.rxRadioReqs[i];
-        if (req->cbfn==NULL) {
-            req->cbfn = callback;
-            req->userctx = userctx;
-            req->data = data;
-            req->sz = sz;
-            req->sf = sf;
-            req->freq = freq;
-            req->atRxMS = abs_time;
-            req->tRxMS = timeoutms;
-            // TODO : check time is after now, and no other radio request using it....
-            os_callout_reset(&req->timer, os_time_ms_to_ticks32(abs_time - getNowMS()));
-
-            return req;
-        }
+    if (sf==LORAWAN_SF_DEFAULT) {
+        sf = _loraCtx.defaultSF;
     }
-    return NULL;
-}
-
-// Cancel a pending request. True if cancelled without action, false if already in progress and cannot be cancelled
-bool lora_api_cancel(LORAWAN_REQ_ID_t id) {
-    // TODO - find req in one of the lists, cancel it
-    return true;
+    return maxSz4SF(sf);
 }
 
-
 // Internals
 
-// get OS ms since boot
-static uint32_t getNowMS() {
-    return os_time_ticks_to_ms32(os_time_get());
-}
-// TODO use stack regional params functions to find max pkt size per SF per region
+// Max app payload for the SF in the current region (ADR : the slowest DR's)
 static uint8_t maxSz4SF(int sf) {
-    return 52;
+    return lora_region_maxPayload(_loraCtx.regionParams, sf, FOPTS_RESERVE);
 }
 
-static struct os_event* allocEvent() {
+static struct os_event* allocEvent(LWEVT_TYPE_t type) {
     // Find an unused one in list
     struct os_event* ret = NULL;
     // mutex access to this list for concurrent calls to allocEvent
     os_mutex_pend(&_loraCtx.lwevts_mutex, OS_TIMEOUT_NEVER);
     for(int i=0;i<MAX_LWEVTS;i++) {
         if (_loraCtx.lwevts[i].lwevt.type==LWEVT_TYPE_UNUSED) {
-            // flag in use
-            _loraCtx.lwevts[i].lwevt.type = LWEVT_TYPE_UNUSED;
+            // flag in use (with its type) before releasing the mutex
+            _loraCtx.lwevts[i].lwevt.type = type;
             ret = &_loraCtx.lwevts[i].e;
             break;
         }
@@ -320,24 +257,21 @@ static void loraapi_task(void* data) {
 }
 
 static int mapSF2DR(int sf) {
-    switch(sf) {
-        case LORAWAN_SF12: 
-            return 0;
-        case LORAWAN_SF11: 
-            return 1;
-        case LORAWAN_SF10: 
-            return 2;
-        case LORAWAN_SF9: 
-            return 3;
-        case LORAWAN_SF8: 
-            return 4;
-        case LORAWAN_SF7: 
-            return 5;
-        case LORAWAN_FSK250: 
-            return 6;
-        default:
-            return 5;
+    if (sf==LORAWAN_SF_USEADR || sf==LORAWAN_SF_DEFAULT) {
+        sf = _loraCtx.defaultSF;
     }
+    return lora_region_sf2DR(_loraCtx.regionParams, sf);
+}
+// SF the stack uses for this UL : the requested one, or the stack's current DR's with ADR (SF12 worst case if it can't say)
+static LORAWAN_SF_t ulSF(LORAWAN_SF_t sf) {
+    if (sf==LORAWAN_SF_USEADR || sf==LORAWAN_SF_DEFAULT) {
+        MibRequestConfirm_t mibReq;
+        mibReq.Type = MIB_CHANNELS_DATARATE;
+        if (LoRaMacMibGetRequestConfirm(&mibReq)==LORAMAC_STATUS_OK) {
+            return lora_region_DR2sf(_loraCtx.regionParams, mibReq.Param.ChannelsDatarate);
+        }
+    }
+    return sf;
 }
 /*
 static bool lora_check_send(uint8_t sz, LORAWAN_SF_t sf) {
@@ -397,23 +331,23 @@ static void execStackEvent(struct os_event* e) {
             McpsConfirm_t* McpsConfirm = &evt->msg.mcpsc;
             // Confirmation of sending of app level message
             log_debug("MCPSconfirm: tx status %d, %d\r\n", McpsConfirm->Status,McpsConfirm->AckReceived);
-            // find guy who ordered this tx and callback with result. As the stack doesn't take a context, we have to set flags (ick)
-            for(int i=0;i<MAX_TXCBS;i++) {
-                if (_loraCtx.txLoraWANReqs[i].txInProgress) {
-                    // record bits we need before doing callback, as this allows caller to immediately re-schedule a send and use same slot
-                    LORAWAN_TX_CB_t cb = _loraCtx.txLoraWANReqs[i].cbfn;
-                    void* userctx = _loraCtx.txLoraWANReqs[i].userctx;
-                    _loraCtx.txLoraWANReqs[i].txInProgress = false;
-                    _loraCtx.txLoraWANReqs[i].cbfn = NULL;
-                    // sucess?
-                    if (McpsConfirm->Status == LORAMAC_EVENT_INFO_STATUS_OK) {
-                        (*cb)(userctx, (LORAWAN_REQ_ID_t*)&_loraCtx.txLoraWANReqs[i],
-                            LORAWAN_RES_OK);
-                    } else {
-                        (*cb)(userctx, (LORAWAN_REQ_ID_t*)&_loraCtx.txLoraWANReqs[i],
-                            LORAWAN_RES_HWERR);
-                    }
+            // callback the guy who ordered this tx with result. As the stack doesn't take a context, we have to set flags (ick)
+            if (_loraCtx.txLoraWANReq.txInProgress) {
+                lora_api_link_noteUL(_loraCtx.txLoraWANReq.sf, _loraCtx.txLoraWANReq.reqAck, McpsConfirm->AckReceived);
+                // record bits we need before doing callback, as this allows caller to immediately re-schedule a send and use same slot
+                LORAWAN_TX_CB_t cb = _loraCtx.txLoraWANReq.cbfn;
+                void* userctx = _loraCtx.txLoraWANReq.userctx;
+                _loraCtx.txLoraWANReq.txInProgress = false;
+                _loraCtx.txLoraWANReq.cbfn = NULL;
+                lora_api_radio_lwEnd();
+                // sucess?
+                if (McpsConfirm->Status == LORAMAC_EVENT_INFO_STATUS_OK) {
+                    (*cb)(userctx, LORAWAN_RES_OK);
+                } else {
+                    (*cb)(userctx, LORAWAN_RES_HWERR);
                 }
+                // tx slot is free, next queued UL can go
+                lora_api_ulq_txFree();
             }
             break;
         }
@@ -448,6 +382,7 @@ static void execStackEvent(struct os_event* e) {
         lorawan_printf("\r\n");
     }
 #endif
+                lora_api_link_noteDL(_loraCtx.txLoraWANReq.sf, McpsIndication->Rssi, McpsIndication->Snr);
                 if( McpsIndication->Port != 0 ){
                     /* Search for a valid callbacks to forward payload */
                     for(int i=0;i<MAX_RXCBS;i++) {
@@ -472,6 +407,7 @@ static void execStackEvent(struct os_event* e) {
             switch(MlmeConfirm->MlmeRequest) {
                 case MLME_JOIN: {
                     LORAWAN_RESULT_t res = LORAWAN_RES_NO_RESP;
+                    lora_api_radio_lwEnd();
                     if (MlmeConfirm->Status == LORAMAC_EVENT_INFO_STATUS_OK) {
                         log_debug("Join Accepted\r\n");
                         _loraCtx.isJoin = true;
@@ -504,11 +440,17 @@ static void execStackEvent(struct os_event* e) {
 
         // Not strictly a stack upcall event..
         case LWEVT_TYPE_DOJOIN: {
-            // try to send a JOIN request
-            if (lora_join(_loraCtx.deveui, _loraCtx.appeui, _loraCtx.appkey, _loraCtx.defaultSF)) {
+            // try to send a JOIN request, if a radio tx/rx slot doesn't need the radio before the join accept windows are closed
+            if (!lora_api_radio_lwStart(lora_api_radio_lwExchangeMS(_loraCtx.defaultSF, 0, true, true))) {
+                if (_loraCtx.joinLoraWANReq.cbfn!=NULL) {
+                    (_loraCtx.joinLoraWANReq.cbfn)(_loraCtx.joinLoraWANReq.userctx, LORAWAN_RES_OCC);
+                    _loraCtx.joinLoraWANReq.cbfn=NULL;
+                }
+            } else if (lora_join(_loraCtx.deveui, _loraCtx.appeui, _loraCtx.appkey, _loraCtx.defaultSF)) {
                 // in progress
             } else {
                 // oopsie
+                lora_api_radio_lwEnd();
                 // tell awaiting joiner
                 if (_loraCtx.joinLoraWANReq.cbfn!=NULL) {
                     (_loraCtx.joinLoraWANReq.cbfn)(_loraCtx.joinLoraWANReq.userctx, LORAWAN_RES_DUTYCYCLE);
@@ -520,20 +462,33 @@ static void execStackEvent(struct os_event* e) {
         case LWEVT_TYPE_DOTXLW: {
             TxLoraWanReq_t* req = &_loraCtx.txLoraWANReq;
             if (req->cbfn!=NULL) {
-                if (lora_api_isJoined()) {
+                if (!lora_api_radio_lwStart(lora_api_radio_lwExchangeMS(req->sf, req->sz, true, false))) {
+                    // a radio tx/rx slot needs the radio before the RX windows would be closed
+                    LORAWAN_TX_CB_t cbfn = req->cbfn;
+                    req->cbfn=NULL;
+                    (cbfn)(req->userctx, LORAWAN_RES_OCC);
+                    lora_api_ulq_txFree();
+                } else if (lora_api_isJoined()) {
                     // try to send UL request
                     if (lora_send(req->data,req->sz, req->port, req->sf, req->reqAck)) {
                         // in progress
+                        req->txInProgress = true;
+                        lora_region_noteTx(_loraCtx.regionParams, 0, lora_api_estimateToA(ulSF(req->sf), req->sz));
                     } else {
+                        lora_api_radio_lwEnd();
                         // oopsie
-                        // tell awaiting txer
-                        (req->cbfn)(req->userctx, LORAWAN_RES_DUTYCYCLE);
+                        // tell awaiting txer (slot freed first so he can retry in the callback)
+                        LORAWAN_TX_CB_t cbfn = req->cbfn;
                         req->cbfn=NULL;
+                        (cbfn)(req->userctx, LORAWAN_RES_DUTYCYCLE);
+                        lora_api_ulq_txFree();
                     }
                 } else {
-                    (req->cbfn)(req->userctx, LORAWAN_RES_NOT_JOIN);
+                    lora_api_radio_lwEnd();
+                    LORAWAN_TX_CB_t cbfn = req->cbfn;
                     req->cbfn=NULL;
-
+                    (cbfn)(req->userctx, LORAWAN_RES_NOT_JOIN);
+                    lora_api_ulq_txFree();
                 }
             }
             break;
@@ -546,31 +501,28 @@ static void execStackEvent(struct os_event* e) {
     freeEvent(e);
 }
 
-static void execTxRadio(struct os_event* e) {
-    TxRadioReq_t* req = (TxRadioReq_t*)(e->ev_arg);
-    // do send now
-    // TODO
-    // if fails tell sender the result
-    (*req->cbfn)(req->userctx, (LORAWAN_REQ_ID_t*)req, LORAWAN_RES_OCC);
-    // else we'll tell when radio send done
+// Raw radio access for the scheduled radio tx/rx : LoRaMac has the radio events (and would open its RX windows after our tx),
+// so none are scheduled
+bool lora_api_radio_hwAvailable() {
+    return false;
+}
+bool lora_api_radio_hwTx(uint32_t freq, LORAWAN_SF_t sf, int8_t power, uint8_t* data, uint8_t sz) {
+    log_warn("LW:DRTX not possible with LoRaMac");
+    return false;
 }
-static void execRxRadio(struct os_event* e) {
-    RxRadioReq_t* req = (RxRadioReq_t*)(e->ev_arg);
-    // do rx now
-    // if fails tell caller the result
-    (*req->cbfn)(req->userctx, (LORAWAN_REQ_ID_t*)req, LORAWAN_RES_OCC, 0, 0, 0, NULL, 0);
-    // else we'll tell when radio done (rx or timeout)   
+bool lora_api_radio_hwRx(uint32_t freq, LORAWAN_SF_t sf, uint32_t timeoutMS, uint8_t* data, uint8_t sz) {
+    log_warn("LW:DRRX not possible with LoRaMac");
+    return false;
 }
 
 /**** Lorawan stack api callbacks. These are just copied into events and posted for execution by the task. */
 /* Primitive definitions used by the LoRaWAN */
 static void _mcps_confirm ( McpsConfirm_t *McpsConfirm ){
-    struct os_event* e = allocEvent();
+    struct os_event* e = allocEvent(LWEVT_TYPE_MCPS_CONFIRM);
     if (e!=NULL) {
         LWEVT_t* evt = (LWEVT_t*)e->ev_arg;
         // copy what stack gave us as only valid during this function
         memcpy(&evt->msg.mcpsc, McpsConfirm, sizeof(McpsConfirm_t));
-        evt->type = LWEVT_TYPE_MCPS_CONFIRM;
         os_eventq_put(&_loraCtx.lwevt_q, e);
     } else {
         // oopsie
@@ -580,12 +532,11 @@ static void _mcps_confirm ( McpsConfirm_t *McpsConfirm ){
 
 // Downlink
 static void _mcps_indication ( McpsIndication_t *McpsIndication ){
-    struct os_event* e = allocEvent();
+    struct os_event* e = allocEvent(LWEVT_TYPE_MCPS_INDICATION);
     if (e!=NULL) {
         LWEVT_t* evt = (LWEVT_t*)e->ev_arg;
         // copy what stack gave us as only valid during this function
         memcpy(&evt->msg.mcpsi, McpsIndication, sizeof(McpsIndication_t));
-        evt->type = LWEVT_TYPE_MCPS_INDICATION;
         os_eventq_put(&_loraCtx.lwevt_q, e);
     } else {
         // oopsie
@@ -595,12 +546,11 @@ static void _mcps_indication ( McpsIndication_t *McpsIndication ){
 
 // Confirmation of WAN MAC level request
 static void _mlme_confirm( MlmeConfirm_t *MlmeConfirm ) {
-    struct os_event* e = allocEvent();
+    struct os_event* e = allocEvent(LWEVT_TYPE_MLME_CONFIRM);
     if (e!=NULL) {
         LWEVT_t* evt = (LWEVT_t*)e->ev_arg;
         // copy what stack gave us as only valid during this function
         memcpy(&evt->msg.mlmec, MlmeConfirm, sizeof(MlmeConfirm_t));
-        evt->type = LWEVT_TYPE_MLME_CONFIRM;
         os_eventq_put(&_loraCtx.lwevt_q, e);
     } else {
         // oopsie
@@ -610,12 +560,11 @@ static void _mlme_confirm( MlmeConfirm_t *MlmeConfirm ) {
 }
 
 static void _mlme_indication( MlmeIndication_t *MlmeIndication ){
-    struct os_event* e = allocEvent();
+    struct os_event* e = allocEvent(LWEVT_TYPE_MLME_INDICATION);
     if (e!=NULL) {
         LWEVT_t* evt = (LWEVT_t*)e->ev_arg;
         // copy what stack gave us as only valid during this function
         memcpy(&evt->msg.mlmei, MlmeIndication, sizeof(MlmeIndication_t));
-        evt->type = LWEVT_TYPE_MLME_INDICATION;
         os_eventq_put(&_loraCtx.lwevt_q, e);
     } else {
         // oopsie
@@ -645,6 +594,27 @@ static LoRaMacRegion_t lorawan_get_first_active_region( void ){
     return 0;
 }
 
+// Get current lora region
+int lora_api_getCurrentRegion() {
+    return _loraCtx.region;
+}
+
+// Set a new region (before JOIN). If the region has not been compiled into this firmware, an error is returned.
+LORAWAN_RESULT_t lora_api_setCurrentRegion(int r) {
+    if (r==_loraCtx.region) {
+        return LORAWAN_RES_OK;
+    }
+    if (_loraCtx.isJoin || !RegionIsActive(r)) {
+        return LORAWAN_RES_BADPARAM;
+    }
+    if (LoRaMacInitialization(&_lorawan_primitives, &_lorawan_callbacks, r)!=LORAMAC_STATUS_OK) {
+        return LORAWAN_RES_FWERR;
+    }
+    _loraCtx.region = r;
+    _loraCtx.regionParams = lora_region_get(r);
+    return LORAWAN_RES_OK;
+}
+
 /*** initialisation */
 // initialise lorawan stack with our config. Called by application before using stack.
 void lora_api_init(uint8_t* devEUI, uint8_t* appEUI, uint8_t* appKey) {
@@ -664,19 +634,14 @@ void lora_api_init(uint8_t* devEUI, uint8_t* appEUI, uint8_t* appKey) {
     _loraCtx.defaultLWPower = 14;            // TODO - max for the region or ADRised
     // init events (mutex, q, each event in the pool)
     os_mutex_init(&_loraCtx.lwevts_mutex);
+    lora_api_ulq_init();
     for(int i=0;i<MAX_LWEVTS;i++) {
         _loraCtx.lwevts[i].e.ev_cb = &execStackEvent;
         _loraCtx.lwevts[i].e.ev_arg = &(_loraCtx.lwevts[i].lwevt);
         _loraCtx.lwevts[i].lwevt.type = LWEVT_TYPE_UNUSED;
     }
-    for(int i=0;i<MAX_TXRADIOCBS;i++) {
-        TxRadioReq_t* req = &_loraCtx.txRadioReqs[i];
-        os_callout_init(&req->timer, &_loraCtx.lwevt_q, execTxRadio, req);    
-    }
-    for(int i=0;i<MAX_RXRADIOCBS;i++) {
-        RxRadioReq_t* req = &_loraCtx.rxRadioReqs[i];
-        os_callout_init(&req->timer, &_loraCtx.lwevt_q, execRxRadio, req);    
-    }
+    lora_api_radio_init();
+    lora_api_link_init(_loraCtx.defaultSF);
     os_eventq_init(&_loraCtx.lwevt_q);
     os_task_init(&_loraCtx.loraapi_task_str, "lw_eventq",
                  loraapi_task, NULL,
@@ -685,8 +650,10 @@ void lora_api_init(uint8_t* devEUI, uint8_t* appEUI, uint8_t* appKey) {
                  LORAAPI_TASK_STACK_SZ);
 
     // Initialise stackforce lorawan stack
+    _loraCtx.region = lorawan_get_first_active_region();
+    _loraCtx.regionParams = lora_region_get(_loraCtx.region);
     LoRaMacStatus_t status = LoRaMacInitialization(&_lorawan_primitives, &_lorawan_callbacks,
-                                   lorawan_get_first_active_region());
+                                   _loraCtx.region);
     assert(status==LORAMAC_STATUS_OK);
 }
 